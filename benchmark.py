@@ -0,0 +1,114 @@
+"""benchmark.py
+
+Times lazysorted on typical workloads, against sorting the whole list with the
+builtin sorted. It's also the training workload for the profile guided build,
+(python setup.py build_optimized), so it should exercise the code paths that
+matter in practice: native and python comparisons, selection, slices,
+iteration, searching and the batched functions.
+
+Usage: python benchmark.py [--quick]
+"""
+
+from __future__ import print_function
+
+import random
+import sys
+import time
+from array import array
+
+from lazysorted import LazySorted, group_select, median_many
+
+try:
+    xrange
+except NameError:
+    xrange = range
+
+
+def median(ls):
+    return ls[len(ls) // 2]
+
+
+def quantiles(ls):
+    return [ls[len(ls) * q // 10] for q in xrange(10)]
+
+
+def top(ls):
+    return ls[:10]
+
+
+def iterate(ls):
+    for i, x in enumerate(ls):
+        if i == 1000:
+            break
+
+
+def trimmed(ls):
+    n = len(ls)
+    if isinstance(ls, LazySorted):
+        return ls.between(n // 20, n - n // 20)
+    return ls[n // 20:n - n // 20]
+
+
+def search(ls):
+    n = len(ls)
+    return [ls.index(ls[k]) for k in xrange(0, n, n // 20)]
+
+
+def workloads(n):
+    """Yields (name, data, use, baseline) for each benchmark, where use(data)
+    does the work with lazysorted, and baseline(data) does it by sorting, (or
+    is None if there's no equivalent)"""
+    floats = [random.random() for _ in xrange(n)]
+    ints = [random.randrange(n) for _ in xrange(n)]
+    strs = [str(x) for x in floats]
+    pairs = [(x, str(x)) for x in ints[:n // 4]]
+
+    for name, data, key in [("floats", floats, None), ("ints", ints, None),
+                            ("strs", strs, None), ("key", pairs,
+                                                   lambda p: p[1])]:
+        for query in [median, quantiles, top, iterate, trimmed, search]:
+            yield ("%s %s" % (name, query.__name__), data,
+                   lambda d, q=query, k=key: q(LazySorted(d, key=k)),
+                   lambda d, q=query, k=key: q(sorted(d, key=k)))
+
+    yield ("buffer keys median", array('d', floats),
+           lambda d: median(LazySorted(xrange(len(d)), keys=d)),
+           lambda d: median(sorted(d)))
+
+    ids = array('l', [random.randrange(n // 100) for _ in xrange(n)])
+    yield ("group_select", (floats, ids),
+           lambda d: group_select(d[0], d[1], [0.5, 0.9]),
+           None)
+
+    groups = [floats[i:i + 100] for i in xrange(0, n, 100)]
+    yield ("median_many", groups,
+           lambda d: median_many(d),
+           lambda d: [median(sorted(g)) for g in d])
+
+
+def best_time(func, data, repeat):
+    best = float("inf")
+    for _ in xrange(repeat):
+        start = time.time()
+        func(data)
+        best = min(best, time.time() - start)
+    return best
+
+
+def main():
+    quick = "--quick" in sys.argv[1:]
+    n, repeat = (20000, 1) if quick else (200000, 5)
+    random.seed(0)
+
+    print("%-24s %12s %12s" % ("benchmark", "lazysorted", "sorted"))
+    for name, data, use, baseline in workloads(n):
+        if baseline is None:
+            sorted_time = "-"
+        else:
+            sorted_time = "%.2fms" % (1000 * best_time(baseline, data, repeat))
+        print("%-24s %10.2fms %12s" % (
+            name, 1000 * best_time(use, data, repeat), sorted_time))
+
+
+if __name__ == "__main__":
+    main()
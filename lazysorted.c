@@ -1,6 +1,12 @@
 /* LazySorted objects */
 
 #include <Python.h>
+#include <datetime.h>
+#define LAZYSORTED_MODULE
+#include "lazysorted.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
 
 /* Parameters for the sorting function */
@@ -14,13 +20,36 @@
  * CONTIG_THRESH should always be bigger than SORT_THRESH */
 #define CONTIG_THRESH 32
 
+/* READAHEAD_*: After READAHEAD_TRIGGER lookups of consecutive indices, in
+ * either direction, sort the next READAHEAD_MIN items in that direction in one
+ * go, and twice as many each time the run reaches the end of what has been
+ * sorted, up to READAHEAD_MAX */
+#define READAHEAD_TRIGGER 3
+#define READAHEAD_MIN 64
+#define READAHEAD_MAX 65536
+
 /* Macro definitions to deal different python versions */
 #if PY_MAJOR_VERSION >= 3
 #define PyString_FromString PyUnicode_FromString
 #define PyString_Format PyUnicode_Format
+#define PyString_FromFormat PyUnicode_FromFormat
 #define PyInt_FromSsize_t PyLong_FromSsize_t
 #endif
 
+#if PY_VERSION_HEX < 0x02070000
+static PY_LONG_LONG
+PyLong_AsLongLongAndOverflow(PyObject *v, int *overflow)
+{
+    PY_LONG_LONG res = PyLong_AsLongLong(v);
+    *overflow = 0;
+    if (res == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        *overflow = 1;
+    }
+    return res;
+}
+#endif
+
 #if PY_VERSION_HEX < 0x03020000
 #define PySlice_GetIndicesEx(item,                                   \
                              length, start, stop, step, slicelength) \
@@ -42,25 +71,263 @@
 #define Py_TYPE(ob)             (((PyObject*)(ob))->ob_type)
 #endif
 
+/* PyCapsules, for the C API, are new in python2.7 and python3.1 */
+#if PY_VERSION_HEX >= 0x03010000 ||                                     \
+    (PY_MAJOR_VERSION == 2 && PY_VERSION_HEX >= 0x02070000)
+#define HAVE_CAPSULE
+#endif
+
+#if PY_VERSION_HEX < 0x03020000
+typedef long Py_hash_t;
+#endif
+
+#ifndef Py_SET_SIZE
+#define Py_SET_SIZE(ob, size)   (Py_SIZE(ob) = (size))
+#endif
+
 /* Macros to support different compilers */
 #if !(defined(__GNUC__) || defined(__clang__))
 #define __builtin_prefetch(x)
 #endif
 
+/* Storage for the arrays that the kernels and tree searches run over: the
+ * native keys, the weights and the pivot arena.
+ *
+ * Each block is 64 byte aligned, so that it starts on a cache line. Blocks of
+ * HUGE_STORAGE_MIN bytes or more are also mapped straight from the kernel in
+ * whole huge pages where that's possible, (on Linux), since partitioning a
+ * big list otherwise touches a new 4k page, and so misses the TLB, every few
+ * hundred items. Explicit huge pages, (MAP_HUGETLB), are tried first, which
+ * only works if the administrator has reserved some, and then transparent
+ * huge pages, (MADV_HUGEPAGE). If neither works the block comes from
+ * PyMem_Malloc like everything else, so nothing fails for lack of them.
+ *
+ * Only the explicit huge pages are sure to be huge pages. Transparent ones
+ * are just advice, which the kernel takes if they're enabled and it can find
+ * the memory, (see AnonHugePages in /proc/self/smaps), so they are reported
+ * separately.
+ *
+ * The header before each block says where it came from, so that it can be
+ * given back, and what kind of pages it's on, (see storage_pages). */
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#if defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE)
+#define HAVE_HUGE_STORAGE 1
+#endif
+#endif
+
+#define STORAGE_ALIGN 64
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define HUGE_STORAGE_MIN ((size_t)4 << 20)
+
+/* The kinds of pages a block can be on */
+#define PAGES_MALLOC 0          /* Whatever PyMem_Malloc gave */
+#define PAGES_HUGETLB 1         /* Explicit huge pages */
+#define PAGES_ADVISED 2         /* Advised to be transparent huge pages */
+
+typedef struct {
+    void *base;                 /* The start of the allocation */
+    size_t mapped;              /* Bytes mapped at base, or 0 if malloced */
+    size_t size;                /* Bytes asked for */
+    int pages;                  /* One of PAGES_* */
+} StorageHeader;
+
+#define STORAGE_HEADER(p) ((StorageHeader *)(p) - 1)
+
+#ifdef HAVE_HUGE_STORAGE
+/* Maps size bytes, (a multiple of HUGE_PAGE_SIZE), on huge pages, and
+ * returns them or NULL if the kernel won't. The kind of pages they're on goes
+ * in pages. */
+static void *
+map_huge(size_t size, int *pages)
+{
+    void *base;
+
+#ifdef MAP_HUGETLB
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base != MAP_FAILED) {
+        *pages = PAGES_HUGETLB;
+        return base;
+    }
+#endif
+
+#ifdef MADV_HUGEPAGE
+    /* Transparent huge pages only back whole aligned huge pages, so map one
+     * extra and trim the ends off to align it */
+    char *raw = (char *)mmap(NULL, size + HUGE_PAGE_SIZE,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == (char *)MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1)
+                             & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    if (raw + HUGE_PAGE_SIZE > aligned)
+        munmap(aligned + size, raw + HUGE_PAGE_SIZE - aligned);
+    if (madvise(aligned, size, MADV_HUGEPAGE) == 0) {
+        *pages = PAGES_ADVISED;
+        return aligned;
+    }
+    munmap(aligned, size);
+#endif
+
+    return NULL;
+}
+#endif
+
+/* Returns a 64 byte aligned block of size bytes, or NULL if there's no
+ * memory, (without setting an exception, like PyMem_Malloc) */
+static void *
+storage_malloc(size_t size)
+{
+    StorageHeader header;
+    char *base;
+    char *p;
+
+    header.size = size;
+    header.mapped = 0;
+    header.pages = PAGES_MALLOC;
+
+#ifdef HAVE_HUGE_STORAGE
+    if (size >= HUGE_STORAGE_MIN &&
+        size <= (size_t)PY_SSIZE_T_MAX - 2 * HUGE_PAGE_SIZE) {
+        size_t mapped = (size + STORAGE_ALIGN + HUGE_PAGE_SIZE - 1)
+                        & ~(HUGE_PAGE_SIZE - 1);
+        base = (char *)map_huge(mapped, &header.pages);
+        if (base != NULL) {
+            header.base = base;
+            header.mapped = mapped;
+            p = base + STORAGE_ALIGN;
+            *STORAGE_HEADER(p) = header;
+            return p;
+        }
+    }
+#endif
+
+    if (size > (size_t)PY_SSIZE_T_MAX - sizeof(StorageHeader)
+               - STORAGE_ALIGN)
+        return NULL;
+    base = (char *)PyMem_Malloc(size + sizeof(StorageHeader) + STORAGE_ALIGN);
+    if (base == NULL)
+        return NULL;
+    header.base = base;
+    p = (char *)(((uintptr_t)(base + sizeof(StorageHeader))
+                  + STORAGE_ALIGN - 1) & ~(uintptr_t)(STORAGE_ALIGN - 1));
+    *STORAGE_HEADER(p) = header;
+    return p;
+}
+
+static void
+storage_free(void *p)
+{
+    if (p == NULL)
+        return;
+    StorageHeader *header = STORAGE_HEADER(p);
+#ifdef HAVE_HUGE_STORAGE
+    if (header->mapped > 0) {
+        munmap(header->base, header->mapped);
+        return;
+    }
+#endif
+    PyMem_Free(header->base);
+}
+
+/* Like PyMem_Realloc, but the block moves even if it's shrinking, since the
+ * new size might want a different kind of memory */
+static void *
+storage_realloc(void *p, size_t size)
+{
+    void *q = storage_malloc(size);
+    if (q == NULL || p == NULL)
+        return q;
+    size_t old = STORAGE_HEADER(p)->size;
+    memcpy(q, p, old < size ? old : size);
+    storage_free(p);
+    return q;
+}
+
+/* Returns the bytes that the block at p takes up: the whole mapping if it
+ * was mapped, and otherwise the size asked for, (like the rest of the memory
+ * accounting, this leaves out the allocator's overhead, which here includes
+ * the header and the alignment) */
+static Py_ssize_t
+storage_bytes(const void *p)
+{
+    const StorageHeader *header = (const StorageHeader *)p - 1;
+    if (p == NULL)
+        return 0;
+    return (Py_ssize_t)(header->mapped > 0 ? header->mapped : header->size);
+}
+
+/* Returns the bytes that the block at p takes up if it's on pages of the
+ * given kind, (see PAGES_*), and 0 if it isn't */
+static Py_ssize_t
+storage_pages(const void *p, int pages)
+{
+    const StorageHeader *header = (const StorageHeader *)p - 1;
+    return p != NULL && header->pages == pages ? storage_bytes(p) : 0;
+}
+
 /* Definitions and functions for the binary search tree of pivot points.
  * The BST implementation is a Treap, selected because of its general speed,
  * especially when inserting and removing elements, which happens a lot in this
- * application. */
-
-typedef struct PivotNode {
-    Py_ssize_t idx;             /* The index it represents */
-    int flags;                  /* Descriptors of the data between pivots */
-    int priority;               /* Priority in the Treap */
-    struct PivotNode *left;
-    struct PivotNode *right;
-    struct PivotNode *parent;
+ * application.
+ *
+ * The nodes live in an arena and refer to each other by their 32 bit position
+ * in it rather than by pointer, and the pivot indices are 32 bits too, which
+ * makes a node 20 bytes instead of 48, (plus malloc overhead), so much more of
+ * the tree stays in cache while searching it. Lists with 2**31 or more items
+ * keep the high halves of their pivot indices in a separate array instead, so
+ * that the common case doesn't pay for the rare one.
+ *
+ * When the list has native keys, each node also keeps a copy of its pivot's
+ * key right after it in the arena, so that searching the tree by key, (for
+ * index, count, in and bisect), compares against the nodes themselves rather
+ * than reaching into the much bigger native key array for every step.
+ *
+ * When the items have weights, each pivot also knows the total weight of the
+ * items before it, (in cum, which is kept separately like idx_hi), so that
+ * weighted quantiles can be found by searching the tree. */
+
+typedef uint32_t Pivot;         /* The position of a node in the arena */
+#define NO_PIVOT ((Pivot)0xFFFFFFFFu)
+
+typedef struct {
+    int32_t idx;                /* The index it represents, (see PIVOT_IDX) */
+    uint32_t meta;              /* Flags in the low two bits, priority above */
+    Pivot left;
+    Pivot right;
+    Pivot parent;
 } PivotNode;
 
+/* A node with its pivot's native key. The key is split in two so that the
+ * node stays four byte aligned, and 28 rather than 32 bytes. */
+typedef struct {
+    PivotNode node;
+    uint32_t key[2];
+} KeyedPivotNode;
+
+typedef struct {
+    PivotNode *nodes;           /* The arena */
+    size_t stride;              /* The size of a node in the arena */
+    const void *source;         /* Native keys to copy into nodes, or NULL */
+    int width;                  /* Bytes per source key, (see native_key) */
+    int64_t base;               /* What narrow source keys are offsets from */
+    Py_ssize_t length;          /* Length of the list, (the last pivot) */
+    const double *weights;      /* Weights of the items, or NULL */
+    double *cum;                /* Weights of the items before each pivot */
+    int32_t *idx_hi;            /* High halves of the indices, or NULL */
+    int wide;                   /* 1 if the indices need idx_hi */
+    Pivot root;
+    Pivot free;                 /* Unused nodes, linked through parent */
+    Pivot used;                 /* Nodes that have ever been handed out */
+    Pivot allocated;            /* Nodes the arena has room for */
+    Pivot count;                /* Nodes in the tree */
+} PivotTree;
+
 /* SORTED_RIGHT means the pivot is to the right of a sorted region.
  * SORTED_LEFT means the pivot is the left of a sorted region */
 #define SORTED_RIGHT 1
@@ -68,43 +335,193 @@ typedef struct PivotNode {
 #define UNSORTED 0
 #define SORTED_BOTH 3
 
+#define NODE(tree, p) (*(PivotNode *)((char *)(tree)->nodes +  \
+                                      (size_t)(p) * (tree)->stride))
+#define PIVOT_IDX(tree, p) (!(tree)->wide ?            \
+                            (Py_ssize_t)NODE(tree, p).idx : wide_idx(tree, p))
+#define PIVOT_FLAGS(tree, p) ((int)(NODE(tree, p).meta & SORTED_BOTH))
+#define PIVOT_PRIORITY(tree, p) (NODE(tree, p).meta >> 2)
+#define ADD_FLAGS(tree, p, f) (NODE(tree, p).meta |= (uint32_t)(f))
+#define CLEAR_FLAGS(tree, p, f) (NODE(tree, p).meta &= ~(uint32_t)(f))
+
+/* Detects runs of sequential single index lookups, (see READAHEAD_*) */
+typedef struct {
+    Py_ssize_t last;            /* The last index looked up */
+    int dir;                    /* 1 or -1 in a run, 0 otherwise */
+    Py_ssize_t run;             /* Lookups so far in the run */
+    Py_ssize_t size;            /* The size of the next readahead */
+    Py_ssize_t lo, hi;          /* The range sorted by the last readahead */
+} ReadAhead;
+
+/* A slot of the membership index, (see build_hash_index) */
+typedef struct {
+    PyObject *item;             /* Borrowed from xs, or NULL if empty */
+    Py_hash_t hash;
+    Py_ssize_t count;           /* The number of items equal to item */
+} HashEntry;
+
 /* The LazySorted object */
 typedef struct {
     PyObject_HEAD
     PyListObject        *xs;            /* Partially sorted list */
-    PivotNode           *root;          /* Root of the pivot BST */
+    PyListObject        *keys;          /* Keys of xs, or NULL if no key */
+    int                 lazykeys;       /* 1 if keys are computed lazily */
+    Py_ssize_t          key_budget;     /* Bytes lazy keys may use */
+    Py_ssize_t          key_bytes;      /* Bytes lazy keys are using */
+    void                *nkeys;         /* Native keys of xs, or NULL */
+    int                 nwidth;         /* Bytes per native key */
+    int64_t             nbase;          /* What narrow keys are offsets from */
+    double              *weights;       /* Weights of xs, or NULL */
+    double              total_weight;   /* Their sum */
+    int                 nkind;          /* What the native keys represent */
+    PivotTree           pivots;         /* The pivot BST */
+    Py_ssize_t          max_pivots;     /* Pivot budget, or -1 for none */
+    ReadAhead           readahead;      /* For lookups by index */
+    Py_ssize_t          hash_after;     /* Queries before hashing, or -1 */
+    Py_ssize_t          hash_queries;   /* in and count queries so far */
+    HashEntry           *hash_table;    /* The membership index, or NULL */
+    size_t              hash_mask;      /* Its size minus one */
     PyObject            *keyfunc;       /* The key function */
+    PyObject            *batchkey;      /* The batch key function */
+    int                 givenkeys;      /* 1 if the keys were passed in */
     int                 reverse;        /* 1 for reverse order */
+    int                 nanmode;        /* Where NaN keys go, (see below) */
+    Py_ssize_t          nan_count;      /* Number of items with NaN keys */
+    int                 nullmode;       /* Where nulls go, (see below) */
+    Py_ssize_t          null_count;     /* Number of null items */
+    int                 outarray;       /* 1 to return ranges as arrays */
+    Py_buffer           *records;       /* Rows of from_records, or NULL */
+    Py_ssize_t          record_size;    /* Bytes in each of those rows */
 } LSObject;
 
 static PyTypeObject LS_Type;
 #define LSObject_Check(v)      (Py_TYPE(v) == &LS_Type)
 
-/* Returns the next (bigger) pivot, or NULL if it's the last pivot */
-PivotNode *
-next_pivot(PivotNode *current)
+/* The items that are compared when sorting: the keys if there are any, and
+ * the items of xs themselves otherwise. Swaps in xs must be mirrored here. */
+#define LS_KEYS(ls) ((ls)->keys != NULL ? (ls)->keys->ob_item  \
+                                        : (ls)->xs->ob_item)
+
+/* The kinds of native keys. When every key has an exact int64 representation
+ * that sorts the same way the key does, (after accounting for reverse), the
+ * keys are converted once and compared natively instead of through python.
+ * All of the time-like kinds are in microseconds. */
+#define NATIVE_NONE 0
+#define NATIVE_INT 1
+#define NATIVE_DATETIME 2       /* Naive datetimes */
+#define NATIVE_DATETIME_UTC 3   /* Datetimes with tzinfo=timezone.utc */
+#define NATIVE_DATE 4
+#define NATIVE_TIMEDELTA 5
+#define NATIVE_FLOAT 6          /* Floats, and ints that floats hold exactly */
+
+/* What to do with NaN keys. By default they are compared like any other key,
+ * which leaves them, (and everything around them), in no sensible order. With
+ * nan='last' or nan='drop', float keys are totally ordered: NaNs get the
+ * native key NAN_KEY, which sorts after every other float whether or not the
+ * order is reversed, and 'drop' then removes them from the list entirely. */
+#define NAN_UNORDERED 0
+#define NAN_LAST 1
+#define NAN_DROP 2
+#define NAN_KEY INT64_MAX
+
+/* What to do with the items that a validity mask, (mask=), marks as null. By
+ * default they are dropped, like nan='drop' drops NaNs. With nulls='first' or
+ * nulls='last' they get the native key NULL_FIRST or NULL_LAST instead, which
+ * sort before or after every other key whether or not the order is reversed,
+ * so those two keys can't also be the keys of valid items, (except that NaNs
+ * with nan='last' tie with nulls='last'). */
+#define NULLS_NONE 0            /* No mask */
+#define NULLS_DROP 1
+#define NULLS_FIRST 2
+#define NULLS_LAST 3
+#define NULL_FIRST INT64_MIN
+#define NULL_LAST INT64_MAX
+
+static Py_ssize_t
+wide_idx(PivotTree *tree, Pivot p)
+{
+    return (Py_ssize_t)((int64_t)tree->idx_hi[p] * ((int64_t)1 << 32)
+                        + (uint32_t)NODE(tree, p).idx);
+}
+
+/* Returns the native key at index i of keys, which are int64s if width is 8,
+ * and otherwise unsigned offsets from base of width bytes */
+static inline int64_t
+load_native(const void *keys, int width, int64_t base, Py_ssize_t i)
+{
+    switch (width) {
+    case 1:
+        return (int64_t)((uint64_t)base + ((const uint8_t *)keys)[i]);
+    case 2:
+        return (int64_t)((uint64_t)base + ((const uint16_t *)keys)[i]);
+    case 4:
+        return (int64_t)((uint64_t)base + ((const uint32_t *)keys)[i]);
+    default:
+        return ((const int64_t *)keys)[i];
+    }
+}
+
+/* The native keys are int64s while the object is being built. Then if they
+ * span less than 2**32 they are narrowed, (see narrow_native_keys), to
+ * unsigned offsets from the smallest of them in 4, 2 or 1 bytes each, so
+ * that the kernels move and compare less memory. This reads one back as an
+ * int64. */
+static inline int64_t
+native_key(const LSObject *ls, Py_ssize_t i)
+{
+    return load_native(ls->nkeys, ls->nwidth, ls->nbase, i);
+}
+
+static void
+set_pivot_idx(PivotTree *tree, Pivot p, Py_ssize_t k)
+{
+    NODE(tree, p).idx = (int32_t)(uint32_t)((int64_t)k & 0xFFFFFFFF);
+    if (tree->wide)
+        tree->idx_hi[p] = (int32_t)(((int64_t)k - (uint32_t)NODE(tree, p).idx)
+                                    / ((int64_t)1 << 32));
+    if (tree->source != NULL && k >= 0 && k < tree->length) {
+        int64_t key = load_native(tree->source, tree->width, tree->base, k);
+        memcpy(((KeyedPivotNode *)&NODE(tree, p))->key, &key, sizeof(key));
+    }
+}
+
+/* Returns the native key of the pivot p, which must be in a keyed tree, and
+ * not one of the pivots at either end */
+static int64_t
+pivot_key(PivotTree *tree, Pivot p)
+{
+    int64_t key;
+    assert(tree->source != NULL);
+    memcpy(&key, ((KeyedPivotNode *)&NODE(tree, p))->key, sizeof(key));
+    return key;
+}
+
+/* Returns the next (bigger) pivot, or NO_PIVOT if it's the last pivot */
+static Pivot
+next_pivot(PivotTree *tree, Pivot current)
 {
-    PivotNode *curr = current;
-    if (curr->right != NULL) {
-        curr = curr->right;
-        while (curr->left != NULL) {
-            curr = curr->left;
+    Pivot curr = current;
+    if (NODE(tree, curr).right != NO_PIVOT) {
+        curr = NODE(tree, curr).right;
+        while (NODE(tree, curr).left != NO_PIVOT) {
+            curr = NODE(tree, curr).left;
         }
     }
     else {
-        while (curr->parent != NULL && curr->parent->idx < curr->idx) {
-            curr = curr->parent;
+        while (NODE(tree, curr).parent != NO_PIVOT &&
+               NODE(tree, NODE(tree, curr).parent).right == curr) {
+            curr = NODE(tree, curr).parent;
         }
 
-        if (curr->parent == NULL) {
-            return NULL;
+        if (NODE(tree, curr).parent == NO_PIVOT) {
+            return NO_PIVOT;
         }
         else {
-            curr = curr->parent;
+            curr = NODE(tree, curr).parent;
         }
     }
 
-    assert(curr->idx > current->idx);
+    assert(PIVOT_IDX(tree, curr) > PIVOT_IDX(tree, current));
     return curr;
 }
 
@@ -114,112 +531,177 @@ next_pivot(PivotNode *current)
  * nodes whose future parents don't know them yet, like in merge_trees(.) */
 #ifndef NDEBUG
 static void
-assert_node(PivotNode *node)
+assert_node(PivotTree *tree, Pivot node)
 {
-    if (node->left != NULL) {
-        assert(node->left->idx < node->idx);
-        assert(node->left->priority <= node->priority);
-        assert(node->left->parent == node);
-        assert_node(node->left);
+    Pivot left = NODE(tree, node).left;
+    Pivot right = NODE(tree, node).right;
+    if (left != NO_PIVOT) {
+        assert(PIVOT_IDX(tree, left) < PIVOT_IDX(tree, node));
+        assert(PIVOT_PRIORITY(tree, left) <= PIVOT_PRIORITY(tree, node));
+        assert(NODE(tree, left).parent == node);
+        assert_node(tree, left);
     }
-    if (node->right != NULL) {
-        assert(node->right->idx > node->idx);
-        assert(node->right->priority <= node->priority);
-        assert(node->right->parent == node);
-        assert_node(node->right);
+    if (right != NO_PIVOT) {
+        assert(PIVOT_IDX(tree, right) > PIVOT_IDX(tree, node));
+        assert(PIVOT_PRIORITY(tree, right) <= PIVOT_PRIORITY(tree, node));
+        assert(NODE(tree, right).parent == node);
+        assert_node(tree, right);
     }
 }
 
 /* A series of assert statements that the tree structure is consistent */
 static void
-assert_tree(PivotNode *root)
+assert_tree(PivotTree *tree)
 {
-    assert(root != NULL);
-    assert(root->parent == NULL);
-    assert_node(root);
+    assert(tree->root != NO_PIVOT);
+    assert(NODE(tree, tree->root).parent == NO_PIVOT);
+    assert_node(tree, tree->root);
 }
 
 /* A series of assert statements that the tree's flags are consistent */
 static void
-assert_tree_flags(PivotNode *root)
-{
-    PivotNode *prev = NULL;
-    PivotNode *curr = root;
-    while (curr->left != NULL)
-        curr = curr->left;
-    while (curr != NULL) {
-        if (curr->flags & SORTED_LEFT)
-            assert(next_pivot(curr)->flags & SORTED_RIGHT);
-        if (curr->flags & SORTED_RIGHT)
-            assert(prev->flags & SORTED_LEFT);
+assert_tree_flags(PivotTree *tree)
+{
+    Pivot prev = NO_PIVOT;
+    Pivot curr = tree->root;
+    while (NODE(tree, curr).left != NO_PIVOT)
+        curr = NODE(tree, curr).left;
+    while (curr != NO_PIVOT) {
+        if (PIVOT_FLAGS(tree, curr) & SORTED_LEFT)
+            assert(PIVOT_FLAGS(tree, next_pivot(tree, curr)) & SORTED_RIGHT);
+        if (PIVOT_FLAGS(tree, curr) & SORTED_RIGHT)
+            assert(PIVOT_FLAGS(tree, prev) & SORTED_LEFT);
 
         prev = curr;
-        curr = next_pivot(curr);
+        curr = next_pivot(tree, curr);
     }
 }
 #else
 /* Silences -Wunused-parameter */
-#define assert_node(x)
-#define assert_tree(x)
-#define assert_tree_flags(x)
+#define assert_node(t, x)
+#define assert_tree(t)
+#define assert_tree_flags(t)
 #endif
 
+/* Returns an unused node from the arena, or NO_PIVOT on error */
+static Pivot
+new_node(PivotTree *tree)
+{
+    Pivot node;
+
+    if (tree->free != NO_PIVOT) {
+        node = tree->free;
+        tree->free = NODE(tree, node).parent;
+        tree->count++;
+        return node;
+    }
 
-/* Inserts an index, returning a pointer to the node, or NULL on error.
- * *root is the root of the tree, while start is the node to insert from.
- */
-static PivotNode *insert_pivot(Py_ssize_t, int, PivotNode **, PivotNode *)
+    if (tree->used == tree->allocated) {
+        if (tree->allocated >= NO_PIVOT / 2) {
+            PyErr_NoMemory();
+            return NO_PIVOT;
+        }
+        Pivot allocated = tree->allocated == 0 ? 8 : tree->allocated * 2;
+        PivotNode *nodes = (PivotNode *)storage_realloc(
+            tree->nodes, allocated * tree->stride);
+        if (nodes == NULL) {
+            PyErr_NoMemory();
+            return NO_PIVOT;
+        }
+        tree->nodes = nodes;
+        if (tree->wide) {
+            int32_t *idx_hi = (int32_t *)storage_realloc(
+                tree->idx_hi, allocated * sizeof(int32_t));
+            if (idx_hi == NULL) {
+                PyErr_NoMemory();
+                return NO_PIVOT;
+            }
+            tree->idx_hi = idx_hi;
+        }
+        if (tree->weights != NULL) {
+            double *cum = (double *)storage_realloc(tree->cum,
+                                                    allocated
+                                                    * sizeof(double));
+            if (cum == NULL) {
+                PyErr_NoMemory();
+                return NO_PIVOT;
+            }
+            tree->cum = cum;
+        }
+        tree->allocated = allocated;
+    }
+
+    tree->count++;
+    return tree->used++;
+}
+
+static void
+free_node(PivotTree *tree, Pivot node)
+{
+    NODE(tree, node).parent = tree->free;
+    tree->free = node;
+    tree->count--;
+}
+
+/* Inserts an index, returning its node, or NO_PIVOT on error.
+ * start is the node to insert from. */
+static Pivot insert_pivot(PivotTree *, Py_ssize_t, int, Pivot)
 Py_GCC_ATTRIBUTE((warn_unused_result));
 
-static PivotNode *
-insert_pivot(Py_ssize_t k, int flags, PivotNode **root, PivotNode *start)
+static Pivot
+insert_pivot(PivotTree *tree, Py_ssize_t k, int flags, Pivot start)
 {
-    /* Build the node */
-    PivotNode *node = (PivotNode *)PyMem_Malloc(sizeof(PivotNode));
-    if (node == NULL)
-        return (PivotNode *)PyErr_NoMemory();
-    node->idx = k;
-    node->flags = flags;
-    node->priority = rand();
-    node->left = NULL;
-    node->right = NULL;
+    /* Build the node. Nothing may hold on to positions in the arena across
+     * this, since it can move the arena. */
+    Pivot node = new_node(tree);
+    if (node == NO_PIVOT)
+        return NO_PIVOT;
+    set_pivot_idx(tree, node, k);
+    NODE(tree, node).meta = ((uint32_t)rand() << 2) | flags;
+    NODE(tree, node).left = NO_PIVOT;
+    NODE(tree, node).right = NO_PIVOT;
 
     /* Special case the empty tree */
-    if (*root == NULL) {
-        node->parent = NULL;
-        *root = node;
+    if (tree->root == NO_PIVOT) {
+        NODE(tree, node).parent = NO_PIVOT;
+        tree->root = node;
         return node;
     }
 
     /* Put the node in its sorted order */
-    PivotNode *current = start;
+    Pivot current = start;
     while (1) {
-        if (current->idx < k) {
-            if (current->right == NULL) {
-                current->right = node;
-                node->parent = current;
+        if (PIVOT_IDX(tree, current) < k) {
+            if (NODE(tree, current).right == NO_PIVOT) {
+                NODE(tree, current).right = node;
+                NODE(tree, node).parent = current;
                 break;
             }
-            current = current->right;
+            current = NODE(tree, current).right;
         }
-        else if (current->idx > k) {
-            if (current->left == NULL) {
-                current->left = node;
-                node->parent = current;
+        else if (PIVOT_IDX(tree, current) > k) {
+            if (NODE(tree, current).left == NO_PIVOT) {
+                NODE(tree, current).left = node;
+                NODE(tree, node).parent = current;
                 break;
             }
-            current = current->left;
+            current = NODE(tree, current).left;
         }
         else {
             /* The pivot BST should always have unique pivots */
+            free_node(tree, node);
             PyErr_SetString(PyExc_SystemError, "All pivots must be unique");
-            return NULL;
+            return NO_PIVOT;
         }
     }
 
     /* Reestablish the treap invariant if necessary by tree rotations */
-    PivotNode *child, *parent, *grandparent;
-    while (node->priority > node->parent->priority) {
+    Pivot child, parent, grandparent;
+    while (PIVOT_PRIORITY(tree, node) >
+           PIVOT_PRIORITY(tree, NODE(tree, node).parent)) {
+        parent = NODE(tree, node).parent;
+        grandparent = NODE(tree, parent).parent;
+
         /*          (parent)    (node)
          *            /              \
          *           /                \
@@ -229,17 +711,10 @@ insert_pivot(Py_ssize_t k, int flags, PivotNode **root, PivotNode *start)
          *         \                   /
          *       (child)            (child)
          */
-        if (node->idx < node->parent->idx) {
-            child = node->right;
-            parent = node->parent;
-            grandparent = parent->parent;
-
-            node->parent = grandparent;
-            node->right = parent;
-            parent->parent = node;
-            parent->left = child;
-            if (child != NULL)
-                child->parent = parent;
+        if (NODE(tree, parent).left == node) {
+            child = NODE(tree, node).right;
+            NODE(tree, node).right = parent;
+            NODE(tree, parent).left = child;
         }
         /* (parent)                (node)
          *      \                   /
@@ -251,230 +726,227 @@ insert_pivot(Py_ssize_t k, int flags, PivotNode **root, PivotNode *start)
          *    (child)           (child)
          */
         else {
-            child = node->left;
-            parent = node->parent;
-            grandparent = parent->parent;
-
-            node->parent = grandparent;
-            node->left = parent;
-            parent->parent = node;
-            parent->right = child;
-            if (child != NULL)
-                child->parent = parent;
-        }
-
-        /* Adjust node->parent's child pointer to point to node */
-        if (node->parent != NULL) {
-            if (k < node->parent->idx) {
-                node->parent->left = node;
+            child = NODE(tree, node).left;
+            NODE(tree, node).left = parent;
+            NODE(tree, parent).right = child;
+        }
+        NODE(tree, node).parent = grandparent;
+        NODE(tree, parent).parent = node;
+        if (child != NO_PIVOT)
+            NODE(tree, child).parent = parent;
+
+        /* Adjust grandparent's child link to point to node */
+        if (grandparent != NO_PIVOT) {
+            if (NODE(tree, grandparent).left == parent) {
+                NODE(tree, grandparent).left = node;
             }
             else {
-                node->parent->right = node;
+                NODE(tree, grandparent).right = node;
             }
         }
         else {  /* The node has propogated up to the root */
-            *root = node;
+            tree->root = node;
             break;
         }
     }
 
-    assert_tree(*root);
-    assert_tree_flags(*root);
+    assert_tree(tree);
+    assert_tree_flags(tree);
     return node;
 }
 
 /* Takes two trees and merges them into one while preserving the treap
  * invariant. left must have a smaller index than right. */
-static PivotNode *
-merge_trees(PivotNode *left, PivotNode *right)
+static Pivot
+merge_trees(PivotTree *tree, Pivot left, Pivot right)
 {
-    assert(left != NULL || right != NULL);
+    assert(left != NO_PIVOT || right != NO_PIVOT);
 
-    if (left == NULL)
+    if (left == NO_PIVOT)
         return right;
-    if (right == NULL)
+    if (right == NO_PIVOT)
         return left;
 
-    assert(left->parent == right->parent);
-    assert(left->idx < right->idx);
-    assert_node(left);
-    assert_node(right);
+    assert(NODE(tree, left).parent == NODE(tree, right).parent);
+    assert(PIVOT_IDX(tree, left) < PIVOT_IDX(tree, right));
+    assert_node(tree, left);
+    assert_node(tree, right);
 
-    if (left->priority > right->priority) {
-        right->parent = left;
-        left->right = merge_trees(left->right, right);
+    if (PIVOT_PRIORITY(tree, left) > PIVOT_PRIORITY(tree, right)) {
+        NODE(tree, right).parent = left;
+        NODE(tree, left).right = merge_trees(tree, NODE(tree, left).right,
+                                             right);
 
-        assert_node(left);
+        assert_node(tree, left);
         return left;
     }
     else {
-        left->parent = right;
-        right->left = merge_trees(left, right->left);
+        NODE(tree, left).parent = right;
+        NODE(tree, right).left = merge_trees(tree, left,
+                                             NODE(tree, right).left);
 
-        assert_node(right);
+        assert_node(tree, right);
         return right;
     }
 }
 
 static void
-delete_node(PivotNode *node, PivotNode **root)
+delete_node(PivotTree *tree, Pivot node)
 {
-    assert_tree(*root);
-
-    if (node->left == NULL) {
-        /* node has at most one child in node->right, so we just have the 
-         * grandparent adopt it, if node is not the root. If node is the root,
-         * we promote the child to root. */
-        if (node->parent != NULL) {
-            if (node->parent->left == node) {
-                node->parent->left = node->right;
-            }
-            else {
-                node->parent->right = node->right;
-            }
-        }
-        else {  /* Node is the root */
-            *root = node->right;
-        }
-
-        if (node->right != NULL) {
-            node->right->parent = node->parent;
-        }
-
-        PyMem_Free(node);
+    assert_tree(tree);
+
+    Pivot left = NODE(tree, node).left;
+    Pivot right = NODE(tree, node).right;
+    Pivot parent = NODE(tree, node).parent;
+    Pivot children;
+
+    /* If node has at most one child, the grandparent just adopts it, (or it
+     * becomes the root if node was the root). In the hard case, where node
+     * has two children, we merge the two children into one treap, and then
+     * replace node by this treap. */
+    if (left == NO_PIVOT) {
+        children = right;
+    }
+    else if (right == NO_PIVOT) {
+        children = left;
     }
     else {
-        if (node->right == NULL) {
-            /* node has a single child in node->left, so have grandparent
-             * adopt it as above */
-            if (node->parent != NULL) {
-                if (node->parent->left == node) {
-                    node->parent->left = node->left;
-                }
-                else {
-                    node->parent->right = node->left;
-                }
-            }
-            else {  /* Node is the root */
-                *root = node->left;
-            }
-
-            /* node->left is not NULL because of the outer if-else statement */
-            node->left->parent = node->parent;
+        children = merge_trees(tree, left, right);
+    }
 
-            PyMem_Free(node);
+    if (parent != NO_PIVOT) {
+        if (NODE(tree, parent).left == node) {
+            NODE(tree, parent).left = children;
         }
         else {
-            /* The hard case: node has two children. We merge the two children
-             * into one treap, and then replace node by this treap */
-            PivotNode *children = merge_trees(node->left, node->right);
-
-            if (node->parent != NULL) {
-                if (node->parent->left == node) {
-                    node->parent->left = children;
-                }
-                else {
-                    node->parent->right = children;
-                }
-            }
-            else {  /* Node is the root */
-                *root = children;
-            }
-
-            /* children is not NULL since node has two children */
-            children->parent = node->parent;
-
-            PyMem_Free(node);
+            NODE(tree, parent).right = children;
         }
     }
+    else {  /* Node is the root */
+        tree->root = children;
+    }
+
+    if (children != NO_PIVOT) {
+        NODE(tree, children).parent = parent;
+    }
 
-    assert_tree(*root);
+    free_node(tree, node);
+    assert_tree(tree);
 }
 
 /* If a sorted pivot is between two sorted section, removes the sorted pivot */
 static void
-depivot(PivotNode *left, PivotNode *right, PivotNode **root)
+depivot(PivotTree *tree, Pivot left, Pivot right)
 {
-    assert_tree(*root);
-    assert_tree_flags(*root);
-    assert(left->flags & SORTED_LEFT);
-    assert(right->flags & SORTED_RIGHT);
+    assert_tree(tree);
+    assert_tree_flags(tree);
+    assert(PIVOT_FLAGS(tree, left) & SORTED_LEFT);
+    assert(PIVOT_FLAGS(tree, right) & SORTED_RIGHT);
 
-    if (left->flags & SORTED_RIGHT) {
-        delete_node(left, root);
+    if (PIVOT_FLAGS(tree, left) & SORTED_RIGHT) {
+        delete_node(tree, left);
     }
 
-    if (right->flags & SORTED_LEFT) {
-        delete_node(right, root);
+    if (PIVOT_FLAGS(tree, right) & SORTED_LEFT) {
+        delete_node(tree, right);
     }
 
-    assert_tree(*root);
-    assert_tree_flags(*root);
+    assert_tree(tree);
+    assert_tree_flags(tree);
+}
+
+static PyObject *key_at(LSObject *, Py_ssize_t);
+
+/* Returns 1 if the keys at indices i and j are equal, 0 if not, and -1 on
+ * error */
+static int
+keys_equal(LSObject *ls, Py_ssize_t i, Py_ssize_t j)
+{
+    if (ls->nkeys != NULL)
+        return native_key(ls, i) == native_key(ls, j);
+    if (!ls->lazykeys)
+        return PyObject_RichCompareBool(LS_KEYS(ls)[i], LS_KEYS(ls)[j], Py_EQ);
+
+    PyObject *i_key = key_at(ls, i);
+    if (i_key == NULL)
+        return -1;
+    PyObject *j_key = key_at(ls, j);
+    if (j_key == NULL) {
+        Py_DECREF(i_key);
+        return -1;
+    }
+    int res = PyObject_RichCompareBool(i_key, j_key, Py_EQ);
+    Py_DECREF(i_key);
+    Py_DECREF(j_key);
+    return res;
 }
 
-/* If the value at middle is equal to the value at left, left is removed.
- * If the value at middle is equal to the value at right, right is removed.
+/* If the value at middle is equal to the value at left, and they are next to
+ * each other, left is removed, and likewise for right. Only adjacent pivots
+ * are removed, since the callers go on to use left or right as a bound, which
+ * is only safe when k can't lie between a removed pivot and middle.
  * Returns 0 on success, or -1 on failure */
 
-static int uniq_pivots(PivotNode *, PivotNode *, PivotNode *, LSObject *)
+static int uniq_pivots(Pivot, Pivot, Pivot, LSObject *)
 Py_GCC_ATTRIBUTE((warn_unused_result));
 
 static int
-uniq_pivots(PivotNode *left, PivotNode *middle, PivotNode *right, LSObject *ls)
+uniq_pivots(Pivot left, Pivot middle, Pivot right, LSObject *ls)
 {
-    assert_tree(ls->root);
-    assert_tree_flags(ls->root);
-    assert(left->idx < middle->idx && middle->idx < right->idx);
+    PivotTree *tree = &ls->pivots;
+    assert_tree(tree);
+    assert_tree_flags(tree);
+    Py_ssize_t left_idx = PIVOT_IDX(tree, left);
+    Py_ssize_t middle_idx = PIVOT_IDX(tree, middle);
+    Py_ssize_t right_idx = PIVOT_IDX(tree, right);
+    assert(left_idx < middle_idx && middle_idx < right_idx);
     int cmp;
 
-    if (left->idx >= 0) {
-        if ((cmp = PyObject_RichCompareBool(ls->xs->ob_item[left->idx],
-                                            ls->xs->ob_item[middle->idx],
-                                            Py_EQ)) < 0) {
+    if (left_idx >= 0 && left_idx + 1 == middle_idx) {
+        if ((cmp = keys_equal(ls, left_idx, middle_idx)) < 0) {
             return -1;
         }
         else if (cmp) {
-            middle->flags = left->flags;
-            delete_node(left, &ls->root);
+            ADD_FLAGS(tree, middle, PIVOT_FLAGS(tree, left) & SORTED_RIGHT);
+            delete_node(tree, left);
         }
     }
 
-    if (right->idx < Py_SIZE(ls->xs)) {
-        if ((cmp = PyObject_RichCompareBool(ls->xs->ob_item[middle->idx],
-                                            ls->xs->ob_item[right->idx],
-                                            Py_EQ)) < 0) {
+    if (right_idx < Py_SIZE(ls->xs) && middle_idx + 1 == right_idx) {
+        if ((cmp = keys_equal(ls, middle_idx, right_idx)) < 0) {
             return -1;
         }
         else if (cmp) {
-            middle->flags = right->flags;
-            delete_node(right, &ls->root);
+            ADD_FLAGS(tree, middle, PIVOT_FLAGS(tree, right) & SORTED_LEFT);
+            delete_node(tree, right);
         }
     }
 
-    assert_tree(ls->root);
-    assert_tree_flags(ls->root);
+    assert_tree(tree);
+    assert_tree_flags(tree);
     return 0;
 }
 
-/* Finds PivotNodes left and right that bound the index */
-/* Never returns k in right_node, only the left, if applicable */
+/* Finds the pivots left and right that bound the index */
+/* Never returns k in right, only the left, if applicable */
 static void
-bound_idx(Py_ssize_t k, PivotNode *root, PivotNode **left, PivotNode **right)
+bound_idx(PivotTree *tree, Py_ssize_t k, Pivot *left, Pivot *right)
 {
-    assert_tree(root);
-    assert_tree_flags(root);
-
-    *left = NULL;
-    *right = NULL;
-    PivotNode *current = root;
-    while (current != NULL) {
-        if (current->idx < k) {
+    assert_tree(tree);
+    assert_tree_flags(tree);
+
+    *left = NO_PIVOT;
+    *right = NO_PIVOT;
+    Pivot current = tree->root;
+    while (current != NO_PIVOT) {
+        Py_ssize_t idx = PIVOT_IDX(tree, current);
+        if (idx < k) {
             *left = current;
-            current = current->right;
+            current = NODE(tree, current).right;
         }
-        else if (current->idx > k) {
+        else if (idx > k) {
             *right = current;
-            current = current->left;
+            current = NODE(tree, current).left;
         }
         else {
             *left = current;
@@ -482,913 +954,4924 @@ bound_idx(Py_ssize_t k, PivotNode *root, PivotNode **left, PivotNode **right)
         }
     }
 
-    assert(*left != NULL && ((*left)->idx == k || *right != NULL));
-    assert((*left)->idx == k || *right == next_pivot(*left));
+    assert(*left != NO_PIVOT &&
+           (PIVOT_IDX(tree, *left) == k || *right != NO_PIVOT));
+    assert(PIVOT_IDX(tree, *left) == k || *right == next_pivot(tree, *left));
 }
 
-static void
-free_tree(PivotNode *root)
+/* Sets up the pivot tree of a list of n items, with its two pivots at -1 and
+ * n. nkeys are the list's native keys, (of width bytes each, from base), and
+ * weights the items' weights, which add up to total, (either may be NULL).
+ * Returns 0 on success and -1 on error. */
+static int
+init_pivots(PivotTree *tree, Py_ssize_t n, const void *nkeys, int width,
+            int64_t base, const double *weights, double total)
 {
-    assert_node(root);  /* might not be the actual root because of recursion */
-
-    if (root->left != NULL)
-        free_tree(root->left);
-    if (root->right != NULL)
-        free_tree(root->right);
+    Pivot first, last;
+
+    tree->nodes = NULL;
+    tree->stride = nkeys != NULL ? sizeof(KeyedPivotNode) : sizeof(PivotNode);
+    tree->source = nkeys;
+    tree->width = width;
+    tree->base = base;
+    tree->length = n;
+    tree->weights = weights;
+    tree->cum = NULL;
+    tree->idx_hi = NULL;
+    tree->wide = n > INT32_MAX;
+    tree->root = NO_PIVOT;
+    tree->free = NO_PIVOT;
+    tree->used = 0;
+    tree->allocated = 0;
+    tree->count = 0;
+
+    if ((first = insert_pivot(tree, -1, UNSORTED, tree->root)) == NO_PIVOT)
+        return -1;
+    if ((last = insert_pivot(tree, n, UNSORTED, tree->root)) == NO_PIVOT)
+        return -1;
+    if (weights != NULL) {
+        tree->cum[first] = 0.0;
+        tree->cum[last] = total;
+    }
+    return 0;
+}
 
-    PyMem_Free(root);
+static void
+free_pivots(PivotTree *tree)
+{
+    storage_free(tree->nodes);
+    storage_free(tree->idx_hi);
+    storage_free(tree->cum);
 }
 
 static void
 LS_dealloc(LSObject *self)
 {
     Py_DECREF(self->xs);
+    Py_XDECREF(self->keys);
+    storage_free(self->nkeys);
+    storage_free(self->weights);
+    PyMem_Free(self->hash_table);
     Py_XDECREF(self->keyfunc);
-    if (self->root != NULL) {
-        free_tree(self->root);
-    }
+    Py_XDECREF(self->batchkey);
+    free_pivots(&self->pivots);
+#if PY_VERSION_HEX >= 0x02060000
+    if (self->records != NULL)
+        PyBuffer_Release(self->records);
+#endif
+    PyMem_Free(self->records);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
-static PyObject *
-newLSObject(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    LSObject *self;
-    PyListObject *xs;
-    PyObject *sequence = NULL;
-    PyObject *keyfunc = NULL;
-    int reverse = 0;
-    static char *kwdlist[] = {"sequence", "key", "reverse", 0};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Oi:LazySorted",
-        kwdlist, &sequence, &keyfunc, &reverse))
-        return NULL;
+/* Native keys */
 
-    PyObject *list_args = Py_BuildValue("(O)", sequence);
-    if (list_args == NULL)
-        return NULL;
+/* Microseconds in a day */
+#define DAY_US ((int64_t)86400 * 1000000)
 
-    xs = (PyListObject *)PyList_Type.tp_new(&PyList_Type, list_args, NULL);
-    if (xs == NULL) {
-        Py_DECREF(list_args);
-        return NULL;
-    }
+/* The proleptic Gregorian ordinal of a date, as in date.toordinal() */
+static int64_t
+ymd_to_ordinal(int year, int month, int day)
+{
+    static const int days_before_month[] = {
+        0, 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+    };
+    int64_t y = year - 1;
+    int64_t days = y * 365 + y / 4 - y / 100 + y / 400
+                   + days_before_month[month] + day;
 
-    if (PyList_Type.tp_init((PyObject *)xs, list_args, NULL)) {
-        Py_DECREF(list_args);
-        Py_DECREF(xs);
-        return NULL;
-    }
-    Py_DECREF(list_args);
+    if (month > 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0))
+        days++;
+    return days;
+}
 
-    self = (LSObject *)type->tp_alloc(type, 0);
-    if (self == NULL) {
-        Py_DECREF(xs);
-        return NULL;
+/* Returns the native kind that key would have, or NATIVE_NONE */
+static int
+native_kind(PyObject *key)
+{
+    if (PyLong_CheckExact(key))
+        return NATIVE_INT;
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_CheckExact(key))
+        return NATIVE_INT;
+#endif
+    if (PyFloat_CheckExact(key))
+        return NATIVE_FLOAT;
+    if (PyDateTime_CheckExact(key)) {
+        if (!((_PyDateTime_BaseTZInfo *)key)->hastzinfo)
+            return NATIVE_DATETIME;
+#if PY_VERSION_HEX >= 0x03070000
+        if (((PyDateTime_DateTime *)key)->tzinfo == PyDateTime_TimeZone_UTC)
+            return NATIVE_DATETIME_UTC;
+#endif
+        return NATIVE_NONE;
     }
-    self->root = NULL;
-    self->keyfunc = NULL;
-    self->reverse = 0;
-    self->xs = xs;
+    if (PyDate_CheckExact(key))
+        return NATIVE_DATE;
+    if (PyDelta_CheckExact(key))
+        return NATIVE_TIMEDELTA;
+    return NATIVE_NONE;
+}
 
-    if (insert_pivot(-1, UNSORTED, &self->root, self->root) == NULL) {
-        Py_DECREF(self);
-        return NULL;
-    }
+/* The largest integer such that it and all smaller integers are doubles */
+#define MAX_EXACT_INT ((int64_t)1 << 53)
 
-    if (insert_pivot(Py_SIZE(xs), UNSORTED, &self->root, self->root) == NULL) {
-        Py_DECREF(self);
-        return NULL;
-    }
+/* Maps doubles to int64s with the same order, (treating -0.0 as 0.0) */
+static int64_t
+double_to_native(double d)
+{
+    int64_t bits;
+    if (d == 0.0)
+        d = 0.0;
+    memcpy(&bits, &d, sizeof(bits));
+    /* Negative doubles order backwards by magnitude, so flip all but the sign
+     * bit to make them order forwards */
+    return bits < 0 ? bits ^ INT64_MAX : bits;
+}
 
-    if (reverse)
-        self->reverse = 1;
+static double
+native_to_double(int64_t bits)
+{
+    double d;
+    if (bits < 0)
+        bits ^= INT64_MAX;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
 
-    if (keyfunc == Py_None)
-        keyfunc = NULL;
+/* Converts key to a native key of the given kind, ignoring reverse. Returns 1
+ * on success, or 0 if key doesn't have an exact native key of that kind. */
+static int
+to_native(PyObject *key, int kind, int64_t *out)
+{
+    int key_kind = native_kind(key);
+    if (key_kind != kind && !(kind == NATIVE_FLOAT && key_kind == NATIVE_INT))
+        return 0;
 
-    if (keyfunc != NULL) {
-        /* Since we sort lazily, we wouldn't discover that the key isn't
-         * callable until we actually attempted sorting. So let's try to help
-         * the user by failing fast if this is the case. */
-        if (!PyCallable_Check(keyfunc)) {
-            PyErr_SetString(PyExc_TypeError, "key must be callable");
-            Py_DECREF(self);
-            return NULL;
+    switch (kind) {
+    case NATIVE_INT: {
+#if PY_MAJOR_VERSION < 3
+        if (PyInt_CheckExact(key)) {
+            *out = PyInt_AS_LONG(key);
+            return 1;
         }
-        self->keyfunc = keyfunc;
-        Py_INCREF(self->keyfunc);
+#endif
+        int overflow;
+        PY_LONG_LONG v = PyLong_AsLongLongAndOverflow(key, &overflow);
+        if (overflow)
+            return 0;
+        *out = v;
+        return 1;
+    }
+    case NATIVE_FLOAT: {
+        double d;
+        if (key_kind == NATIVE_INT) {
+            int64_t v;
+            if (!to_native(key, NATIVE_INT, &v) ||
+                v > MAX_EXACT_INT || v < -MAX_EXACT_INT)
+                return 0;
+            d = (double)v;
+        }
+        else {
+            d = PyFloat_AS_DOUBLE(key);
+            /* NaNs don't have any place in the order of floats */
+            if (Py_IS_NAN(d))
+                return 0;
+        }
+        *out = double_to_native(d);
+        return 1;
+    }
+    case NATIVE_DATETIME:
+    case NATIVE_DATETIME_UTC:
+        *out = ymd_to_ordinal(PyDateTime_GET_YEAR(key),
+                              PyDateTime_GET_MONTH(key),
+                              PyDateTime_GET_DAY(key)) * DAY_US
+               + ((PyDateTime_DATE_GET_HOUR(key) * (int64_t)60
+                   + PyDateTime_DATE_GET_MINUTE(key)) * 60
+                  + PyDateTime_DATE_GET_SECOND(key)) * 1000000
+               + PyDateTime_DATE_GET_MICROSECOND(key);
+        return 1;
+    case NATIVE_DATE:
+        *out = ymd_to_ordinal(PyDateTime_GET_YEAR(key),
+                              PyDateTime_GET_MONTH(key),
+                              PyDateTime_GET_DAY(key)) * DAY_US;
+        return 1;
+    case NATIVE_TIMEDELTA: {
+        PyDateTime_Delta *delta = (PyDateTime_Delta *)key;
+        /* Very large timedeltas don't fit in 64 bits of microseconds */
+        if (delta->days > INT64_MAX / DAY_US - 1 ||
+            delta->days < INT64_MIN / DAY_US + 1)
+            return 0;
+        *out = delta->days * DAY_US + delta->seconds * (int64_t)1000000
+               + delta->microseconds;
+        return 1;
+    }
+    default:
+        return 0;
     }
-
-    return (PyObject *)self;
 }
 
-/* Private helper functions for partial sorting */
+/* Returns a new reference to the python object for a native key, (ignoring
+ * reverse), or NULL on error */
+static PyObject *
+from_native(int64_t v, int kind)
+{
+    if (kind == NATIVE_INT)
+        return PyLong_FromLongLong(v);
+    if (kind == NATIVE_FLOAT)
+        return PyFloat_FromDouble(native_to_double(v));
+
+    /* The time-like kinds are offsets from their first representable value,
+     * which has ordinal 1 */
+    int64_t offset = kind == NATIVE_TIMEDELTA ? v : v - DAY_US;
+    int64_t days = offset / DAY_US;
+    int64_t us = offset % DAY_US;
+    if (us < 0) {
+        days--;
+        us += DAY_US;
+    }
+    PyObject *delta = PyDelta_FromDSU((int)days, (int)(us / 1000000),
+                                      (int)(us % 1000000));
+    if (delta == NULL || kind == NATIVE_TIMEDELTA)
+        return delta;
+
+    PyObject *first;
+    if (kind == NATIVE_DATE) {
+        first = PyDate_FromDate(1, 1, 1);
+    }
+#if PY_VERSION_HEX >= 0x03070000
+    else if (kind == NATIVE_DATETIME_UTC) {
+        first = PyDateTimeAPI->DateTime_FromDateAndTime(
+            1, 1, 1, 0, 0, 0, 0, PyDateTime_TimeZone_UTC,
+            PyDateTimeAPI->DateTimeType);
+    }
+#endif
+    else {
+        first = PyDateTime_FromDateAndTime(1, 1, 1, 0, 0, 0, 0);
+    }
+    if (first == NULL) {
+        Py_DECREF(delta);
+        return NULL;
+    }
 
-/* These macros are basically taken from list.c
- * Returns 1 if x < y, 0 if x >= y, and -1 on error */
-/* #define ISLT(X, Y) PyObject_RichCompareBool(X, Y, Py_LT) */
+    PyObject *result = PyNumber_Add(first, delta);
+    Py_DECREF(first);
+    Py_DECREF(delta);
+    return result;
+}
 
-static inline int islt(PyObject *, PyObject *, LSObject *)
-Py_GCC_ATTRIBUTE((warn_unused_result));
-
-static inline int
-islt(PyObject *x, PyObject *y, LSObject *ls)
+/* Returns 1 if key is a float NaN */
+static int
+is_nan(PyObject *key)
 {
-    if (ls->keyfunc != NULL) {
-        PyObject *x_cmp, *y_cmp;
-
-        PyObject *x_arg = Py_BuildValue("(O)", x);
-        x_cmp = PyObject_CallObject(ls->keyfunc, x_arg);
-        Py_DECREF(x_arg);
-        if (x_cmp == NULL) {
-            return -1;
-        }
-
-        PyObject *y_arg = Py_BuildValue("(O)", y);
-        y_cmp = PyObject_CallObject(ls->keyfunc, y_arg);
-        Py_DECREF(y_arg);
-        if (y_cmp == NULL) {
-            Py_DECREF(x_cmp);
-            return -1;
-        }
+    return PyFloat_Check(key) && Py_IS_NAN(PyFloat_AS_DOUBLE(key));
+}
 
-        int res = ls->reverse ? PyObject_RichCompareBool(x_cmp, y_cmp, Py_GT)
-                              : PyObject_RichCompareBool(x_cmp, y_cmp, Py_LT);
+/* Applies reverse to the native keys of the given kind, which leaves NaNs
+ * last */
+static void
+reverse_native_keys(int64_t *nkeys, Py_ssize_t n, int kind)
+{
+    Py_ssize_t i;
 
-        Py_DECREF(x_cmp);
-        Py_DECREF(y_cmp);
-        return res;
-    } else {
-        return ls->reverse ? PyObject_RichCompareBool(x, y, Py_GT)
-                           : PyObject_RichCompareBool(x, y, Py_LT);
+    /* ~v reverses the order of all int64s without overflowing */
+    for (i = 0; i < n; i++) {
+        if (kind != NATIVE_FLOAT || nkeys[i] != NAN_KEY)
+            nkeys[i] = ~nkeys[i];
     }
 }
 
-#define IFLT(X, Y) if ((ltflag = islt(X, Y, ls)) < 0) goto fail;  \
-            if(ltflag)
-
-/* N.B: No semicolon at the end, so that you can include one yourself */
-#define SWAP(i, j) tmp = ob_item[i];  \
-                   ob_item[i] = ob_item[j];  \
-                   ob_item[j] = tmp
-
-/* Picks a pivot point among the indices left <= i < right. Returns -1 on
- * error */
-
-static Py_ssize_t pick_pivot(LSObject *, Py_ssize_t, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
+/* Converts key to a native key that can be compared against ls->nkeys, (so
+ * accounting for reverse and NaNs). Returns 1 on success, or 0 if key has no
+ * such native key. */
+static int
+native_probe(LSObject *ls, PyObject *key, int64_t *out)
+{
+    if (ls->nanmode != NAN_UNORDERED && ls->nkind == NATIVE_FLOAT &&
+        is_nan(key)) {
+        *out = NAN_KEY;
+        return 1;
+    }
+    if (!to_native(key, ls->nkind, out))
+        return 0;
+    if (ls->reverse)
+        *out = ~*out;
+    return 1;
+}
 
-static Py_ssize_t
-pick_pivot(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+/* Converts the n items to native keys in out, (ignoring reverse), with NaNs
+ * as NAN_KEY if allow_nan is set. Their kind goes in kind, and the number of
+ * NaNs in nans. Returns 1 on success, or 0 if the items don't all have native
+ * keys of the same kind. */
+static int
+items_to_native(PyObject **items, Py_ssize_t n, int allow_nan, int64_t *out,
+                int *kind, Py_ssize_t *nans)
 {
-    PyObject **ob_item = ls->xs->ob_item;
+    Py_ssize_t i;
 
-    /* Use median of three trick */
-    Py_ssize_t idx1 = left + rand() % (right - left);
-    Py_ssize_t idx2 = left + rand() % (right - left);
-    Py_ssize_t idx3 = left + rand() % (right - left);
+    *kind = n > 0 ? native_kind(items[0]) : NATIVE_INT;
+    if (*kind == NATIVE_NONE)
+        return 0;
 
-    int ltflag;
-    IFLT(ob_item[idx1], ob_item[idx3]) {
-        IFLT(ob_item[idx1], ob_item[idx2]) {
-            /* 1 2 3 vs. 1 3 2 */
-            IFLT(ob_item[idx2], ob_item[idx3]) {
-                return idx2;
-            }
-            else {
-                return idx3;
-            }
-        }
-        else {
-            /* 2 1 3 */
-            return idx1;
-        }
-    }
-    else {
-        IFLT(ob_item[idx3], ob_item[idx2]) {
-            /* 3 1 2 vs 3 2 1 */
-            IFLT(ob_item[idx1], ob_item[idx2]) {
-                return idx1;
+    *nans = 0;
+    for (i = 0; i < n; i++) {
+        if (!to_native(items[i], *kind, &out[i])) {
+            /* Ints mixed with floats are compared as floats */
+            if (*kind == NATIVE_INT && PyFloat_CheckExact(items[i])) {
+                *kind = NATIVE_FLOAT;
+                *nans = 0;
+                i = -1;
+                continue;
             }
-            else {
-                return idx2;
+            if (*kind == NATIVE_FLOAT && allow_nan && is_nan(items[i])) {
+                out[i] = NAN_KEY;
+                (*nans)++;
+                continue;
             }
-        }
-        else {
-            /* 2 3 1 */
-            return idx3;
+            return 0;
         }
     }
-
-fail:
-    return -1;
+    return 1;
 }
 
-/* Partitions the data between left and right into
- * [less than region | greater or equal to region]
- * and returns the pivot index, or -1 on error */
-static Py_ssize_t partition(LSObject *, Py_ssize_t, Py_ssize_t)
+/* Computes ls->nkeys if every key has a native representation of the same
+ * kind, and then drops the python keys, which are no longer needed. Leaves
+ * ls untouched if the keys can't be made native. Returns 0 on success and -1
+ * on error. */
+static int compute_native_keys(LSObject *)
 Py_GCC_ATTRIBUTE((warn_unused_result));
 
-static Py_ssize_t
-partition(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+static int
+compute_native_keys(LSObject *ls)
 {
-    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **cmp_item = LS_KEYS(ls);
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
 
-    PyObject *tmp;  /* Used by SWAP macro */
-    PyObject *pivot;
-    int ltflag;
+    if (xs_len == 0 || ls->nkeys != NULL || ls->lazykeys)
+        return 0;
 
-    Py_ssize_t piv_idx = pick_pivot(ls, left, right);
-    if (piv_idx < 0) {
+    if (native_kind(cmp_item[0]) == NATIVE_NONE)
+        return 0;
+
+    int64_t *nkeys = (int64_t *)storage_malloc(xs_len * sizeof(int64_t));
+    if (nkeys == NULL) {
+        PyErr_NoMemory();
         return -1;
     }
-    pivot = ob_item[piv_idx];
-
-    SWAP(left, piv_idx);
-    Py_ssize_t last_less = left;
 
-    /* Invariant: last_less and everything to its left is less than
-     * pivot or the pivot itself */
-
-    Py_ssize_t i;
-    for (i = left + 1; i < right; i++) {
-        /*
-        This single line boosts performance by a factor of around 2 on GCC.
-        The optimal lookahead distance i+3 was chosen by experimentation.
-        See http://www.naftaliharris.com/blog/2x-speedup-with-one-line-of-code/
-        */
-        __builtin_prefetch(ob_item[i+3]);
-        IFLT(ob_item[i], pivot) {
-            last_less++;
-            SWAP(i, last_less);
-        }
+    int kind;
+    Py_ssize_t nans;
+    if (!items_to_native(cmp_item, xs_len, ls->nanmode != NAN_UNORDERED,
+                         nkeys, &kind, &nans)) {
+        storage_free(nkeys);
+        return 0;
     }
 
-    SWAP(left, last_less);
-    return last_less;
+    if (ls->reverse)
+        reverse_native_keys(nkeys, xs_len, kind);
 
-fail:  /* From IFLT macro */
-    return -1;
+    ls->nkeys = nkeys;
+    ls->nan_count = nans;
+    ls->nkind = kind;
+    Py_CLEAR(ls->keys);
+    return 0;
 }
 
-/* Runs insertion sort on the items left <= i < right */
-static int insertion_sort(LSObject *, Py_ssize_t, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
-
+#if PY_VERSION_HEX >= 0x02060000
+/* Gets a view of obj if it's a one dimensional buffer of numbers, whose type
+ * code goes in format. Returns 1 if it is, (and the view must be released),
+ * and 0 if it isn't. */
 static int
-insertion_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+open_numeric_buffer(PyObject *obj, Py_buffer *view, char *format)
 {
-    PyObject **ob_item = ls->xs->ob_item;
-
-    PyObject *tmp;
-    Py_ssize_t i, j;
+    if (!PyObject_CheckBuffer(obj))
+        return 0;
+    if (PyObject_GetBuffer(obj, view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)) {
+        PyErr_Clear();
+        return 0;
+    }
 
-    for (i = left; i < right; i++) {
-        tmp = ob_item[i];
-        int ltflag = 0;
-        for (j = i; j > 0 && (ltflag = islt(tmp, ob_item[j - 1], ls)) > 0; j--)
-            ob_item[j] = ob_item[j - 1];
-        ob_item[j] = tmp;
-        if (ltflag < 0) {
-            return -1;
-        }
+    const char *fmt = view->format == NULL ? "B" : view->format;
+    if (*fmt == '@')
+        fmt++;
+    if (view->ndim != 1 || strlen(fmt) != 1 ||
+        strchr("bBhHiIlLqQnNfd", *fmt) == NULL) {
+        PyBuffer_Release(view);
+        return 0;
     }
-    return 0;
+    *format = *fmt;
+    return 1;
 }
 
-/* Runs quicksort on the items left <= i < right, returning 0 on success
- * or -1 on error. Does not affect stored pivots at all. */
-static int quick_sort(LSObject *, Py_ssize_t, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
-
-static int
-quick_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+/* Copies the size bytes at src to dst, reversing their order if swap is set */
+static inline void
+load_number(void *dst, const char *src, size_t size, int swap)
 {
-    if (right - left <= SORT_THRESH) {
-        return insertion_sort(ls, left, right);
+    size_t b;
+    if (!swap) {
+        memcpy(dst, src, size);
+        return;
     }
+    for (b = 0; b < size; b++)
+        ((char *)dst)[b] = src[size - 1 - b];
+}
 
-    Py_ssize_t piv_idx = partition(ls, left, right);
-    if (piv_idx < 0)
-        return -1;
-
-    if (quick_sort(ls, left, piv_idx) < 0)
-        return -1;
+/* The numbers needn't be aligned, (packed records often aren't), so they are
+ * always loaded with memcpy, which compiles down to a plain load */
+#define LOAD(type, v)                                           \
+    type v;                                                     \
+    load_number(&v, buf + i * stride, sizeof(type), swap)
 
-    if (quick_sort(ls, piv_idx + 1, right) < 0)
-        return -1;
+#define CONVERT_SIGNED(type)                                    \
+    for (i = 0; i < n; i++) {                                   \
+        LOAD(type, v);                                          \
+        out[i] = v;                                             \
+    }
 
-    return 0;
-}
+#define CONVERT_UNSIGNED(type)                                  \
+    for (i = 0; i < n; i++) {                                   \
+        LOAD(type, v);                                          \
+        if ((unsigned PY_LONG_LONG)v >> 63)                     \
+            return 0;                                           \
+        out[i] = v;                                             \
+    }
 
-/* Sorts the list ls sufficiently such that ls->xs->ob_item[k] is actually the
- * kth value in sorted order. Returns 0 on success and -1 on error. */
-static int sort_point(LSObject *, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
+#define CONVERT_FLOAT(type)                                     \
+    for (i = 0; i < n; i++) {                                   \
+        LOAD(type, v);                                          \
+        if (Py_IS_NAN(v)) {                                     \
+            if (!allow_nan)                                     \
+                return 0;                                       \
+            out[i] = NAN_KEY;                                   \
+            (*nans)++;                                          \
+        }                                                       \
+        else {                                                  \
+            out[i] = double_to_native(v);                       \
+        }                                                       \
+    }
 
+/* Converts n numbers of the given struct type code, stride bytes apart from
+ * buf on and byte swapped if swap is set, to native keys in out, (ignoring
+ * reverse), with NaNs as NAN_KEY if allow_nan is set. Returns 1 on success,
+ * or 0 if the numbers don't have exact native keys. */
 static int
-sort_point(LSObject *ls, Py_ssize_t k)
+convert_strided(const char *buf, Py_ssize_t stride, Py_ssize_t n, char format,
+                int swap, int allow_nan, int64_t *out, Py_ssize_t *nans)
 {
-    /* Find the best possible bounds */
-    PivotNode *left, *right, *middle;
-    bound_idx(k, ls->root, &left, &right);
+    Py_ssize_t i;
 
-    /* bound_idx never returns k in right, but right might be NULL if
-     * left->idx == k, so check left->idx first. */
-    if (left->idx == k || right->flags & SORTED_RIGHT) {
-        return 0;
+    switch (format) {
+    case 'b': CONVERT_SIGNED(signed char); break;
+    case '?':
+    case 'B': CONVERT_SIGNED(unsigned char); break;
+    case 'h': CONVERT_SIGNED(short); break;
+    case 'H': CONVERT_SIGNED(unsigned short); break;
+    case 'i': CONVERT_SIGNED(int); break;
+    case 'I': CONVERT_UNSIGNED(unsigned int); break;
+    case 'l': CONVERT_SIGNED(long); break;
+    case 'L': CONVERT_UNSIGNED(unsigned long); break;
+    case 'q': CONVERT_SIGNED(PY_LONG_LONG); break;
+    case 'Q': CONVERT_UNSIGNED(unsigned PY_LONG_LONG); break;
+    case 'n': CONVERT_SIGNED(Py_ssize_t); break;
+    case 'N': CONVERT_UNSIGNED(size_t); break;
+    case 'f': CONVERT_FLOAT(float); break;
+    case 'd': CONVERT_FLOAT(double); break;
     }
+    return 1;
+}
 
-    /* Run quickselect */
-    Py_ssize_t piv_idx;
+/* Converts the numbers of a view from open_numeric_buffer to native keys, as
+ * convert_strided does */
+static int
+convert_buffer(Py_buffer *view, char format, int allow_nan, int64_t *out,
+               Py_ssize_t *nans)
+{
+    return convert_strided((const char *)view->buf, view->itemsize,
+                           view->shape[0], format, 0, allow_nan, out, nans);
+}
 
-    while (left->idx + 1 + SORT_THRESH <= right->idx) {
-        piv_idx = partition(ls, left->idx + 1, right->idx);
-        if (piv_idx < 0) {
-            return -1;
-        }
-        if (piv_idx < k) {
-            if (left->right == NULL) {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-            }
-            else {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-            }
-            if (middle == NULL)
-                return -1;
+#undef LOAD
+#undef CONVERT_SIGNED
+#undef CONVERT_UNSIGNED
+#undef CONVERT_FLOAT
 
-            if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-            left = middle;
-        }
-        else if (piv_idx > k) {
-            if (left->right == NULL) {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-            }
-            else {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-            }
-            if (middle == NULL)
-                return -1;
+/* Computes ls->nkeys straight from keys, if it's a one dimensional buffer of
+ * numbers with exact native keys. Returns 1 if it does, 0 if it doesn't, and
+ * -1 on error. */
+static int native_keys_from_buffer(LSObject *, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
 
-            if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-            right = middle;
-        }
-        else {
-            if (left->right == NULL) {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-            }
-            else {
-                middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-            }
-            if (middle == NULL)
-                return -1;
+static int
+native_keys_from_buffer(LSObject *ls, PyObject *keys)
+{
+    Py_buffer view;
+    char format;
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    Py_ssize_t nans = 0;
 
-            if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-            return 0;
-        }
+    if (!open_numeric_buffer(keys, &view, &format))
+        return 0;
+
+    if (view.shape[0] != xs_len) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "keys must have one key per item");
+        return -1;
     }
 
-    if (insertion_sort(ls, left->idx + 1, right->idx) < 0) {
+    int64_t *nkeys = (int64_t *)storage_malloc((xs_len > 0 ? xs_len : 1)
+                                               * sizeof(int64_t));
+    if (nkeys == NULL) {
+        PyBuffer_Release(&view);
+        PyErr_NoMemory();
         return -1;
     }
-    left->flags |= SORTED_LEFT;
-    right->flags |= SORTED_RIGHT;
-    depivot(left, right, &ls->root);
 
-    return 0;
-}
+    /* If the buffer doesn't have native keys, it might still be usable */
+    if (!convert_buffer(&view, format, ls->nanmode != NAN_UNORDERED, nkeys,
+                        &nans)) {
+        storage_free(nkeys);
+        PyBuffer_Release(&view);
+        return 0;
+    }
 
-/* Sorts the list ls sufficiently such that everything between indices start
- * and stop is in sorted order. Returns 0 on success and -1 on error. */
-static int sort_range(LSObject *, Py_ssize_t, Py_ssize_t)
-Py_GCC_ATTRIBUTE((warn_unused_result));
+    PyBuffer_Release(&view);
+    ls->nkeys = nkeys;
+    ls->nkind = strchr("fd", format) != NULL ? NATIVE_FLOAT : NATIVE_INT;
+    ls->nan_count = nans;
+    if (ls->reverse)
+        reverse_native_keys(nkeys, xs_len, ls->nkind);
+    return 1;
+}
+#else
+#define open_numeric_buffer(obj, view, format) 0
+#define convert_strided(buf, stride, n, format, swap, allow_nan, out, nans) 0
+#define convert_buffer(view, format, allow_nan, out, nans) 0
+#define native_keys_from_buffer(ls, keys) 0
+#endif
 
-static int
-sort_range(LSObject *ls, Py_ssize_t start, Py_ssize_t stop)
+/* Removes the items with NaN keys for nan='drop' */
+static void
+drop_nans(LSObject *ls)
 {
-    /* The xs list is always partially sorted, with pivots partioning up the
-     * space, like in this picture:
-     *
-     * | ~~~~~ | ~~~ | ~~~~~ | ~~ | ~~~~~~~ |
-     *
-     * '|' indicates a pivot and '~~' indicates unsorted data.
-     *
-     * So we iterate through the regions bounding our data, and sort them.
-     */
-
-    assert(0 <= start && start < stop && stop <= Py_SIZE(ls->xs));
-
-    if (sort_point(ls, start) < 0)
-        return -1;
-    if (sort_point(ls, stop) < 0)
-        return -1;
-
-    PivotNode *current, *next;
-    bound_idx(start, ls->root, &current, &next);
-    if (current->idx == start)
-        next = next_pivot(current);
+    PyObject **ob_item = ls->xs->ob_item;
+    int64_t *nkeys = ls->nkeys;
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    Py_ssize_t i, kept = 0;
 
-    while (current->idx < stop) {
-        if (current->flags & SORTED_LEFT) {
-            assert(next->flags & SORTED_RIGHT);
+    assert(nkeys != NULL && ls->nkind == NATIVE_FLOAT);
+    for (i = 0; i < xs_len; i++) {
+        if (nkeys[i] == NAN_KEY) {
+            Py_DECREF(ob_item[i]);
         }
         else {
-            /* Since we are sorting the entire region, we don't need to keep
-             * track of pivots, and so we can use vanilla quicksort */
-            if (quick_sort(ls, current->idx + 1, next->idx) < 0) {
-                return -1;    
-            }
-            current->flags |= SORTED_LEFT;
-            next->flags |= SORTED_RIGHT;
+            ob_item[kept] = ob_item[i];
+            nkeys[kept] = nkeys[i];
+            if (ls->weights != NULL)
+                ls->weights[kept] = ls->weights[i];
+            kept++;
         }
+    }
+    Py_SET_SIZE(ls->xs, kept);
+}
 
-        if (current->flags & SORTED_RIGHT) {
-            delete_node(current, &ls->root);
-        }
+/* Narrows ls->nkeys if they span less than 2**32, (see native_key). Returns 0
+ * on success and -1 on error. */
+static int
+narrow_native_keys(LSObject *ls)
+{
+    const int64_t *nkeys = (const int64_t *)ls->nkeys;
+    Py_ssize_t i, n = Py_SIZE(ls->xs);
 
-        current = next;
-        next = next_pivot(current);
+    if (nkeys == NULL || n == 0)
+        return 0;
+
+    int64_t lo = nkeys[0], hi = nkeys[0];
+    for (i = 1; i < n; i++) {
+        lo = nkeys[i] < lo ? nkeys[i] : lo;
+        hi = nkeys[i] > hi ? nkeys[i] : hi;
     }
+    uint64_t span = (uint64_t)hi - (uint64_t)lo;
+    int width = span <= 0xFF ? 1 : span <= 0xFFFF ? 2
+              : span <= 0xFFFFFFFF ? 4 : 8;
+    if (width == 8)
+        return 0;
 
-    assert(current->flags & SORTED_RIGHT);
-    if (current->flags & SORTED_LEFT) {
-        delete_node(current, &ls->root);
+    void *narrow = storage_malloc(n * width);
+    if (narrow == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        uint64_t offset = (uint64_t)nkeys[i] - (uint64_t)lo;
+        switch (width) {
+        case 1: ((uint8_t *)narrow)[i] = (uint8_t)offset; break;
+        case 2: ((uint16_t *)narrow)[i] = (uint16_t)offset; break;
+        case 4: ((uint32_t *)narrow)[i] = (uint32_t)offset; break;
+        }
     }
 
+    storage_free(ls->nkeys);
+    ls->nkeys = narrow;
+    ls->nwidth = width;
+    ls->nbase = lo;
     return 0;
 }
 
-/* Returns the first index of item in the list, or -2 on error, or -1 if item
- * is not present. Places item in that first idx, but makes no guarantees
- * any duplicate versions of item will immediately follow. Eg, it's possible
- * calling find_item on some list with item = 1 will result in the following
- * list:
- * [0, 0, 0, 1, 2, 2, 1, 2, 1, 1, 2]
- */
-static Py_ssize_t find_item(LSObject *, PyObject *)
-Py_GCC_ATTRIBUTE((warn_unused_result));
+/* Returns a new reference to the key of the item at index k, or NULL on
+ * error. This is only needed for lazy keys and to compare against keys that
+ * have no native representation, so it may have to recompute the key. */
+static PyObject *
+key_at(LSObject *ls, Py_ssize_t k)
+{
+    if (ls->keys != NULL && ls->keys->ob_item[k] != NULL) {
+        Py_INCREF(ls->keys->ob_item[k]);
+        return ls->keys->ob_item[k];
+    }
+    else if (ls->keyfunc != NULL) {
+        return PyObject_CallFunctionObjArgs(ls->keyfunc, ls->xs->ob_item[k],
+                                            NULL);
+    }
+    else if (ls->batchkey != NULL || ls->givenkeys) {
+        assert(ls->nkeys != NULL);
+        int64_t nkey = native_key(ls, k);
+        return from_native(ls->reverse ? ~nkey : nkey, ls->nkind);
+    }
+    else {
+        Py_INCREF(ls->xs->ob_item[k]);
+        return ls->xs->ob_item[k];
+    }
+}
+
+/* Lazy keys. With a key_cache budget, keys are only computed for the regions
+ * that actually get partitioned, for as long as they fit in the budget, and
+ * are dropped again once their region is sorted. */
 
+/* Roughly how many bytes key takes up */
 static Py_ssize_t
-find_item(LSObject *ls, PyObject *item)
+key_size(PyObject *key)
 {
-    PivotNode *left = NULL;
-    PivotNode *right = NULL;
-    PivotNode *middle;
-    PivotNode *current = ls->root;
-    int ltflag;
-    Py_ssize_t xs_len = Py_SIZE(ls->xs);
-    Py_ssize_t left_idx, right_idx;
+    PyTypeObject *type = Py_TYPE(key);
+    Py_ssize_t size = type->tp_basicsize;
+    if (type->tp_itemsize != 0) {
+        Py_ssize_t n = Py_SIZE(key);
+        size += (n < 0 ? -n : n) * type->tp_itemsize;
+    }
+    return size;
+}
 
-    while (current != NULL) {
-        if (current->idx == -1) {
-            left = current;
-            current = current->right;
+/* Computes the missing keys of the items left <= i < right while there's
+ * room in the budget, or regardless of the budget if force is set. Returns 1
+ * if all of those keys are cached, 0 if not, and -1 on error. A key's size
+ * isn't known until it has been computed, and then it's kept rather than
+ * thrown away, so the last key may go over the budget. */
+static int fill_keys(LSObject *, Py_ssize_t, Py_ssize_t, int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+fill_keys(LSObject *ls, Py_ssize_t left, Py_ssize_t right, int force)
+{
+    PyObject **key_item = ls->keys->ob_item;
+    PyObject *key;
+    Py_ssize_t i;
+
+    for (i = left; i < right; i++) {
+        if (key_item[i] != NULL)
+            continue;
+        if (!force && ls->key_bytes >= ls->key_budget)
+            return 0;
+
+        key = PyObject_CallFunctionObjArgs(ls->keyfunc, ls->xs->ob_item[i],
+                                           NULL);
+        if (key == NULL)
+            return -1;
+        key_item[i] = key;
+        ls->key_bytes += key_size(key);
+    }
+    return 1;
+}
+
+/* Drops any lazy keys of the items left <= i < right */
+static void
+evict_keys(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    if (!ls->lazykeys)
+        return;
+
+    PyObject **key_item = ls->keys->ob_item;
+    Py_ssize_t i;
+
+    if (left < 0)
+        left = 0;
+    if (right > Py_SIZE(ls->xs))
+        right = Py_SIZE(ls->xs);
+
+    for (i = left; i < right; i++) {
+        if (key_item[i] != NULL) {
+            ls->key_bytes -= key_size(key_item[i]);
+            Py_CLEAR(key_item[i]);
         }
-        else if (current->idx == xs_len) {
-            right = current;
-            current = current->left;
+    }
+}
+
+/* Computes the keys of ls->xs, either by calling the key function on each
+ * item, by calling the batch key function once on the whole sequence, or from
+ * the given keys, (NULL if there aren't any). Returns 0 on success and -1 on
+ * error. */
+static int compute_keys(LSObject *, PyObject *, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+compute_keys(LSObject *ls, PyObject *sequence, PyObject *keys)
+{
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    Py_ssize_t i;
+    PyObject *key;
+
+    if (ls->keyfunc != NULL) {
+        ls->keys = (PyListObject *)PyList_New(xs_len);
+        if (ls->keys == NULL)
+            return -1;
+
+        /* Lazy keys are filled in as regions get partitioned */
+        if (ls->lazykeys)
+            return 0;
+
+        for (i = 0; i < xs_len; i++) {
+            key = PyObject_CallFunctionObjArgs(ls->keyfunc,
+                                               ls->xs->ob_item[i], NULL);
+            if (key == NULL)
+                return -1;
+            ls->keys->ob_item[i] = key;
         }
+    }
+    else if (ls->batchkey != NULL) {
+        /* Iterators have been exhausted by copying them into xs, so they can
+         * only be passed on as a copy of that, (as a tuple, so that batch_key
+         * can't change the items out from under their keys) */
+        PyObject *batch;
+        if (PyIter_Check(sequence))
+            batch = PyList_AsTuple((PyObject *)ls->xs);
         else {
-            IFLT(ls->xs->ob_item[current->idx], item) {
-                left = current;
-                current = current->right;
-            }
-            else {
-                right = current;
-                current = current->left;
-            }
+            batch = sequence;
+            Py_INCREF(batch);
         }
-    }
+        if (batch == NULL)
+            return -1;
+        PyObject *result = PyObject_CallFunctionObjArgs(ls->batchkey, batch,
+                                                        NULL);
+        Py_DECREF(batch);
+        if (result == NULL)
+            return -1;
+        ls->keys = (PyListObject *)PySequence_List(result);
+        Py_DECREF(result);
+        if (ls->keys == NULL)
+            return -1;
 
-    if (left->flags & SORTED_LEFT) {
-        assert(right->flags & SORTED_RIGHT);
-        left_idx = left->idx + 1;
-        right_idx = right->idx == xs_len ? xs_len : right->idx + 1;
+        if (Py_SIZE(ls->keys) != xs_len) {
+            PyErr_SetString(PyExc_ValueError,
+                            "batch_key must return one key per item");
+            return -1;
+        }
     }
-    else {
-        Py_ssize_t piv_idx;
-        while (left->idx + 1 + SORT_THRESH <= right->idx) {
-            if ((piv_idx = partition(ls, left->idx + 1, right->idx)) < 0) {
-                return -2;
-            }
-            IFLT(ls->xs->ob_item[piv_idx], item) {
-                if (left->right == NULL) {
-                    middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-                }
-                else {
-                    middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-                }
-                if (middle == NULL)
-                    return -2;
+    else if (keys != NULL) {
+        int res = native_keys_from_buffer(ls, keys);
+        if (res != 0)
+            return res < 0 ? -1 : 0;
 
-                if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-                left = middle;
-            }
-            else {
-                if (left->right == NULL) {
-                    middle = insert_pivot(piv_idx, UNSORTED, &ls->root, left);
-                }
-                else {
-                    middle = insert_pivot(piv_idx, UNSORTED, &ls->root, right);
-                }
-                if (middle == NULL)
-                    return -2;
+        ls->keys = (PyListObject *)PySequence_List(keys);
+        if (ls->keys == NULL)
+            return -1;
 
-                if (uniq_pivots(left, middle, right, ls) < 0) return -1;
-                right = middle;
-            }
+        if (Py_SIZE(ls->keys) != xs_len) {
+            PyErr_SetString(PyExc_ValueError,
+                            "keys must have one key per item");
+            return -1;
         }
+    }
 
-        left_idx = left->idx + 1;
-        right_idx = right->idx == xs_len ? xs_len : right->idx + 1;
+    return 0;
+}
 
-        if (insertion_sort(ls, left->idx + 1, right->idx) < 0) {
-           return -2;
-        }
-        left->flags |= SORTED_LEFT;
-        right->flags |= SORTED_RIGHT;
-        depivot(left, right, &ls->root);
+/* Returns a new reference to the key of an item that may not be in ls, or
+ * NULL on error */
+static PyObject *
+item_key(LSObject *ls, PyObject *item)
+{
+    if (ls->keyfunc != NULL) {
+        return PyObject_CallFunctionObjArgs(ls->keyfunc, item, NULL);
     }
+    else if (ls->batchkey != NULL) {
+        PyObject *batch = PyList_New(1);
+        if (batch == NULL)
+            return NULL;
+        Py_INCREF(item);
+        PyList_SET_ITEM(batch, 0, item);
 
-    /* TODO: Do binary search now */
-    Py_ssize_t k;
-    int cmp = 0;
-    for (k = left_idx; cmp == 0 && k < right_idx; k++) {
-        cmp = PyObject_RichCompareBool(item, ls->xs->ob_item[k], Py_EQ);
+        PyObject *result = PyObject_CallFunctionObjArgs(ls->batchkey, batch,
+                                                        NULL);
+        Py_DECREF(batch);
+        if (result == NULL)
+            return NULL;
+        PyObject *key = PySequence_GetItem(result, 0);
+        Py_DECREF(result);
+        return key;
+    }
+    else {
+        Py_INCREF(item);
+        return item;
     }
+}
 
-    if (cmp < 0) {
-        return -2;
+/* Returns the value that goes with whichever of the n names arg equals, or
+ * sets a ValueError with the message error and returns -1 if it's none of
+ * them */
+static int
+parse_choice(PyObject *arg, const char *const *names, const int *values,
+             int n, const char *error)
+{
+    int i, cmp;
+
+    for (i = 0; i < n; i++) {
+        PyObject *name = PyString_FromString(names[i]);
+        if (name == NULL)
+            return -1;
+        cmp = PyObject_RichCompareBool(arg, name, Py_EQ);
+        Py_DECREF(name);
+        if (cmp < 0)
+            return -1;
+        if (cmp)
+            return values[i];
     }
-    else if (cmp == 0) {
+
+    PyErr_SetString(PyExc_ValueError, error);
+    return -1;
+}
+
+/* Returns the NaN mode named by nan, or -1 on error */
+static int
+parse_nan(PyObject *nan)
+{
+    static const char *const names[] = {"last", "drop"};
+    static const int modes[] = {NAN_LAST, NAN_DROP};
+    return parse_choice(nan, names, modes, 2,
+                        "nan must be None, 'last' or 'drop'");
+}
+
+/* Returns 1 if out asks for arrays, 0 if it asks for lists, or -1 on error */
+static int
+parse_out(PyObject *out)
+{
+    static const char *const names[] = {"list", "array"};
+    static const int arrays[] = {0, 1};
+    return parse_choice(out, names, arrays, 2,
+                        "out must be 'list' or 'array'");
+}
+
+/* Returns the nullmode that nulls names, or -1 on error */
+static int
+parse_nulls(PyObject *nulls)
+{
+    static const char *const names[] = {"drop", "first", "last"};
+    static const int modes[] = {NULLS_DROP, NULLS_FIRST, NULLS_LAST};
+    return parse_choice(nulls, names, modes, 3,
+                        "nulls must be 'drop', 'first' or 'last'");
+}
+
+#if PY_VERSION_HEX >= 0x02060000
+/* Applies mask, a validity bitmap with bit i, (counting from the least
+ * significant bit of each byte), set if item i is valid, as ls->nullmode
+ * says. Since the bitmap is by position, this also does nan='drop' in the
+ * same pass. Returns 0 on success and -1 on error. */
+static int
+apply_mask(LSObject *ls, PyObject *mask)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    int64_t *nkeys = ls->nkeys;
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    Py_ssize_t i, kept = 0, nans = 0;
+    Py_buffer view;
+
+    if (PyObject_GetBuffer(mask, &view, PyBUF_SIMPLE) < 0)
+        return -1;
+    if (view.len < (xs_len + 7) / 8) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError,
+                        "mask must have a bit for each item");
         return -1;
     }
-    else {
-        return k - 1;  /* -1 since incremented in for loop */
+    const unsigned char *bits = (const unsigned char *)view.buf;
+
+    int64_t null_key = ls->nullmode == NULLS_FIRST ? NULL_FIRST : NULL_LAST;
+    int nan_ties = ls->nkind == NATIVE_FLOAT && null_key == NAN_KEY;
+    for (i = 0; i < xs_len; i++) {
+        int valid = (bits[i >> 3] >> (i & 7)) & 1;
+        int nan = ls->nanmode != NAN_UNORDERED && nkeys[i] == NAN_KEY &&
+                  ls->nkind == NATIVE_FLOAT;
+        if (valid) {
+            nans += nan;
+            if (nan && ls->nanmode == NAN_DROP) {
+                Py_DECREF(ob_item[i]);
+                continue;
+            }
+            if (ls->nullmode != NULLS_DROP && nkeys[i] == null_key &&
+                !(nan && nan_ties)) {
+                PyBuffer_Release(&view);
+                PyErr_SetString(PyExc_ValueError,
+                                "the keys of valid items collide with nulls");
+                return -1;
+            }
+        }
+        else {
+            ls->null_count++;
+            if (ls->nullmode == NULLS_DROP) {
+                Py_DECREF(ob_item[i]);
+                continue;
+            }
+            nkeys[i] = null_key;
+        }
+        ob_item[kept] = ob_item[i];
+        nkeys[kept] = nkeys[i];
+        if (ls->weights != NULL)
+            ls->weights[kept] = ls->weights[i];
+        kept++;
     }
 
-fail:
-    return -2;
+    PyBuffer_Release(&view);
+    ls->nan_count = nans;
+    Py_SET_SIZE(ls->xs, kept);
+    return 0;
+}
+#else
+static int
+apply_mask(LSObject *ls, PyObject *mask)
+{
+    PyErr_SetString(PyExc_TypeError, "mask needs python 2.6 or later");
+    return -1;
 }
+#endif
 
-/* Public facing LazySorted methods */
+/* Sets ls->weights from weights, a sequence of a non-negative number for each
+ * item. Returns 0 on success and -1 on error. */
+static int
+parse_weights(LSObject *ls, PyObject *weights)
+{
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    Py_ssize_t i;
 
-static PyObject *idxerr = NULL;
+    PyObject *seq = PySequence_Fast(weights, "weights must be a sequence");
+    if (seq == NULL)
+        return -1;
+    if (PySequence_Fast_GET_SIZE(seq) != xs_len) {
+        PyErr_SetString(PyExc_ValueError,
+                        "weights must be the same length as the sequence");
+        Py_DECREF(seq);
+        return -1;
+    }
+
+    ls->weights = (double *)storage_malloc((xs_len > 0 ? xs_len : 1)
+                                           * sizeof(double));
+    if (ls->weights == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < xs_len; i++) {
+        double w = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+        if (w == -1.0 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        if (!(w >= 0.0) || Py_IS_INFINITY(w)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "weights must be finite and non-negative");
+            Py_DECREF(seq);
+            return -1;
+        }
+        ls->weights[i] = w;
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+static void
+init_readahead(ReadAhead *ra)
+{
+    ra->last = -2;
+    ra->dir = 0;
+    ra->run = 0;
+    ra->size = READAHEAD_MIN;
+    ra->lo = ra->hi = 0;
+}
 
 static PyObject *
-ls_subscript(LSObject* self, PyObject* item)
+newLSObject(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    Py_ssize_t xs_len = Py_SIZE(self->xs);
+    LSObject *self;
+    PyListObject *xs;
+    PyObject *sequence = NULL;
+    PyObject *keyfunc = NULL;
+    PyObject *batchkey = NULL;
+    PyObject *keys = NULL;
+    PyObject *key_cache = NULL;
+    PyObject *nan = NULL;
+    PyObject *max_pivots = NULL;
+    PyObject *hash_index = NULL;
+    PyObject *weights = NULL;
+    PyObject *out = NULL;
+    PyObject *mask = NULL;
+    PyObject *nulls = NULL;
+    int reverse = 0;
+    static char *kwdlist[] = {"sequence", "key", "reverse", "batch_key",
+                              "keys", "key_cache", "nan", "max_pivots",
+                              "hash_index", "weights", "out", "mask",
+                              "nulls", 0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OiOOOOOOOOOO:LazySorted",
+        kwdlist, &sequence, &keyfunc, &reverse, &batchkey, &keys, &key_cache,
+        &nan, &max_pivots, &hash_index, &weights, &out, &mask, &nulls))
+        return NULL;
 
-    if (PyIndex_Check(item)) {
-        Py_ssize_t k;
-        k = PyNumber_AsSsize_t(item, PyExc_IndexError);
-        if (k == -1 && PyErr_Occurred())
+    PyObject *list_args = Py_BuildValue("(O)", sequence);
+    if (list_args == NULL)
+        return NULL;
+
+    xs = (PyListObject *)PyList_Type.tp_new(&PyList_Type, list_args, NULL);
+    if (xs == NULL) {
+        Py_DECREF(list_args);
+        return NULL;
+    }
+
+    if (PyList_Type.tp_init((PyObject *)xs, list_args, NULL)) {
+        Py_DECREF(list_args);
+        Py_DECREF(xs);
+        return NULL;
+    }
+    Py_DECREF(list_args);
+
+    self = (LSObject *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        Py_DECREF(xs);
+        return NULL;
+    }
+    self->pivots.nodes = NULL;
+    self->pivots.idx_hi = NULL;
+    self->max_pivots = -1;
+    init_readahead(&self->readahead);
+    self->hash_after = -1;
+    self->hash_queries = 0;
+    self->hash_table = NULL;
+    self->hash_mask = 0;
+    self->keys = NULL;
+    self->lazykeys = 0;
+    self->key_budget = 0;
+    self->key_bytes = 0;
+    self->nkeys = NULL;
+    self->nwidth = sizeof(int64_t);
+    self->nbase = 0;
+    self->weights = NULL;
+    self->total_weight = 0.0;
+    self->nkind = NATIVE_NONE;
+    self->keyfunc = NULL;
+    self->batchkey = NULL;
+    self->givenkeys = 0;
+    self->reverse = 0;
+    self->nanmode = NAN_UNORDERED;
+    self->nan_count = 0;
+    self->nullmode = NULLS_NONE;
+    self->null_count = 0;
+    self->outarray = 0;
+    self->records = NULL;
+    self->record_size = 0;
+    self->xs = xs;
+
+    if (reverse)
+        self->reverse = 1;
+
+    if (nan != NULL && nan != Py_None) {
+        if ((self->nanmode = parse_nan(nan)) < 0) {
+            Py_DECREF(self);
             return NULL;
-        if (k < 0)
-            k += xs_len;
+        }
+    }
 
-        if (k < 0 || k >= xs_len) {
-            if (idxerr == NULL) {
-                idxerr = PyString_FromString("LazySorted index out of range");
-                if (idxerr == NULL)
-                    return NULL;
-            }
-            PyErr_SetObject(PyExc_IndexError, idxerr);
+    if (mask == Py_None)
+        mask = NULL;
+    if (mask != NULL) {
+        self->nullmode = NULLS_DROP;
+        /* Null slots often hold NaNs, which mustn't stop the keys being
+         * native */
+        if (self->nanmode == NAN_UNORDERED)
+            self->nanmode = NAN_LAST;
+    }
+    if (nulls != NULL && nulls != Py_None) {
+        if (mask == NULL) {
+            PyErr_SetString(PyExc_TypeError, "nulls requires mask");
+            Py_DECREF(self);
+            return NULL;
+        }
+        if ((self->nullmode = parse_nulls(nulls)) < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+
+    if (out != NULL && out != Py_None) {
+        if ((self->outarray = parse_out(out)) < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+
+    if (max_pivots != NULL && max_pivots != Py_None) {
+        self->max_pivots = PyNumber_AsSsize_t(max_pivots, PyExc_OverflowError);
+        if (self->max_pivots == -1 && PyErr_Occurred()) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (self->max_pivots < 0) {
+            PyErr_SetString(PyExc_ValueError, "max_pivots must be >= 0");
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+
+    if (hash_index != NULL && hash_index != Py_None) {
+        self->hash_after = PyNumber_AsSsize_t(hash_index, PyExc_OverflowError);
+        if (self->hash_after == -1 && PyErr_Occurred()) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (self->hash_after < 0) {
+            PyErr_SetString(PyExc_ValueError, "hash_index must be >= 0");
+            Py_DECREF(self);
             return NULL;
         }
+    }
+
+    if (keyfunc == Py_None)
+        keyfunc = NULL;
+    if (batchkey == Py_None)
+        batchkey = NULL;
+    if (keys == Py_None)
+        keys = NULL;
+
+    if ((keyfunc != NULL) + (batchkey != NULL) + (keys != NULL) > 1) {
+        PyErr_SetString(PyExc_TypeError,
+                        "only one of key, batch_key and keys may be used");
+        Py_DECREF(self);
+        return NULL;
+    }
+    if (keys != NULL)
+        self->givenkeys = 1;
+
+    if (key_cache != NULL && key_cache != Py_None) {
+        if (keyfunc == NULL) {
+            PyErr_SetString(PyExc_TypeError, "key_cache requires key");
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->key_budget = PyNumber_AsSsize_t(key_cache, PyExc_OverflowError);
+        if (self->key_budget == -1 && PyErr_Occurred()) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (self->key_budget < 0) {
+            PyErr_SetString(PyExc_ValueError, "key_cache must be >= 0");
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->lazykeys = 1;
+    }
+
+    /* Since we sort lazily, we wouldn't discover that the key isn't
+     * callable until we actually attempted sorting. So let's try to help
+     * the user by failing fast if this is the case. */
+    if (keyfunc != NULL) {
+        if (!PyCallable_Check(keyfunc)) {
+            PyErr_SetString(PyExc_TypeError, "key must be callable");
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->keyfunc = keyfunc;
+        Py_INCREF(self->keyfunc);
+    }
+
+    if (batchkey != NULL) {
+        if (!PyCallable_Check(batchkey)) {
+            PyErr_SetString(PyExc_TypeError, "batch_key must be callable");
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->batchkey = batchkey;
+        Py_INCREF(self->batchkey);
+    }
+
+    /* Every item gets compared during the first partition anyway, so compute
+     * each key exactly once up front rather than once per comparison */
+    if (compute_keys(self, sequence, keys) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    if (compute_native_keys(self) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    if (self->nanmode != NAN_UNORDERED && self->nkeys == NULL &&
+        Py_SIZE(xs) > 0 && mask == NULL) {
+        PyErr_SetString(PyExc_TypeError, "nan requires int or float keys");
+        Py_DECREF(self);
+        return NULL;
+    }
+    /* Arrays are copied straight from the native keys, so the items have to
+     * be their own keys */
+    if (self->outarray && Py_SIZE(xs) > 0 &&
+        (self->nkeys == NULL || self->keyfunc != NULL ||
+         self->batchkey != NULL || self->givenkeys ||
+         (self->nkind != NATIVE_INT && self->nkind != NATIVE_FLOAT))) {
+        PyErr_SetString(PyExc_TypeError,
+                        "out='array' requires int or float items and no key");
+        Py_DECREF(self);
+        return NULL;
+    }
+    /* Kept nulls only have their sentinel keys, which an array couldn't tell
+     * apart from real values */
+    if (self->outarray && self->nullmode != NULLS_NONE &&
+        self->nullmode != NULLS_DROP) {
+        PyErr_SetString(PyExc_TypeError,
+                        "out='array' can't hold nulls, use nulls='drop'");
+        Py_DECREF(self);
+        return NULL;
+    }
+    if (weights != NULL && weights != Py_None) {
+        if (self->nkeys == NULL && Py_SIZE(xs) > 0) {
+            PyErr_SetString(PyExc_TypeError,
+                            "weights require int or float keys");
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (parse_weights(self, weights) < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    if (mask != NULL) {
+        if (self->nkeys == NULL && Py_SIZE(xs) > 0) {
+            PyErr_SetString(PyExc_TypeError,
+                            "mask requires int or float keys");
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (apply_mask(self, mask) < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    else if (self->nanmode == NAN_DROP && self->nan_count > 0) {
+        drop_nans(self);
+    }
+    if (self->weights != NULL) {
+        Py_ssize_t i;
+        for (i = 0; i < Py_SIZE(xs); i++)
+            self->total_weight += self->weights[i];
+    }
+
+    /* The pivots go in last, since dropping NaNs or nulls changes the
+     * length */
+    if (narrow_native_keys(self) < 0 ||
+        init_pivots(&self->pivots, Py_SIZE(xs), self->nkeys, self->nwidth,
+                    self->nbase, self->weights, self->total_weight) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject *)self;
+}
+
+static PyObject *strided_native_array(const int64_t *, Py_ssize_t,
+                                      Py_ssize_t, int, int);
+
+#if PY_VERSION_HEX >= 0x02060000
+/* Returns struct.calcsize(fmt), or -1 on error */
+static Py_ssize_t
+struct_calcsize(PyObject *calcsize, PyObject *fmt)
+{
+    if (fmt == NULL)
+        return -1;
+    PyObject *size = PyObject_CallFunctionObjArgs(calcsize, fmt, NULL);
+    Py_DECREF(fmt);
+    if (size == NULL)
+        return -1;
+    Py_ssize_t result = PyNumber_AsSsize_t(size, PyExc_OverflowError);
+    Py_DECREF(size);
+    return result;
+}
+
+/* Finds field number field of the records of the struct format fmt. Its type
+ * code goes in code, its offset into each record in offset, and whether it
+ * has to be byte swapped in swap. Returns 0 on success and -1 on error. */
+static int
+parse_record_field(PyObject *calcsize, const char *fmt, Py_ssize_t field,
+                   char *code, Py_ssize_t *offset, int *swap)
+{
+    const int one = 1;
+    int little = *(const char *)&one;
+    char order[2] = {0, 0};
+    const char *p = fmt;
+    Py_ssize_t first = 0;
+
+    *swap = 0;
+    if (*p != '\0' && strchr("@=<>!", *p) != NULL) {
+        order[0] = *p;
+        *swap = *p == '<' ? !little : (*p == '>' || *p == '!') && little;
+        p++;
+    }
+
+    /* struct has already checked that fmt is well formed */
+    while (*p != '\0') {
+        if (strchr(" \t\n\r\v\f", *p) != NULL) {
+            p++;
+            continue;
+        }
+        const char *token = p;
+        Py_ssize_t count = 1;
+        if ('0' <= *p && *p <= '9') {
+            count = 0;
+            while ('0' <= *p && *p <= '9')
+                count = count * 10 + (*p++ - '0');
+        }
+        char c = *p++;
+        if (c == 'x')
+            continue;
+        /* A count before s or p is the length of one string */
+        Py_ssize_t fields = c == 's' || c == 'p' ? 1 : count;
+
+        if (field < first + fields) {
+            if (strchr("bBhHiIlLqQnNfd?", c) == NULL) {
+                PyErr_SetString(PyExc_TypeError,
+                                "the field must be an int or float");
+                return -1;
+            }
+            /* struct never pads the end of a format, so the field ends where
+             * a format of everything up to and including it does */
+            size_t len = token - fmt;
+            char *prefix = (char *)PyMem_Malloc(len + 32);
+            if (prefix == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            memcpy(prefix, fmt, len);
+            PyOS_snprintf(prefix + len, 32, "%ld%c",
+                          (long)(field - first + 1), c);
+            Py_ssize_t end = struct_calcsize(calcsize,
+                                             PyString_FromString(prefix));
+            PyMem_Free(prefix);
+            Py_ssize_t size = struct_calcsize(
+                calcsize, PyString_FromFormat("%s%c", order, c));
+            if (end < 0 || size < 0)
+                return -1;
+            *offset = end - size;
+            /* Standard sizes are the C sizes, except for longs */
+            *code = order[0] != '\0' && order[0] != '@' && c == 'l' ? 'i'
+                  : order[0] != '\0' && order[0] != '@' && c == 'L' ? 'I'
+                  : c;
+            return 0;
+        }
+        first += fields;
+    }
+
+    PyErr_SetString(PyExc_IndexError, "field index out of range");
+    return -1;
+}
+
+/* Makes a LazySorted of the numbers of the records in buffer, (which are laid
+ * out as the struct format fmt says), keyed by one of their fields. The keys
+ * are read straight out of the buffer, and the buffer is kept so that ranges
+ * can be returned as the bytes of their records. */
+static PyObject *
+from_records(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *buffer;
+    const char *fmt;
+    Py_ssize_t field = 0;
+    PyObject *calcsize = NULL, *rows = NULL, *column = NULL;
+    PyObject *ls_args = NULL, *ls = NULL;
+    Py_buffer *view = NULL;
+    int64_t *nkeys = NULL;
+    char code;
+    Py_ssize_t offset, i, n;
+    int swap;
+
+    if (!PyArg_ParseTuple(args, "Os|n:from_records", &buffer, &fmt, &field))
+        return NULL;
+
+    /* Everything but field is passed on to LazySorted */
+    PyObject *ls_kwds = kwds != NULL ? PyDict_Copy(kwds) : PyDict_New();
+    if (ls_kwds == NULL)
+        return NULL;
+    PyObject *field_obj = PyDict_GetItemString(ls_kwds, "field");
+    if (field_obj != NULL) {
+        field = PyNumber_AsSsize_t(field_obj, PyExc_IndexError);
+        if ((field == -1 && PyErr_Occurred()) ||
+            PyDict_DelItemString(ls_kwds, "field") < 0)
+            goto done;
+    }
+    if (PyDict_GetItemString(ls_kwds, "key") != NULL ||
+        PyDict_GetItemString(ls_kwds, "batch_key") != NULL ||
+        PyDict_GetItemString(ls_kwds, "keys") != NULL ||
+        PyDict_GetItemString(ls_kwds, "out") != NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "from_records takes no key, batch_key, keys or out");
+        goto done;
+    }
+    if (field < 0) {
+        PyErr_SetString(PyExc_IndexError, "field index out of range");
+        goto done;
+    }
+
+    PyObject *module = PyImport_ImportModule("struct");
+    if (module == NULL)
+        goto done;
+    calcsize = PyObject_GetAttrString(module, "calcsize");
+    Py_DECREF(module);
+    if (calcsize == NULL)
+        goto done;
+    Py_ssize_t size = struct_calcsize(calcsize, PyString_FromString(fmt));
+    if (size < 0 ||
+        parse_record_field(calcsize, fmt, field, &code, &offset, &swap) < 0)
+        goto done;
+
+    view = PyMem_New(Py_buffer, 1);
+    if (view == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (PyObject_GetBuffer(buffer, view, PyBUF_SIMPLE) < 0) {
+        PyMem_Free(view);
+        view = NULL;
+        goto done;
+    }
+    if (view->len % size != 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the buffer isn't a whole number of records");
+        goto done;
+    }
+    n = view->len / size;
+
+    /* The field goes through an array, so that LazySorted treats it exactly
+     * like keys=array */
+    nkeys = PyMem_New(int64_t, n > 0 ? n : 1);
+    if (nkeys == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    Py_ssize_t nans = 0;
+    if (!convert_strided((const char *)view->buf + offset, size, n, code,
+                         swap, 1, nkeys, &nans)) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "the field has values too big for 64 bit ints");
+        goto done;
+    }
+    column = strided_native_array(nkeys, 1, n,
+                                  strchr("fd", code) != NULL ? NATIVE_FLOAT
+                                                             : NATIVE_INT, 0);
+    if (column == NULL || PyDict_SetItemString(ls_kwds, "keys", column) < 0)
+        goto done;
+
+    /* The items are the numbers of the records */
+    rows = PyList_New(n);
+    if (rows == NULL)
+        goto done;
+    for (i = 0; i < n; i++) {
+        PyObject *row = PyInt_FromSsize_t(i);
+        if (row == NULL)
+            goto done;
+        PyList_SET_ITEM(rows, i, row);
+    }
+    ls_args = PyTuple_Pack(1, rows);
+    if (ls_args == NULL)
+        goto done;
+
+    ls = newLSObject(type, ls_args, ls_kwds);
+    if (ls != NULL) {
+        ((LSObject *)ls)->records = view;
+        ((LSObject *)ls)->record_size = size;
+        view = NULL;
+    }
+
+done:
+    if (view != NULL) {
+        PyBuffer_Release(view);
+        PyMem_Free(view);
+    }
+    PyMem_Free(nkeys);
+    Py_XDECREF(calcsize);
+    Py_XDECREF(column);
+    Py_XDECREF(rows);
+    Py_XDECREF(ls_args);
+    Py_DECREF(ls_kwds);
+    return ls;
+}
+#endif
+
+/* Converts a column of from_columns, (a buffer or a sequence of numbers or
+ * times), to native keys, which go in *out, with their number in n and their
+ * kind in kind. NaNs become NAN_KEY. Returns 0 on success and -1 on error. */
+static int
+column_keys(PyObject *column, int64_t **out, Py_ssize_t *n, int *kind)
+{
+    Py_ssize_t nans;
+    int ok;
+
+#if PY_VERSION_HEX >= 0x02060000
+    Py_buffer view;
+    char format;
+    if (open_numeric_buffer(column, &view, &format)) {
+        *n = view.shape[0];
+        *out = PyMem_New(int64_t, *n > 0 ? *n : 1);
+        if (*out == NULL) {
+            PyBuffer_Release(&view);
+            PyErr_NoMemory();
+            return -1;
+        }
+        ok = convert_buffer(&view, format, 1, *out, &nans);
+        PyBuffer_Release(&view);
+        *kind = strchr("fd", format) != NULL ? NATIVE_FLOAT : NATIVE_INT;
+        if (!ok) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "column values too big for 64 bit ints");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    PyObject *seq = PySequence_Fast(column, "columns must be sequences");
+    if (seq == NULL)
+        return -1;
+    *n = PySequence_Fast_GET_SIZE(seq);
+    *out = PyMem_New(int64_t, *n > 0 ? *n : 1);
+    if (*out == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    ok = items_to_native(PySequence_Fast_ITEMS(seq), *n, 1, *out, kind,
+                         &nans);
+    Py_DECREF(seq);
+    if (!ok) {
+        PyErr_SetString(PyExc_TypeError,
+                        "columns must be of ints, floats or times");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Replaces the n keys with their dense ranks: 0 for the smallest distinct
+ * key, 1 for the next, and so on. Returns the number of distinct keys, or -1
+ * on error. */
+static Py_ssize_t
+rank_keys(int64_t *keys, Py_ssize_t n)
+{
+    Py_ssize_t i, d = 0;
+
+    int64_t *distinct = PyMem_New(int64_t, n > 0 ? n : 1);
+    if (distinct == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    /* libc's qsort, rather than the engine's, which slows down on columns
+     * with lots of duplicates */
+    memcpy(distinct, keys, n * sizeof(int64_t));
+    qsort(distinct, n, sizeof(int64_t), compare_int64);
+    for (i = 0; i < n; i++) {
+        if (d == 0 || distinct[d - 1] != distinct[i])
+            distinct[d++] = distinct[i];
+    }
+
+    for (i = 0; i < n; i++) {
+        Py_ssize_t lo = 0, hi = d - 1;
+        while (lo < hi) {
+            Py_ssize_t mid = lo + (hi - lo) / 2;
+            if (distinct[mid] < keys[i])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        keys[i] = lo;
+    }
+
+    PyMem_Free(distinct);
+    return d;
+}
+
+/* Returns the number of bits in v, not counting leading zeros */
+static int
+bit_length(uint64_t v)
+{
+    int bits = 0;
+    while (v != 0) {
+        bits++;
+        v >>= 1;
+    }
+    return bits;
+}
+
+/* Makes a LazySorted of the numbers of the rows of columns, ordered by the
+ * first column, then the second, and so on. Each column is converted to
+ * native keys, and the columns are packed into a single native key per row,
+ * with the fewest bits each column's range of keys needs. Columns whose range
+ * is too wide for that, (like most float columns), are replaced by their
+ * ranks first, widest first. Only if the ranks don't fit either are the keys
+ * tuples of the columns' native keys, which python compares. */
+static PyObject *
+from_columns(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *columns;
+    PyObject *descending = NULL;
+    PyObject *cols = NULL, *desc = NULL, *rows = NULL, *keys = NULL;
+    PyObject *ls_args = NULL, *ls = NULL;
+    int64_t **ckeys = NULL;
+    int64_t *packed = NULL;
+    int64_t *mins = NULL;
+    int *bits = NULL;
+    char *ranked = NULL;
+    Py_ssize_t c, i, ncols = 0, n = 0;
+
+    if (!PyArg_ParseTuple(args, "O|O:from_columns", &columns, &descending))
+        return NULL;
+
+    /* Everything but descending is passed on to LazySorted */
+    PyObject *ls_kwds = kwds != NULL ? PyDict_Copy(kwds) : PyDict_New();
+    if (ls_kwds == NULL)
+        return NULL;
+    PyObject *desc_obj = PyDict_GetItemString(ls_kwds, "descending");
+    if (desc_obj != NULL) {
+        descending = desc_obj;
+        Py_INCREF(descending);
+        if (PyDict_DelItemString(ls_kwds, "descending") < 0)
+            goto done;
+    }
+    else {
+        Py_XINCREF(descending);
+    }
+    if (PyDict_GetItemString(ls_kwds, "key") != NULL ||
+        PyDict_GetItemString(ls_kwds, "batch_key") != NULL ||
+        PyDict_GetItemString(ls_kwds, "keys") != NULL ||
+        PyDict_GetItemString(ls_kwds, "out") != NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "from_columns takes no key, batch_key, keys or out");
+        goto done;
+    }
+
+    cols = PySequence_Fast(columns, "columns must be a sequence");
+    if (cols == NULL)
+        goto done;
+    ncols = PySequence_Fast_GET_SIZE(cols);
+    if (ncols == 0) {
+        PyErr_SetString(PyExc_ValueError, "from_columns needs a column");
+        goto done;
+    }
+    if (descending != NULL && descending != Py_None) {
+        desc = PySequence_Fast(descending, "descending must be a sequence");
+        if (desc == NULL)
+            goto done;
+        if (PySequence_Fast_GET_SIZE(desc) != ncols) {
+            PyErr_SetString(PyExc_ValueError,
+                            "descending must have one flag per column");
+            goto done;
+        }
+    }
+
+    ckeys = PyMem_New(int64_t *, ncols);
+    mins = PyMem_New(int64_t, ncols);
+    bits = PyMem_New(int, ncols);
+    ranked = PyMem_New(char, ncols);
+    if (ckeys == NULL || mins == NULL || bits == NULL || ranked == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (c = 0; c < ncols; c++) {
+        ckeys[c] = NULL;
+        ranked[c] = 0;
+    }
+
+    int total_bits = 0;
+    for (c = 0; c < ncols; c++) {
+        Py_ssize_t len;
+        int kind;
+        if (column_keys(PySequence_Fast_GET_ITEM(cols, c), &ckeys[c], &len,
+                        &kind) < 0)
+            goto done;
+        if (c > 0 && len != n) {
+            PyErr_SetString(PyExc_ValueError,
+                            "columns must all have the same length");
+            goto done;
+        }
+        n = len;
+
+        if (desc != NULL) {
+            int flag = PyObject_IsTrue(PySequence_Fast_GET_ITEM(desc, c));
+            if (flag < 0)
+                goto done;
+            if (flag)
+                reverse_native_keys(ckeys[c], n, kind);
+        }
+
+        int64_t lo = n > 0 ? ckeys[c][0] : 0, hi = lo;
+        for (i = 1; i < n; i++) {
+            lo = ckeys[c][i] < lo ? ckeys[c][i] : lo;
+            hi = ckeys[c][i] > hi ? ckeys[c][i] : hi;
+        }
+        mins[c] = lo;
+        bits[c] = bit_length((uint64_t)hi - (uint64_t)lo);
+        total_bits += bits[c];
+    }
+
+    /* Rank the widest columns until they all fit, (ranks start at 0) */
+    while (total_bits > 63) {
+        Py_ssize_t widest = -1;
+        for (c = 0; c < ncols; c++) {
+            if (!ranked[c] && (widest < 0 || bits[c] > bits[widest]))
+                widest = c;
+        }
+        if (widest < 0)
+            break;
+        Py_ssize_t distinct = rank_keys(ckeys[widest], n);
+        if (distinct < 0)
+            goto done;
+        int rank_bits = bit_length(distinct > 0 ? distinct - 1 : 0);
+        total_bits += rank_bits - bits[widest];
+        bits[widest] = rank_bits;
+        mins[widest] = 0;
+        ranked[widest] = 1;
+    }
+
+    if (total_bits <= 63) {
+        packed = PyMem_New(int64_t, n > 0 ? n : 1);
+        if (packed == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        for (i = 0; i < n; i++) {
+            uint64_t v = 0;
+            for (c = 0; c < ncols; c++) {
+                v = bits[c] > 0 ? v << bits[c] : v;
+                v |= (uint64_t)ckeys[c][i] - (uint64_t)mins[c];
+            }
+            packed[i] = (int64_t)v;
+        }
+        keys = strided_native_array(packed, 1, n, NATIVE_INT, 0);
+    }
+    else {
+        keys = PyList_New(n);
+        for (i = 0; keys != NULL && i < n; i++) {
+            PyObject *key = PyTuple_New(ncols);
+            if (key == NULL) {
+                Py_CLEAR(keys);
+                break;
+            }
+            PyList_SET_ITEM(keys, i, key);
+            for (c = 0; c < ncols; c++) {
+                PyObject *v = PyLong_FromLongLong(ckeys[c][i]);
+                if (v == NULL) {
+                    Py_CLEAR(keys);
+                    break;
+                }
+                PyTuple_SET_ITEM(key, c, v);
+            }
+        }
+    }
+    if (keys == NULL || PyDict_SetItemString(ls_kwds, "keys", keys) < 0)
+        goto done;
+
+    /* The items are the numbers of the rows */
+    rows = PyList_New(n);
+    if (rows == NULL)
+        goto done;
+    for (i = 0; i < n; i++) {
+        PyObject *row = PyInt_FromSsize_t(i);
+        if (row == NULL)
+            goto done;
+        PyList_SET_ITEM(rows, i, row);
+    }
+    ls_args = PyTuple_Pack(1, rows);
+    if (ls_args == NULL)
+        goto done;
+
+    ls = newLSObject(type, ls_args, ls_kwds);
+
+done:
+    if (ckeys != NULL) {
+        for (c = 0; c < ncols; c++)
+            PyMem_Free(ckeys[c]);
+    }
+    PyMem_Free(ckeys);
+    PyMem_Free(packed);
+    PyMem_Free(mins);
+    PyMem_Free(bits);
+    PyMem_Free(ranked);
+    Py_XDECREF(descending);
+    Py_XDECREF(cols);
+    Py_XDECREF(desc);
+    Py_XDECREF(keys);
+    Py_XDECREF(rows);
+    Py_XDECREF(ls_args);
+    Py_DECREF(ls_kwds);
+    return ls;
+}
+
+/* Private helper functions for partial sorting */
+
+/* These macros are basically taken from list.c
+ * Returns 1 if x < y, 0 if x >= y, and -1 on error. x and y are keys, (or
+ * items if there is no key function) */
+/* #define ISLT(X, Y) PyObject_RichCompareBool(X, Y, Py_LT) */
+
+static inline int islt(PyObject *, PyObject *, LSObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static inline int
+islt(PyObject *x, PyObject *y, LSObject *ls)
+{
+    return ls->reverse ? PyObject_RichCompareBool(x, y, Py_GT)
+                       : PyObject_RichCompareBool(x, y, Py_LT);
+}
+
+#define IFLT(X, Y) if ((ltflag = islt(X, Y, ls)) < 0) goto fail;  \
+            if(ltflag)
+
+/* N.B: No semicolon at the end, so that you can include one yourself.
+ * Expects ob_item and key_item, (NULL if there are no keys), to be in scope */
+#define SWAP(i, j) tmp = ob_item[i];  \
+                   ob_item[i] = ob_item[j];  \
+                   ob_item[j] = tmp;  \
+                   if (key_item != NULL) {  \
+                       tmp = key_item[i];  \
+                       key_item[i] = key_item[j];  \
+                       key_item[j] = tmp;  \
+                   }
+
+/* Native versions of the sorting primitives below, used when ls->nkeys is
+ * set. They can't fail, and they keep the items of xs in step with the keys.
+ * They are the int64 instantiations of the C++ engine in lazysorted.hpp, and
+ * are defined in lazysorted_engine.cpp. */
+ptrdiff_t lazysorted_native_partition(void *, int, void **, ptrdiff_t,
+                                      ptrdiff_t);
+void lazysorted_native_insertion_sort(void *, int, void **, ptrdiff_t,
+                                      ptrdiff_t);
+void lazysorted_native_quick_sort(void *, int, void **, ptrdiff_t,
+                                  ptrdiff_t);
+ptrdiff_t lazysorted_native_weighted_partition(void *, int, void **,
+                                               double *, ptrdiff_t,
+                                               ptrdiff_t);
+void lazysorted_native_weighted_insertion_sort(void *, int, void **,
+                                               double *, ptrdiff_t,
+                                               ptrdiff_t);
+void lazysorted_native_weighted_quick_sort(void *, int, void **, double *,
+                                           ptrdiff_t, ptrdiff_t);
+
+/* Returns whichever of idx1, idx2 and idx3 has the median key, given their
+ * keys, or -1 on error */
+static Py_ssize_t median_of_three(LSObject *, Py_ssize_t, PyObject *,
+                                  Py_ssize_t, PyObject *,
+                                  Py_ssize_t, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+median_of_three(LSObject *ls, Py_ssize_t idx1, PyObject *key1,
+                Py_ssize_t idx2, PyObject *key2,
+                Py_ssize_t idx3, PyObject *key3)
+{
+    int ltflag;
+    IFLT(key1, key3) {
+        IFLT(key1, key2) {
+            /* 1 2 3 vs. 1 3 2 */
+            IFLT(key2, key3) {
+                return idx2;
+            }
+            else {
+                return idx3;
+            }
+        }
+        else {
+            /* 2 1 3 */
+            return idx1;
+        }
+    }
+    else {
+        IFLT(key3, key2) {
+            /* 3 1 2 vs 3 2 1 */
+            IFLT(key1, key2) {
+                return idx1;
+            }
+            else {
+                return idx2;
+            }
+        }
+        else {
+            /* 2 3 1 */
+            return idx3;
+        }
+    }
+
+fail:
+    return -1;
+}
+
+/* Picks a pivot point among the indices left <= i < right. Returns -1 on
+ * error */
+
+static Py_ssize_t pick_pivot(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+pick_pivot(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    PyObject **cmp_item = LS_KEYS(ls);
+
+    /* Use median of three trick */
+    Py_ssize_t idx1 = left + rand() % (right - left);
+    Py_ssize_t idx2 = left + rand() % (right - left);
+    Py_ssize_t idx3 = left + rand() % (right - left);
+
+    return median_of_three(ls, idx1, cmp_item[idx1], idx2, cmp_item[idx2],
+                           idx3, cmp_item[idx3]);
+}
+
+/* partition for when some of the lazy keys between left and right didn't fit
+ * in the budget. Keys that aren't cached are computed as needed, except for
+ * the pivot's, which is kept from choosing it. */
+static Py_ssize_t lazy_partition(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+lazy_partition(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **key_item = ls->keys->ob_item;
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    PyObject *pivot, *key;
+    PyObject *key1, *key2, *key3;
+    int ltflag;
+
+    Py_ssize_t idx1 = left + rand() % (right - left);
+    Py_ssize_t idx2 = left + rand() % (right - left);
+    Py_ssize_t idx3 = left + rand() % (right - left);
+
+    key1 = key_at(ls, idx1);
+    key2 = key1 == NULL ? NULL : key_at(ls, idx2);
+    key3 = key2 == NULL ? NULL : key_at(ls, idx3);
+    Py_ssize_t piv_idx = key3 == NULL ? -1 : median_of_three(ls, idx1, key1,
+                                                             idx2, key2,
+                                                             idx3, key3);
+
+    /* The pivot's key is kept, (it goes with its item through the SWAP) */
+    pivot = NULL;
+    if (piv_idx == idx1) {
+        pivot = key1;
+        key1 = NULL;
+    }
+    else if (piv_idx == idx2) {
+        pivot = key2;
+        key2 = NULL;
+    }
+    else if (piv_idx == idx3) {
+        pivot = key3;
+        key3 = NULL;
+    }
+    Py_XDECREF(key1);
+    Py_XDECREF(key2);
+    Py_XDECREF(key3);
+    if (piv_idx < 0) {
+        return -1;
+    }
+
+    SWAP(left, piv_idx);
+    Py_ssize_t last_less = left;
+
+    Py_ssize_t i;
+    for (i = left + 1; i < right; i++) {
+        if ((key = key_at(ls, i)) == NULL)
+            goto fail;
+        ltflag = islt(key, pivot, ls);
+        Py_DECREF(key);
+        if (ltflag < 0)
+            goto fail;
+        if (ltflag) {
+            last_less++;
+            SWAP(i, last_less);
+        }
+    }
+
+    SWAP(left, last_less);
+    Py_DECREF(pivot);
+    return last_less;
+
+fail:
+    Py_DECREF(pivot);
+    return -1;
+}
+
+/* Partitions the data between left and right into
+ * [less than region | greater or equal to region]
+ * and returns the pivot index, or -1 on error */
+static Py_ssize_t partition(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+partition(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    if (ls->weights != NULL)
+        return lazysorted_native_weighted_partition(ls->nkeys, ls->nwidth,
+                                                    (void **)ls->xs->ob_item,
+                                                    ls->weights, left, right);
+    if (ls->nkeys != NULL)
+        return lazysorted_native_partition(ls->nkeys, ls->nwidth,
+                                           (void **)ls->xs->ob_item, left,
+                                           right);
+
+    if (ls->lazykeys) {
+        int filled = fill_keys(ls, left, right, 0);
+        if (filled < 0)
+            return -1;
+        if (!filled)
+            return lazy_partition(ls, left, right);
+    }
+
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **key_item = ls->keys != NULL ? ls->keys->ob_item : NULL;
+    PyObject **cmp_item = LS_KEYS(ls);
+
+    PyObject *tmp;  /* Used by SWAP macro */
+    PyObject *pivot;
+    int ltflag;
+
+    Py_ssize_t piv_idx = pick_pivot(ls, left, right);
+    if (piv_idx < 0) {
+        return -1;
+    }
+    pivot = cmp_item[piv_idx];
+
+    SWAP(left, piv_idx);
+    Py_ssize_t last_less = left;
+
+    /* Invariant: last_less and everything to its left is less than
+     * pivot or the pivot itself */
+
+    Py_ssize_t i;
+    for (i = left + 1; i < right; i++) {
+        /*
+        This single line boosts performance by a factor of around 2 on GCC.
+        The optimal lookahead distance i+3 was chosen by experimentation.
+        See http://www.naftaliharris.com/blog/2x-speedup-with-one-line-of-code/
+        */
+        __builtin_prefetch(cmp_item[i+3]);
+        IFLT(cmp_item[i], pivot) {
+            last_less++;
+            SWAP(i, last_less);
+        }
+    }
+
+    SWAP(left, last_less);
+    return last_less;
+
+fail:  /* From IFLT macro */
+    return -1;
+}
+
+/* Runs insertion sort on the items left <= i < right */
+static int insertion_sort(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+insertion_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    if (ls->weights != NULL) {
+        lazysorted_native_weighted_insertion_sort(ls->nkeys, ls->nwidth,
+                                                  (void **)ls->xs->ob_item,
+                                                  ls->weights, left, right);
+        return 0;
+    }
+    if (ls->nkeys != NULL) {
+        lazysorted_native_insertion_sort(ls->nkeys, ls->nwidth,
+                                         (void **)ls->xs->ob_item, left,
+                                         right);
+        return 0;
+    }
+
+    /* Insertion sort only runs on small regions, which are sorted afterwards,
+     * so their lazy keys are only around very briefly */
+    if (ls->lazykeys && fill_keys(ls, left, right, 1) < 0) {
+        return -1;
+    }
+
+    PyObject **ob_item = ls->xs->ob_item;
+    PyObject **key_item = ls->keys != NULL ? ls->keys->ob_item : NULL;
+    PyObject **cmp_item = LS_KEYS(ls);
+
+    PyObject *tmp, *tmpkey;
+    Py_ssize_t i, j;
+
+    for (i = left; i < right; i++) {
+        tmp = ob_item[i];
+        tmpkey = cmp_item[i];
+        int ltflag = 0;
+        for (j = i;
+             j > left && (ltflag = islt(tmpkey, cmp_item[j - 1], ls)) > 0;
+             j--) {
+            ob_item[j] = ob_item[j - 1];
+            if (key_item != NULL)
+                key_item[j] = key_item[j - 1];
+        }
+        ob_item[j] = tmp;
+        if (key_item != NULL)
+            key_item[j] = tmpkey;
+        if (ltflag < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Runs quicksort on the items left <= i < right, returning 0 on success
+ * or -1 on error. Does not affect stored pivots at all. */
+static int quick_sort(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+quick_sort(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    if (ls->weights != NULL) {
+        lazysorted_native_weighted_quick_sort(ls->nkeys, ls->nwidth,
+                                              (void **)ls->xs->ob_item,
+                                              ls->weights, left, right);
+        return 0;
+    }
+    if (ls->nkeys != NULL) {
+        lazysorted_native_quick_sort(ls->nkeys, ls->nwidth,
+                                     (void **)ls->xs->ob_item, left, right);
+        return 0;
+    }
+
+    if (right - left <= SORT_THRESH) {
+        return insertion_sort(ls, left, right);
+    }
+
+    Py_ssize_t piv_idx = partition(ls, left, right);
+    if (piv_idx < 0)
+        return -1;
+
+    if (quick_sort(ls, left, piv_idx) < 0)
+        return -1;
+
+    if (quick_sort(ls, piv_idx + 1, right) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Records that the data between the pivots left and right is sorted, and
+ * removes any pivots that become redundant */
+static void
+mark_sorted(LSObject *ls, Pivot left, Pivot right)
+{
+    PivotTree *tree = &ls->pivots;
+    ADD_FLAGS(tree, left, SORTED_LEFT);
+    ADD_FLAGS(tree, right, SORTED_RIGHT);
+    /* The pivots that depivot removes end up inside a sorted region too */
+    Py_ssize_t left_idx = PIVOT_IDX(tree, left);
+    Py_ssize_t right_idx = PIVOT_IDX(tree, right);
+    if (PIVOT_FLAGS(tree, left) & SORTED_RIGHT)
+        left_idx--;
+    if (PIVOT_FLAGS(tree, right) & SORTED_LEFT)
+        right_idx++;
+    evict_keys(ls, left_idx + 1, right_idx);
+    depivot(tree, left, right);
+}
+
+/* Inserts the pivot piv_idx between the adjacent pivots left and right,
+ * starting from whichever of them is lower in the tree. Returns the new node,
+ * or NO_PIVOT on error. */
+static Pivot
+insert_between(PivotTree *tree, Py_ssize_t piv_idx, Pivot left, Pivot right)
+{
+    Pivot node = insert_pivot(tree, piv_idx, UNSORTED,
+                              NODE(tree, left).right == NO_PIVOT ? left
+                                                                 : right);
+    if (node != NO_PIVOT && tree->weights != NULL) {
+        Py_ssize_t i = PIVOT_IDX(tree, left);
+        double cum = tree->cum[left] + (i >= 0 ? tree->weights[i] : 0.0);
+        for (i++; i < piv_idx; i++)
+            cum += tree->weights[i];
+        tree->cum[node] = cum;
+    }
+    return node;
+}
+
+/* Pivot budget. Every partition leaves a pivot behind, so an object that is
+ * queried at many scattered indices can build up a huge pivot tree. The
+ * tree can be compacted by removing the least valuable pivots: those whose
+ * removal leaves the smallest unsorted region behind, since that is what has
+ * to be partitioned again, and only then the ones at the ends of sorted
+ * regions. */
+
+static int
+compare_ssize(const void *a, const void *b)
+{
+    Py_ssize_t x = *(const Py_ssize_t *)a;
+    Py_ssize_t y = *(const Py_ssize_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Removes the pivot node from between the pivots left and right, forgetting
+ * about any sorted region it bounds */
+static void
+remove_pivot(PivotTree *tree, Pivot left, Pivot node, Pivot right)
+{
+    assert(PIVOT_FLAGS(tree, node) != SORTED_BOTH);
+    if (PIVOT_FLAGS(tree, node) & SORTED_RIGHT)
+        CLEAR_FLAGS(tree, left, SORTED_LEFT);
+    if (PIVOT_FLAGS(tree, node) & SORTED_LEFT)
+        CLEAR_FLAGS(tree, right, SORTED_RIGHT);
+    delete_node(tree, node);
+}
+
+/* Rebuilds the tree in a new arena that just fits it, to give back the memory
+ * of the nodes that have been removed. Returns 0 on success and -1 on
+ * error, in which case the tree is unchanged. */
+static int
+repack_pivots(PivotTree *tree, Pivot *order)
+{
+    PivotTree packed;
+    Py_ssize_t count = tree->count;
+    Py_ssize_t i;
+    Pivot node;
+
+    packed.nodes = (PivotNode *)storage_malloc(count * tree->stride);
+    packed.idx_hi = tree->wide
+                    ? (int32_t *)storage_malloc(count * sizeof(int32_t))
+                    : NULL;
+    packed.cum = tree->weights != NULL
+                 ? (double *)storage_malloc(count * sizeof(double)) : NULL;
+    if (packed.nodes == NULL || (tree->wide && packed.idx_hi == NULL) ||
+        (tree->weights != NULL && packed.cum == NULL)) {
+        storage_free(packed.nodes);
+        storage_free(packed.idx_hi);
+        storage_free(packed.cum);
+        PyErr_NoMemory();
+        return -1;
+    }
+    packed.stride = tree->stride;
+    packed.source = tree->source;
+    packed.width = tree->width;
+    packed.base = tree->base;
+    packed.length = tree->length;
+    packed.weights = tree->weights;
+    packed.wide = tree->wide;
+    packed.root = NO_PIVOT;
+    packed.free = NO_PIVOT;
+    packed.used = 0;
+    packed.allocated = (Pivot)count;
+    packed.count = 0;
+
+    /* The flags go in afterwards, since the tree's flags are only consistent
+     * once both ends of each sorted region are in it */
+    for (i = 0; i < count; i++) {
+        node = insert_pivot(&packed, PIVOT_IDX(tree, order[i]), UNSORTED,
+                            packed.root);
+        assert(node != NO_PIVOT);
+    }
+    node = packed.root;
+    while (NODE(&packed, node).left != NO_PIVOT)
+        node = NODE(&packed, node).left;
+    for (i = 0; i < count; i++, node = next_pivot(&packed, node)) {
+        ADD_FLAGS(&packed, node, PIVOT_FLAGS(tree, order[i]));
+        if (tree->weights != NULL)
+            packed.cum[node] = tree->cum[order[i]];
+    }
+
+    free_pivots(tree);
+    *tree = packed;
+    assert_tree(tree);
+    assert_tree_flags(tree);
+    return 0;
+}
+
+/* Removes the least valuable pivots until at most max_pivots are left, (not
+ * counting the two at either end), and gives the memory back. Returns 0 on
+ * success and -1 on error. */
+static int compact_pivots(LSObject *, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+compact_pivots(LSObject *ls, Py_ssize_t max_pivots)
+{
+    PivotTree *tree = &ls->pivots;
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    Py_ssize_t target = max_pivots + 2;
+    Py_ssize_t count = tree->count;
+    Py_ssize_t m, i, removed, threshold;
+    Pivot node;
+
+    assert(max_pivots >= 0);
+    Pivot *order = PyMem_New(Pivot, count);
+    Py_ssize_t *costs = PyMem_New(Py_ssize_t, count);
+    Py_ssize_t *sorted_costs = PyMem_New(Py_ssize_t, count);
+    if (order == NULL || costs == NULL || sorted_costs == NULL) {
+        PyMem_Free(order);
+        PyMem_Free(costs);
+        PyMem_Free(sorted_costs);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    /* Each pass removes the cheapest pivots, (but never two neighbours, whose
+     * costs depend on each other), until there are few enough */
+    while (tree->count > target) {
+        node = tree->root;
+        while (NODE(tree, node).left != NO_PIVOT)
+            node = NODE(tree, node).left;
+        for (m = 0; node != NO_PIVOT; m++, node = next_pivot(tree, node))
+            order[m] = node;
+
+        for (i = 1; i < m - 1; i++) {
+            costs[i] = PIVOT_IDX(tree, order[i + 1])
+                       - PIVOT_IDX(tree, order[i - 1]);
+            if (PIVOT_FLAGS(tree, order[i]) != UNSORTED)
+                costs[i] += xs_len + 1;
+            sorted_costs[i - 1] = costs[i];
+        }
+        qsort(sorted_costs, m - 2, sizeof(Py_ssize_t), compare_ssize);
+        threshold = sorted_costs[m - target - 1];
+
+        removed = 0;
+        for (i = 1; i < m - 1 && removed < m - target; i++) {
+            if (costs[i] <= threshold) {
+                remove_pivot(tree, order[i - 1], order[i], order[i + 1]);
+                removed++;
+                i++;
+            }
+        }
+    }
+
+    /* Repacking is just an optimization, so it's fine if it fails */
+    if (tree->allocated > 2 * tree->count + 8) {
+        node = tree->root;
+        while (NODE(tree, node).left != NO_PIVOT)
+            node = NODE(tree, node).left;
+        for (m = 0; node != NO_PIVOT; m++, node = next_pivot(tree, node))
+            order[m] = node;
+        if (repack_pivots(tree, order) < 0)
+            PyErr_Clear();
+    }
+
+    PyMem_Free(order);
+    PyMem_Free(costs);
+    PyMem_Free(sorted_costs);
+    assert_tree(tree);
+    assert_tree_flags(tree);
+    return 0;
+}
+
+/* Compacts the pivot tree if it has outgrown the budget. This must only be
+ * called between operations, since it can remove any pivot: halving the tree
+ * keeps the cost of compacting to O(log n) per pivot inserted. Returns 0 on
+ * success and -1 on error. */
+static int limit_pivots(LSObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+limit_pivots(LSObject *ls)
+{
+    if (ls->max_pivots < 0 || ls->pivots.count - 2 <= ls->max_pivots)
+        return 0;
+    return compact_pivots(ls, ls->max_pivots / 2);
+}
+
+/* Sorts the list ls sufficiently such that ls->xs->ob_item[k] is actually the
+ * kth value in sorted order. Returns 0 on success and -1 on error. */
+static int sort_point(LSObject *, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+sort_point(LSObject *ls, Py_ssize_t k)
+{
+    /* Find the best possible bounds */
+    PivotTree *tree = &ls->pivots;
+    Pivot left, right, middle;
+    bound_idx(tree, k, &left, &right);
+
+    /* bound_idx never returns k in right, but right might be NO_PIVOT if
+     * left is at k, so check left first. */
+    if (PIVOT_IDX(tree, left) == k ||
+        PIVOT_FLAGS(tree, right) & SORTED_RIGHT) {
+        return 0;
+    }
+
+    /* Run quickselect */
+    Py_ssize_t piv_idx;
+
+    while (PIVOT_IDX(tree, left) + 1 + SORT_THRESH <= PIVOT_IDX(tree, right)) {
+        piv_idx = partition(ls, PIVOT_IDX(tree, left) + 1,
+                            PIVOT_IDX(tree, right));
+        if (piv_idx < 0) {
+            return -1;
+        }
+        middle = insert_between(tree, piv_idx, left, right);
+        if (middle == NO_PIVOT)
+            return -1;
+        if (uniq_pivots(left, middle, right, ls) < 0)
+            return -1;
+
+        if (piv_idx < k) {
+            left = middle;
+        }
+        else if (piv_idx > k) {
+            right = middle;
+        }
+        else {
+            return 0;
+        }
+    }
+
+    if (insertion_sort(ls, PIVOT_IDX(tree, left) + 1,
+                       PIVOT_IDX(tree, right)) < 0) {
+        return -1;
+    }
+    mark_sorted(ls, left, right);
+
+    return 0;
+}
+
+/* Sorts the list ls sufficiently such that everything between indices start
+ * and stop is in sorted order. Returns 0 on success and -1 on error. */
+static int sort_range(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+sort_range(LSObject *ls, Py_ssize_t start, Py_ssize_t stop)
+{
+    /* The xs list is always partially sorted, with pivots partioning up the
+     * space, like in this picture:
+     *
+     * | ~~~~~ | ~~~ | ~~~~~ | ~~ | ~~~~~~~ |
+     *
+     * '|' indicates a pivot and '~~' indicates unsorted data.
+     *
+     * So we iterate through the regions bounding our data, and sort them.
+     */
+
+    assert(0 <= start && start < stop && stop <= Py_SIZE(ls->xs));
+
+    if (limit_pivots(ls) < 0)
+        return -1;
+    if (sort_point(ls, start) < 0)
+        return -1;
+    if (sort_point(ls, stop) < 0)
+        return -1;
+
+    PivotTree *tree = &ls->pivots;
+    Pivot current, next;
+    bound_idx(tree, start, &current, &next);
+    if (PIVOT_IDX(tree, current) == start)
+        next = next_pivot(tree, current);
+
+    while (PIVOT_IDX(tree, current) < stop) {
+        Py_ssize_t current_idx = PIVOT_IDX(tree, current);
+        if (PIVOT_FLAGS(tree, current) & SORTED_LEFT) {
+            assert(PIVOT_FLAGS(tree, next) & SORTED_RIGHT);
+        }
+        else {
+            /* Since we are sorting the entire region, we don't need to keep
+             * track of pivots, and so we can use vanilla quicksort */
+            if (quick_sort(ls, current_idx + 1, PIVOT_IDX(tree, next)) < 0) {
+                return -1;    
+            }
+            ADD_FLAGS(tree, current, SORTED_LEFT);
+            ADD_FLAGS(tree, next, SORTED_RIGHT);
+            evict_keys(ls, current_idx + 1, PIVOT_IDX(tree, next));
+        }
+
+        if (PIVOT_FLAGS(tree, current) & SORTED_RIGHT) {
+            evict_keys(ls, current_idx, current_idx + 1);
+            delete_node(tree, current);
+        }
+
+        current = next;
+        next = next_pivot(tree, current);
+    }
+
+    assert(PIVOT_FLAGS(tree, current) & SORTED_RIGHT);
+    if (PIVOT_FLAGS(tree, current) & SORTED_LEFT) {
+        evict_keys(ls, PIVOT_IDX(tree, current), PIVOT_IDX(tree, current) + 1);
+        delete_node(tree, current);
+    }
+
+    return 0;
+}
+
+/* Does what sort_point does for a lookup of the index k, (and compacts the
+ * pivots first if they're over budget), but when k continues a run of
+ * sequential lookups, reads ahead by sorting a whole chunk of the run's
+ * future indices at once. Loops over indices then cost about as much as
+ * iteration, instead of a quickselect every SORT_THRESH items. Returns 0 on
+ * success and -1 on error. */
+static int sort_index(LSObject *, ReadAhead *, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+sort_index(LSObject *ls, ReadAhead *ra, Py_ssize_t k)
+{
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    int dir = k == ra->last + 1 ? 1 : k == ra->last - 1 ? -1 : 0;
+
+    /* A new run starts with the lookup before this one */
+    if (dir == 0 || dir != ra->dir) {
+        init_readahead(ra);
+        ra->dir = dir;
+        ra->run = dir != 0;
+    }
+    ra->last = k;
+    ra->run++;
+
+    if (dir != 0 && ra->run >= READAHEAD_TRIGGER &&
+        (k < ra->lo || k >= ra->hi)) {
+        Py_ssize_t lo = dir > 0 ? k : k + 1 - ra->size;
+        Py_ssize_t hi = dir > 0 ? k + ra->size : k + 1;
+        lo = lo < 0 ? 0 : lo;
+        hi = hi > xs_len ? xs_len : hi;
+        if (hi - lo > 1) {
+            if (sort_range(ls, lo, hi) < 0)
+                return -1;
+            ra->lo = lo;
+            ra->hi = hi;
+            if (ra->size < READAHEAD_MAX)
+                ra->size *= 2;
+            return 0;
+        }
+    }
+
+    if (limit_pivots(ls) < 0)
+        return -1;
+    return sort_point(ls, k);
+}
+
+/* Returns 1 if the key at index k is less than key, 0 if not, and -1 on
+ * error. nkey is the native version of key, (accounting for reverse), or NULL
+ * if key has no native version. */
+static int lt_key(LSObject *, Py_ssize_t, PyObject *, const int64_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+lt_key(LSObject *ls, Py_ssize_t k, PyObject *key, const int64_t *nkey)
+{
+    if (nkey != NULL)
+        return native_key(ls, k) < *nkey;
+    if (ls->nkeys == NULL && !ls->lazykeys)
+        return islt(LS_KEYS(ls)[k], key, ls);
+
+    /* The key at k might not be cached, or the keys might be native while key
+     * isn't, so get the key at k as a python object */
+    PyObject *k_key = key_at(ls, k);
+    if (k_key == NULL)
+        return -1;
+    int res = islt(k_key, key, ls);
+    Py_DECREF(k_key);
+    return res;
+}
+
+/* Returns 1 if the key at index k goes before key, 0 if not, and -1 on
+ * error. The key at k goes before key if it is less than key, or with upper,
+ * if it is less than or equal to key. nkey is as in lt_key. */
+static int before_key(LSObject *, Py_ssize_t, PyObject *, const int64_t *,
+                      int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+before_key(LSObject *ls, Py_ssize_t k, PyObject *key, const int64_t *nkey,
+           int upper)
+{
+    if (!upper)
+        return lt_key(ls, k, key, nkey);
+    if (nkey != NULL)
+        return native_key(ls, k) <= *nkey;
+
+    PyObject *k_key = key_at(ls, k);
+    if (k_key == NULL)
+        return -1;
+    int res = islt(key, k_key, ls);
+    Py_DECREF(k_key);
+    return res < 0 ? -1 : !res;
+}
+
+#define IFBEFORE(K) if ((ltflag = before_key(ls, K, key, nkey, upper)) < 0) \
+                        goto fail;                                      \
+                    if (ltflag)
+
+/* Sorts just enough of the list that every item with a key less than key, (or
+ * with upper, less than or equal to key), is before left_idx, every item with
+ * a greater key is at or after right_idx, and the items in between are in
+ * sorted order. nkey is the native version of key, (from native_probe), or
+ * NULL if it has none, in which case key may be NULL. Returns 0 on success
+ * and -1 on error. */
+static int locate_key(LSObject *, PyObject *, const int64_t *, int,
+                      Py_ssize_t *, Py_ssize_t *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+locate_key(LSObject *ls, PyObject *key, const int64_t *nkey, int upper,
+           Py_ssize_t *left_idx, Py_ssize_t *right_idx)
+{
+    if (limit_pivots(ls) < 0)
+        return -1;
+
+    PivotTree *tree = &ls->pivots;
+    Pivot left = NO_PIVOT;
+    Pivot right = NO_PIVOT;
+    Pivot middle;
+    Pivot current = tree->root;
+    int ltflag;
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+
+    while (current != NO_PIVOT) {
+        Py_ssize_t idx = PIVOT_IDX(tree, current);
+        if (idx == -1) {
+            left = current;
+            current = NODE(tree, current).right;
+        }
+        else if (idx == xs_len) {
+            right = current;
+            current = NODE(tree, current).left;
+        }
+        else {
+            /* Native keys are cached in the nodes, (see PivotTree) */
+            if (nkey != NULL)
+                ltflag = upper ? pivot_key(tree, current) <= *nkey
+                               : pivot_key(tree, current) < *nkey;
+            else if ((ltflag = before_key(ls, idx, key, NULL, upper)) < 0)
+                goto fail;
+
+            if (ltflag) {
+                left = current;
+                current = NODE(tree, current).right;
+            }
+            else {
+                right = current;
+                current = NODE(tree, current).left;
+            }
+        }
+    }
+
+    if (PIVOT_FLAGS(tree, left) & SORTED_LEFT) {
+        assert(PIVOT_FLAGS(tree, right) & SORTED_RIGHT);
+    }
+    else {
+        Py_ssize_t piv_idx;
+        while (PIVOT_IDX(tree, left) + 1 + SORT_THRESH
+               <= PIVOT_IDX(tree, right)) {
+            if ((piv_idx = partition(ls, PIVOT_IDX(tree, left) + 1,
+                                     PIVOT_IDX(tree, right))) < 0) {
+                return -1;
+            }
+            middle = insert_between(tree, piv_idx, left, right);
+            if (middle == NO_PIVOT)
+                return -1;
+            if (uniq_pivots(left, middle, right, ls) < 0)
+                return -1;
+
+            IFBEFORE(piv_idx) {
+                left = middle;
+            }
+            else {
+                right = middle;
+            }
+        }
+
+        if (insertion_sort(ls, PIVOT_IDX(tree, left) + 1,
+                           PIVOT_IDX(tree, right)) < 0) {
+           return -1;
+        }
+    }
+
+    Py_ssize_t right_pos = PIVOT_IDX(tree, right);
+    *left_idx = PIVOT_IDX(tree, left) + 1;
+    *right_idx = right_pos == xs_len ? xs_len : right_pos + 1;
+    if (!(PIVOT_FLAGS(tree, left) & SORTED_LEFT))
+        mark_sorted(ls, left, right);
+
+    return 0;
+
+fail:
+    return -1;
+}
+
+/* Returns the first index of item in the list, or -2 on error, or -1 if item
+ * is not present. Places item in that first idx, but makes no guarantees
+ * any duplicate versions of item will immediately follow. Eg, it's possible
+ * calling find_item on some list with item = 1 will result in the following
+ * list:
+ * [0, 0, 0, 1, 2, 2, 1, 2, 1, 1, 2]
+ * key is the key of item, which is used to locate it.
+ */
+static Py_ssize_t find_key(LSObject *, PyObject *, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+find_key(LSObject *ls, PyObject *item, PyObject *key)
+{
+    Py_ssize_t left_idx, right_idx;
+    int64_t nkey_value;
+    int64_t *nkey = NULL;
+    if (ls->nkeys != NULL && native_probe(ls, key, &nkey_value))
+        nkey = &nkey_value;
+
+    if (locate_key(ls, key, nkey, 0, &left_idx, &right_idx) < 0)
+        return -2;
+
+    /* TODO: Do binary search now */
+    Py_ssize_t k;
+    int cmp = 0;
+    for (k = left_idx; cmp == 0 && k < right_idx; k++) {
+        cmp = PyObject_RichCompareBool(item, ls->xs->ob_item[k], Py_EQ);
+    }
+
+    if (cmp < 0) {
+        return -2;
+    }
+    else if (cmp == 0) {
+        return -1;
+    }
+    else {
+        return k - 1;  /* -1 since incremented in for loop */
+    }
+}
+
+/* Returns the number of items whose keys are less than key, (ie, the index
+ * bisect_left would return on the sorted keys), or with upper, less than or
+ * equal to key, (as bisect_right), or -1 on error. key and nkey are as in
+ * locate_key. */
+static Py_ssize_t bisect_key(LSObject *, PyObject *, const int64_t *, int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+bisect_key(LSObject *ls, PyObject *key, const int64_t *nkey, int upper)
+{
+    Py_ssize_t lo, hi, mid;
+    int ltflag;
+
+    if (locate_key(ls, key, nkey, upper, &lo, &hi) < 0)
+        return -1;
+
+    /* The keys between lo and hi are sorted, so binary search them */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        IFBEFORE(mid) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+
+fail:
+    return -1;
+}
+
+/* Returns the number of items whose keys are less than key, or with upper,
+ * less than or equal to it, or -1 on error */
+static Py_ssize_t rank_key(LSObject *, PyObject *, int)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+rank_key(LSObject *ls, PyObject *key, int upper)
+{
+    int64_t nkey_value;
+    int64_t *nkey = NULL;
+    if (ls->nkeys != NULL && native_probe(ls, key, &nkey_value))
+        nkey = &nkey_value;
+    return bisect_key(ls, key, nkey, upper);
+}
+
+/* Returns the first index of item in the list, or -2 on error, or -1 if item
+ * is not present, as find_key, but computes the key of the item itself */
+static Py_ssize_t find_item(LSObject *, PyObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+find_item(LSObject *ls, PyObject *item)
+{
+    PyObject *key;
+
+    if (ls->givenkeys) {
+        /* There's no way to get the key of an arbitrary item, so look for any
+         * copy of it and use the key of that */
+        Py_ssize_t xs_len = Py_SIZE(ls->xs);
+        Py_ssize_t k;
+        int cmp = 0;
+        for (k = 0; cmp == 0 && k < xs_len; k++) {
+            cmp = PyObject_RichCompareBool(item, ls->xs->ob_item[k], Py_EQ);
+        }
+        if (cmp < 0)
+            return -2;
+        else if (cmp == 0)
+            return -1;
+        key = key_at(ls, k - 1);
+    }
+    else {
+        key = item_key(ls, item);
+    }
+    if (key == NULL)
+        return -2;
+
+    Py_ssize_t k = find_key(ls, item, key);
+    Py_DECREF(key);
+    return k;
+}
+
+/* Public facing LazySorted methods */
+
+static PyObject *idxerr = NULL;
+
+/* Returns a new bytes of the records of from_records whose numbers are the n
+ * items step apart from items on, or NULL on error */
+static PyObject *
+records_bytes(LSObject *ls, PyObject **items, Py_ssize_t step, Py_ssize_t n)
+{
+    Py_ssize_t j, size = ls->record_size;
+
+    PyObject *result = PyBytes_FromStringAndSize(NULL, n * size);
+    if (result == NULL)
+        return NULL;
+    char *out = PyBytes_AS_STRING(result);
+    for (j = 0; j < n; j++) {
+        Py_ssize_t row = PyNumber_AsSsize_t(items[j * step], NULL);
+        memcpy(out + j * size, (const char *)ls->records->buf + row * size,
+               size);
+    }
+    return result;
+}
+
+/* Returns the n items from index start on, step apart, as they are currently
+ * ordered: in a new list, or with out='array', in a new array.array of their
+ * native keys, or for from_records, in a new bytes of their records */
+static PyObject *
+range_result(LSObject *ls, Py_ssize_t start, Py_ssize_t step, Py_ssize_t n)
+{
+    Py_ssize_t j;
+
+    if (ls->records != NULL)
+        return records_bytes(ls, ls->xs->ob_item + start, step, n);
+
+    if (ls->outarray && ls->nwidth == sizeof(int64_t))
+        return strided_native_array(n > 0 ? (int64_t *)ls->nkeys + start
+                                          : NULL,
+                                    step, n, ls->nkind, ls->reverse);
+    if (ls->outarray) {
+        int64_t *values = PyMem_New(int64_t, n > 0 ? n : 1);
+        if (values == NULL)
+            return PyErr_NoMemory();
+        for (j = 0; j < n; j++)
+            values[j] = native_key(ls, start + j * step);
+        PyObject *result = strided_native_array(values, 1, n, ls->nkind,
+                                                ls->reverse);
+        PyMem_Free(values);
+        return result;
+    }
+
+    PyListObject *result = (PyListObject *)PyList_New(n);
+    if (result == NULL)
+        return NULL;
+    for (j = 0; j < n; j++) {
+        Py_INCREF(ls->xs->ob_item[start + j * step]);
+        result->ob_item[j] = ls->xs->ob_item[start + j * step];
+    }
+    return (PyObject *)result;
+}
+
+static PyObject *
+ls_subscript(LSObject* self, PyObject* item)
+{
+    Py_ssize_t xs_len = Py_SIZE(self->xs);
+
+    if (PyIndex_Check(item)) {
+        Py_ssize_t k;
+        k = PyNumber_AsSsize_t(item, PyExc_IndexError);
+        if (k == -1 && PyErr_Occurred())
+            return NULL;
+        if (k < 0)
+            k += xs_len;
+
+        if (k < 0 || k >= xs_len) {
+            if (idxerr == NULL) {
+                idxerr = PyString_FromString("LazySorted index out of range");
+                if (idxerr == NULL)
+                    return NULL;
+            }
+            PyErr_SetObject(PyExc_IndexError, idxerr);
+            return NULL;
+        }
+
+        if (sort_index(self, &self->readahead, k) < 0)
+            return NULL;
+
+        Py_INCREF(self->xs->ob_item[k]);
+        return self->xs->ob_item[k];
+    }
+    else if (PySlice_Check(item)) {
+        Py_ssize_t start, stop, step, slicelength;
+
+        if (PySlice_GetIndicesEx(item, Py_SIZE(self->xs),
+                         &start, &stop, &step, &slicelength) < 0) {
+            return NULL;
+        }
+
+        if (slicelength <= 0) {
+            return range_result(self, 0, 1, 0);
+        }
+        else if (-CONTIG_THRESH <= step && step <= CONTIG_THRESH) {
+            Py_ssize_t left = start < stop ? start : stop;
+            Py_ssize_t right = start < stop ? stop : start;
+
+            if (step < 0) {
+                left++;
+                right++;
+            }
+
+            if (sort_range(self, left, right) < 0) {
+                return NULL;
+            }
+
+            return range_result(self, start, step, slicelength);
+        }
+        else if (self->outarray) {
+            int64_t *values = PyMem_New(int64_t, slicelength);
+            if (values == NULL)
+                return PyErr_NoMemory();
+
+            Py_ssize_t k, j;
+            for (k = start, j = 0; j < slicelength; k += step, j++) {
+                if (limit_pivots(self) < 0 || sort_point(self, k) < 0) {
+                    PyMem_Free(values);
+                    return NULL;
+                }
+                values[j] = native_key(self, k);
+            }
+
+            PyObject *result = strided_native_array(
+                values, 1, slicelength, self->nkind, self->reverse);
+            PyMem_Free(values);
+            return result;
+        }
+        else if (self->records != NULL) {
+            PyObject **rows = PyMem_New(PyObject *, slicelength);
+            if (rows == NULL)
+                return PyErr_NoMemory();
+
+            Py_ssize_t k, j;
+            for (k = start, j = 0; j < slicelength; k += step, j++) {
+                if (limit_pivots(self) < 0 || sort_point(self, k) < 0) {
+                    PyMem_Free(rows);
+                    return NULL;
+                }
+                rows[j] = self->xs->ob_item[k];
+            }
+
+            PyObject *result = records_bytes(self, rows, 1, slicelength);
+            PyMem_Free(rows);
+            return result;
+        }
+        else {
+            PyListObject *result = (PyListObject *)PyList_New(slicelength);
+            if (result == NULL)
+                return NULL;
+
+            Py_ssize_t k, j;
+            for (k = start, j = 0; j < slicelength; k += step, j++) {
+                if (limit_pivots(self) < 0 || sort_point(self, k) < 0)
+                    return NULL;
+                Py_INCREF(self->xs->ob_item[k]);
+                result->ob_item[j] = self->xs->ob_item[k];
+            }
+
+            return (PyObject *)result;
+        }
+    }
+    else {
+        PyErr_Format(PyExc_TypeError,
+                     "list indices must be integers, not %.200s",
+                     item->ob_type->tp_name);
+        return NULL;
+    }
+}
+
+/* Sorts the list just enough that the items whose sorted indices are in
+ * [left, right) are between left and right, in some order. Returns 0 on
+ * success and -1 on error. */
+static int select_range(LSObject *, Py_ssize_t, Py_ssize_t)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+select_range(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    assert(0 <= left && left < right && right <= Py_SIZE(ls->xs));
+
+    if (limit_pivots(ls) < 0)
+        return -1;
+    if (left != 0 && sort_point(ls, left) < 0)
+        return -1;
+    if (right != Py_SIZE(ls->xs) && sort_point(ls, right) < 0)
+        return -1;
+    return 0;
+}
+
+/* Weighted selection. The weight of the items up to and including a pivot
+ * is its cum plus its own weight, so the tree can be searched for the pivots
+ * either side of a target weight, and the region between them partitioned
+ * like sort_point does, with each new pivot's cum adding up the weights of
+ * the items it has to its left. */
+
+/* The weight of the items up to and including the pivot p */
+static double
+weight_through(LSObject *ls, Pivot p)
+{
+    PivotTree *tree = &ls->pivots;
+    Py_ssize_t idx = PIVOT_IDX(tree, p);
+    if (idx < 0)
+        return 0.0;
+    if (idx == Py_SIZE(ls->xs))
+        return ls->total_weight;
+    return tree->cum[p] + ls->weights[idx];
+}
+
+/* Whether the weight w reaches target. Items with no weight are never
+ * selected, so a target of zero is only reached by a positive weight. */
+#define REACHES(w, target) \
+    ((w) > (target) || ((w) == (target) && (target) > 0))
+
+/* Returns the index of the first item in sorted order at which the weights
+ * of the items so far reach target, sorting just enough to put it there, or
+ * -1 on error */
+static Py_ssize_t weighted_select(LSObject *, double)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static Py_ssize_t
+weighted_select(LSObject *ls, double target)
+{
+    PivotTree *tree = &ls->pivots;
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    Pivot left = NO_PIVOT;
+    Pivot right = NO_PIVOT;
+    Pivot middle;
+    Pivot current;
+    Py_ssize_t piv_idx;
+
+    assert(ls->weights != NULL && xs_len > 0);
+    if (limit_pivots(ls) < 0)
+        return -1;
+
+    current = tree->root;
+    while (current != NO_PIVOT) {
+        if (!REACHES(weight_through(ls, current), target) &&
+            PIVOT_IDX(tree, current) < xs_len) {
+            left = current;
+            current = NODE(tree, current).right;
+        }
+        else {
+            right = current;
+            current = NODE(tree, current).left;
+        }
+    }
+
+    /* The item is between left, (exclusive), and right, (inclusive). The
+     * pivots aren't uniq'ed as sort_point does, since that could delete left
+     * or right while they're still needed. */
+    if (!(PIVOT_FLAGS(tree, left) & SORTED_LEFT)) {
+        while (PIVOT_IDX(tree, left) + 1 + SORT_THRESH
+               <= PIVOT_IDX(tree, right)) {
+            piv_idx = partition(ls, PIVOT_IDX(tree, left) + 1,
+                                PIVOT_IDX(tree, right));
+            if (piv_idx < 0)
+                return -1;
+            middle = insert_between(tree, piv_idx, left, right);
+            if (middle == NO_PIVOT)
+                return -1;
+
+            if (!REACHES(weight_through(ls, middle), target))
+                left = middle;
+            else if (!REACHES(tree->cum[middle], target))
+                return piv_idx;
+            else
+                right = middle;
+        }
+        if (insertion_sort(ls, PIVOT_IDX(tree, left) + 1,
+                           PIVOT_IDX(tree, right)) < 0)
+            return -1;
+    }
+
+    /* mark_sorted can delete left and right, so read them first */
+    double weight = weight_through(ls, left);
+    Py_ssize_t k = PIVOT_IDX(tree, left) + 1;
+    Py_ssize_t right_idx = PIVOT_IDX(tree, right);
+    if (!(PIVOT_FLAGS(tree, left) & SORTED_LEFT))
+        mark_sorted(ls, left, right);
+
+    for (; k < right_idx; k++) {
+        weight += ls->weights[k];
+        if (REACHES(weight, target))
+            return k;
+    }
+    /* Rounding can leave the sum just short of the total */
+    return right_idx < xs_len ? right_idx : xs_len - 1;
+}
+
+/* Returns a new list of the items between indices left and right, as they are
+ * currently ordered */
+static PyObject *
+list_range(LSObject *ls, Py_ssize_t left, Py_ssize_t right)
+{
+    PyListObject *result = (PyListObject *)PyList_New(right - left);
+    if (result == NULL)
+        return NULL;
+
+    Py_ssize_t k;
+    for (k = left; k < right; k++) {
+        Py_INCREF(ls->xs->ob_item[k]);
+        result->ob_item[k - left] = ls->xs->ob_item[k];
+    }
+
+    return (PyObject *)result;
+}
+
+/* Returns (possibly unsorted) data in a specified contiguous range */
+static PyObject *
+between(LSObject *self, PyObject *args)
+{
+    Py_ssize_t left;
+    Py_ssize_t right;
+
+    if (!PyArg_ParseTuple(args, "nn:list", &left, &right))
+        return NULL;
+
+    Py_ssize_t xlen = Py_SIZE(self->xs);
+    if (left < 0) {
+        left += xlen;
+    }
+    else if (left > xlen) {
+        left = xlen;
+    }
+
+    if (right < 0) {
+        right += xlen;
+    }
+    else if (right > xlen) {
+        right = xlen;
+    }
+
+    if (left >= right || right <= 0) {
+        return range_result(self, 0, 1, 0);
+    }
+
+    if (select_range(self, left, right) < 0)
+        return NULL;
+
+    return range_result(self, left, 1, right - left);
+}
+
+/* Returns the weighted q-quantile: the first item in sorted order at which
+ * the weights of the items so far reach q times the total weight */
+static PyObject *
+weighted_quantile(LSObject *self, double q)
+{
+    if (self->weights == NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "the LazySorted object has no weights");
+        return NULL;
+    }
+    if (!(0.0 <= q && q <= 1.0)) {
+        PyErr_SetString(PyExc_ValueError, "q must be between 0 and 1");
+        return NULL;
+    }
+    if (Py_SIZE(self->xs) == 0) {
+        PyErr_SetString(PyExc_IndexError, "LazySorted index out of range");
+        return NULL;
+    }
+    if (!(self->total_weight > 0.0)) {
+        PyErr_SetString(PyExc_ValueError, "the weights are all zero");
+        return NULL;
+    }
+
+    Py_ssize_t k = weighted_select(self, q * self->total_weight);
+    if (k < 0)
+        return NULL;
+    Py_INCREF(self->xs->ob_item[k]);
+    return self->xs->ob_item[k];
+}
+
+static PyObject *
+ls_weighted_quantile(LSObject *self, PyObject *args)
+{
+    double q;
+    if (!PyArg_ParseTuple(args, "d:weighted_quantile", &q))
+        return NULL;
+    return weighted_quantile(self, q);
+}
+
+static PyObject *
+ls_weighted_median(LSObject *self)
+{
+    return weighted_quantile(self, 0.5);
+}
+
+/* Membership index. Sorting only helps so much with `in` and count: each
+ * query still takes O(log n) comparisons to find the item's place, plus a scan
+ * of its equal keys. So with hash_index=n, after n such queries the object
+ * builds an open addressing hash table of the distinct items of xs and their
+ * counts, and answers from that from then on. xs holds on to the items and
+ * never replaces them, so the table can borrow them. */
+
+/* Returns the slot of the table where item, with the given hash, is or
+ * would go, or NULL on error. Probes like dict does, since hashes of ints
+ * are themselves, and so are often clustered. */
+static HashEntry *
+hash_slot(HashEntry *table, size_t mask, PyObject *item, Py_hash_t hash)
+{
+    size_t perturb = (size_t)hash;
+    size_t i = (size_t)hash & mask;
+    int cmp;
+
+    while (table[i].item != NULL) {
+        if (table[i].item == item)
+            return &table[i];
+        if (table[i].hash == hash) {
+            cmp = PyObject_RichCompareBool(table[i].item, item, Py_EQ);
+            if (cmp < 0)
+                return NULL;
+            if (cmp)
+                return &table[i];
+        }
+        perturb >>= 5;
+        i = (i * 5 + perturb + 1) & mask;
+    }
+    return &table[i];
+}
+
+/* Returns a table with room for n distinct items at a load of at most 2/3,
+ * or NULL on error */
+static HashEntry *
+new_hash_table(Py_ssize_t n, size_t *mask)
+{
+    size_t size = 8;
+    while (size < (size_t)n + (size_t)n / 2)
+        size *= 2;
+    if (size > PY_SSIZE_T_MAX / sizeof(HashEntry)) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    HashEntry *table = (HashEntry *)PyMem_Malloc(size * sizeof(HashEntry));
+    if (table == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(table, 0, size * sizeof(HashEntry));
+    *mask = size - 1;
+    return table;
+}
+
+/* Builds ls->hash_table. If some item is unhashable, there's no index, and
+ * hash_after is set so that it isn't tried again. Returns 0 on success, (with
+ * or without an index), and -1 on error. */
+static int build_hash_index(LSObject *)
+Py_GCC_ATTRIBUTE((warn_unused_result));
+
+static int
+build_hash_index(LSObject *ls)
+{
+    Py_ssize_t xs_len = Py_SIZE(ls->xs);
+    Py_ssize_t distinct = 0;
+    Py_ssize_t i;
+    size_t mask, small_mask, j;
+    HashEntry *slot;
+
+    HashEntry *table = new_hash_table(xs_len, &mask);
+    if (table == NULL)
+        return -1;
+
+    for (i = 0; i < xs_len; i++) {
+        PyObject *item = ls->xs->ob_item[i];
+        Py_hash_t hash = PyObject_Hash(item);
+        if (hash == -1) {
+            PyMem_Free(table);
+            if (!PyErr_ExceptionMatches(PyExc_TypeError))
+                return -1;
+            PyErr_Clear();
+            ls->hash_after = -1;
+            return 0;
+        }
+        if ((slot = hash_slot(table, mask, item, hash)) == NULL) {
+            PyMem_Free(table);
+            return -1;
+        }
+        if (slot->item == NULL) {
+            slot->item = item;
+            slot->hash = hash;
+            distinct++;
+        }
+        slot->count++;
+    }
+
+    /* Sizing for xs_len items wastes a lot of space when there are many
+     * duplicates, so move them to a table that fits. The entries are known
+     * to be distinct, so this needs no comparisons. */
+    HashEntry *small = new_hash_table(distinct, &small_mask);
+    if (small != NULL && small_mask < mask) {
+        for (j = 0; j <= mask; j++) {
+            if (table[j].item == NULL)
+                continue;
+            size_t perturb = (size_t)table[j].hash;
+            size_t k = (size_t)table[j].hash & small_mask;
+            while (small[k].item != NULL) {
+                perturb >>= 5;
+                k = (k * 5 + perturb + 1) & small_mask;
+            }
+            small[k] = table[j];
+        }
+        PyMem_Free(table);
+        table = small;
+        mask = small_mask;
+    }
+    else {
+        PyMem_Free(small);
+        PyErr_Clear();
+    }
+
+    ls->hash_table = table;
+    ls->hash_mask = mask;
+    return 0;
+}
+
+/* Returns the number of items equal to item from the membership index,
+ * building it if it's due. Returns -1 if there's no index to answer from, or
+ * item isn't hashable, and -2 on error. */
+static Py_ssize_t
+hash_count(LSObject *ls, PyObject *item)
+{
+    if (ls->hash_table == NULL) {
+        if (ls->hash_after < 0 || ls->hash_queries++ < ls->hash_after)
+            return -1;
+        if (build_hash_index(ls) < 0)
+            return -2;
+        if (ls->hash_table == NULL)
+            return -1;
+    }
+
+    Py_hash_t hash = PyObject_Hash(item);
+    if (hash == -1) {
+        if (!PyErr_ExceptionMatches(PyExc_TypeError))
+            return -2;
+        PyErr_Clear();
+        return -1;
+    }
+    HashEntry *slot = hash_slot(ls->hash_table, ls->hash_mask, item, hash);
+    if (slot == NULL)
+        return -2;
+    return slot->count;
+}
+
+static PyObject *
+ls_index(LSObject *self, PyObject *args)
+{
+    PyObject *item;
+    if (!PyArg_ParseTuple(args, "O:list", &item))
+        return NULL;
+
+    Py_ssize_t index = find_item(self, item);
+    if (index == -2) {
+        return NULL;
+    }
+    else if (index == -1) {
+        PyObject *err_format, *err_string, *format_tuple;
+        err_format = PyString_FromString("%r is not in list");
+        if (err_format == NULL)
+            return NULL;
+        format_tuple = PyTuple_Pack(1, item);
+        if (format_tuple == NULL)
+            return NULL;
+        err_string = PyString_Format(err_format, format_tuple);
+        Py_DECREF(format_tuple);
+        if (err_string == NULL)
+            return NULL;
+        PyErr_SetObject(PyExc_ValueError, err_string);
+        Py_DECREF(err_string);
+        return NULL;
+    }
+    else {
+        return PyInt_FromSsize_t(index);
+    }
+}
+
+static PyObject *
+ls_count(LSObject *self, PyObject *args)
+{
+    PyObject *item;
+    if (!PyArg_ParseTuple(args, "O:list", &item))
+        return NULL;
+
+    Py_ssize_t k = hash_count(self, item);
+    if (k == -2)
+        return NULL;
+    else if (k >= 0)
+        return PyInt_FromSsize_t(k);
+
+    k = find_item(self, item);
+    if (k == -2) {
+        return NULL;
+    }
+
+    if (k == -1) {
+        return PyInt_FromSsize_t(0);
+    }
+    else {
+        /* Figure out where items may be */
+        PivotTree *tree = &self->pivots;
+        Pivot left, right;
+        bound_idx(tree, k, &left, &right);
+        if (right == NO_PIVOT) {
+            right = next_pivot(tree, left);
+        }
+
+        int xs_len = Py_SIZE(self->xs);
+        int cmp;
+        for (cmp = 1; PIVOT_IDX(tree, right) < xs_len && cmp;
+             right = next_pivot(tree, right)) {
+            cmp = PyObject_RichCompareBool(
+                item, self->xs->ob_item[PIVOT_IDX(tree, right)], Py_EQ);
+            if (cmp < 0) {
+                return NULL;
+            }
+        }
+
+        /* TODO: do some additional sorting here to take advantage of the
+         * compares. Or refactor the code substantially or something. */
+        Py_ssize_t count = 1;
+        for (k++; k < PIVOT_IDX(tree, right); k++) {
+            cmp = PyObject_RichCompareBool(item, self->xs->ob_item[k], Py_EQ);
+            if (cmp < 0) {
+                return NULL;
+            }
+            else if (cmp) {
+                count++;
+            }
+        }
+        return PyInt_FromSsize_t(count);
+    }
+}
+
+static int
+ls_contains(LSObject *self, PyObject *item)
+{
+    Py_ssize_t count = hash_count(self, item);
+    if (count == -2)
+        return -1;
+    else if (count >= 0)
+        return count > 0;
+
+    Py_ssize_t idx = find_item(self, item);
+    if (idx == -2) {
+        return -1;
+    }
+    else if (idx == -1) {
+        return 0;
+    }
+    else {
+        return 1;
+    }
+}
+
+/* Memory accounting. The items and any given keys belong to the caller, so
+ * only the arrays holding them count, but keys computed by key or batch_key
+ * are the object's own. */
+
+/* The bytes used by each part of a LazySorted object */
+typedef struct {
+    Py_ssize_t object;          /* The LSObject itself */
+    Py_ssize_t items;           /* The partially sorted list */
+    Py_ssize_t keys;            /* The python keys and their list */
+    Py_ssize_t native_keys;     /* The native keys, and any weights */
+    Py_ssize_t pivots;          /* The pivot tree */
+    Py_ssize_t hash_index;      /* The membership index */
+} LSMemory;
+
+/* The bytes taken by the list itself, as in list.__sizeof__() */
+static Py_ssize_t
+list_size(PyListObject *list)
+{
+    return Py_TYPE(list)->tp_basicsize + list->allocated * sizeof(PyObject *);
+}
+
+static void
+ls_memory(LSObject *ls, LSMemory *mem)
+{
+    PivotTree *tree = &ls->pivots;
+    Py_ssize_t i;
+
+    mem->object = Py_TYPE(ls)->tp_basicsize;
+    mem->items = list_size(ls->xs);
+
+    mem->keys = 0;
+    if (ls->keys != NULL) {
+        mem->keys = list_size(ls->keys);
+        if (ls->lazykeys) {
+            mem->keys += ls->key_bytes;
+        }
+        else if (!ls->givenkeys) {
+            for (i = 0; i < Py_SIZE(ls->keys); i++)
+                mem->keys += key_size(ls->keys->ob_item[i]);
+        }
+    }
+
+    /* These come from storage_malloc, which knows their sizes, (dropping
+     * NaNs or nulls doesn't shrink them, for one) */
+    mem->native_keys = storage_bytes(ls->nkeys) + storage_bytes(ls->weights);
+    mem->pivots = storage_bytes(tree->nodes) + storage_bytes(tree->idx_hi) +
+                  storage_bytes(tree->cum);
+
+    mem->hash_index = 0;
+    if (ls->hash_table != NULL)
+        mem->hash_index = (ls->hash_mask + 1) * sizeof(HashEntry);
+}
+
+static PyObject *
+ls_sizeof(LSObject *self)
+{
+    LSMemory mem;
+    ls_memory(self, &mem);
+    return PyInt_FromSsize_t(mem.object + mem.items + mem.keys +
+                             mem.native_keys + mem.pivots + mem.hash_index);
+}
+
+static PyObject *
+ls_memory_usage(LSObject *self)
+{
+    LSMemory mem;
+    ls_memory(self, &mem);
+    return Py_BuildValue("{snsnsnsnsnsnsn}",
+                         "object", mem.object,
+                         "items", mem.items,
+                         "keys", mem.keys,
+                         "native_keys", mem.native_keys,
+                         "pivots", mem.pivots,
+                         "hash_index", mem.hash_index,
+                         "total", mem.object + mem.items + mem.keys +
+                                  mem.native_keys + mem.pivots +
+                                  mem.hash_index);
+}
+
+static PyObject *
+ls_compact(LSObject *self, PyObject *args)
+{
+    Py_ssize_t max_pivots = -1;
+
+    if (!PyArg_ParseTuple(args, "|n:compact", &max_pivots))
+        return NULL;
+
+    if (max_pivots < 0) {
+        if (PyTuple_GET_SIZE(args) > 0) {
+            PyErr_SetString(PyExc_ValueError, "max_pivots must be >= 0");
+            return NULL;
+        }
+        max_pivots = (self->pivots.count - 2) / 2;
+    }
+
+    if (compact_pivots(self, max_pivots) < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ls_pivots(LSObject *self)
+{
+    PyObject *result = PyList_New(0);
+    if (result == NULL) 
+        return NULL;
+
+    PyObject *unsorted = PyString_FromString("UNSORTED");
+    if (unsorted == NULL)
+        return NULL;
+    PyObject *sortedright = PyString_FromString("SORTED_RIGHT");
+    if (sortedright == NULL)
+        return NULL;
+    PyObject *sortedleft = PyString_FromString("SORTED_LEFT");
+    if (sortedleft == NULL)
+        return NULL;
+    PyObject *sortedboth = PyString_FromString("SORTED_BOTH");
+    if (sortedboth == NULL)
+        return NULL;
+
+    PyObject *flags[4] = {unsorted, sortedright, sortedleft, sortedboth};
+
+    PivotTree *tree = &self->pivots;
+    Pivot curr = tree->root;
+    while (NODE(tree, curr).left != NO_PIVOT)
+        curr = NODE(tree, curr).left;
+
+    Py_ssize_t i;
+    PyObject *index;
+    PyObject *tuple;
+    for (i = 0; curr != NO_PIVOT; i++, curr = next_pivot(tree, curr)) {
+        index = PyInt_FromSsize_t(PIVOT_IDX(tree, curr));
+        if (index == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        tuple = PyTuple_Pack(2, index, flags[PIVOT_FLAGS(tree, curr)]);
+        if (tuple == NULL) {
+            Py_DECREF(index);
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_Append(result, tuple);
+    }
+
+    return (PyObject*)result;
+}
+
+static Py_ssize_t
+ls_length(LSObject *self)
+{
+    return Py_SIZE(self->xs);
+}
+
+/* The LazySorted iterator object */
+/* TODO: Be a little smarter here, (keep track of pivots, etc) */
+typedef struct {
+    PyObject_HEAD
+    LSObject            *ls;            /* The referenced lazysorted object */
+    Py_ssize_t          i;              /* The next location to check */
+    ReadAhead           readahead;
+    int                 unique;         /* 1 for one item per distinct key */
+} LSIterObject;
+
+static PyTypeObject LSIter_Type;
+#define LSIterObject_Check(v)      (Py_TYPE(v) == &LSIter_Type)
+
+static PyMethodDef LSIterObject_methods[] = {
+    {NULL, NULL}           /* sentinel */
+};
+
+static PyObject *
+new_iter(PyObject *self, int unique)
+{
+    LSIterObject *it;
+
+    if (!LSObject_Check(self)) {
+        PyErr_BadInternalCall();
+        return NULL;
+    }
+    it = PyObject_GC_New(LSIterObject, &LSIter_Type);
+    if (it == NULL)
+        return NULL;
+    it->i = 0;
+    init_readahead(&it->readahead);
+    it->unique = unique;
+    Py_INCREF(self);
+    it->ls = (LSObject *)self;
+
+    return (PyObject *)it;
+}
+
+PyObject*
+LSObject_iter(PyObject *self)
+{
+    return new_iter(self, 0);
+}
+
+static PyObject *
+ls_iter_unique(PyObject *self)
+{
+    return new_iter(self, 1);
+}
+
+static void
+LSIterObject_dealloc(LSIterObject *it)
+{
+    Py_XDECREF(it->ls);
+    PyObject_GC_Del(it);
+}
+
+/* Returns the first item of the next run of equal keys. Each run is skipped
+ * by a bisect_right for its key, which only sorts the region around the end
+ * of the run, so the runs that aren't consumed are never sorted. */
+static PyObject *
+unique_next(LSIterObject *lsi)
+{
+    LSObject *ls = lsi->ls;
+    Py_ssize_t k = lsi->i;
+    Py_ssize_t next;
+
+    if (limit_pivots(ls) < 0 || sort_point(ls, k) < 0)
+        return NULL;
+
+    if (ls->nkeys != NULL) {
+        int64_t nkey = native_key(ls, k);
+        next = bisect_key(ls, NULL, &nkey, 1);
+    }
+    else {
+        PyObject *key = key_at(ls, k);
+        if (key == NULL)
+            return NULL;
+        next = bisect_key(ls, key, NULL, 1);
+        Py_DECREF(key);
+    }
+    if (next < 0)
+        return NULL;
+
+    /* Unordered NaNs aren't even equal to themselves */
+    lsi->i = next > k ? next : k + 1;
+    Py_INCREF(ls->xs->ob_item[k]);
+    return ls->xs->ob_item[k];
+}
+
+PyObject*
+LSObject_iternext(PyObject *self)
+{
+    LSIterObject *lsi = (LSIterObject *)self;
+    if (lsi->unique && lsi->i < ls_length(lsi->ls))
+        return unique_next(lsi);
+    if (lsi->i < ls_length(lsi->ls)) {
+        if (sort_index(lsi->ls, &lsi->readahead, lsi->i) < 0)
+            return NULL;
+        PyObject *res = lsi->ls->xs->ob_item[lsi->i];
+        Py_INCREF(res);
+        (lsi->i)++;
+        return res;
+    } else {
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+}
+
+static PyTypeObject LSIter_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "LazySortedIterator",                       /* tp_name */
+    sizeof(LSIterObject),                       /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    /* methods */
+    (destructor)LSIterObject_dealloc,           /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)LSObject_iternext,            /* tp_iternext */
+    LSIterObject_methods,                       /* tp_methods */
+    0,                                          /* tp_members */
+};
+
+
+/* TODO: This documentation sucks */
+static PyMethodDef LS_methods[] = {
+    {"__getitem__", (PyCFunction)ls_subscript, METH_O|METH_COEXIST,
+        PyDoc_STR(
+"__getitem__ allows you to access items from the LazySorted instance. It is\n"
+"equivalent to the subscript notation, ie, LS.__getitem__(x) is the same\n"
+"thing as LS[x], where x is integer or slice object.\n"
+"When __getitem__ is called, it sorts the internal list only enough so that\n"
+"it can get your query, and then returns it.\n"
+"\n"
+"Examples:\n"
+"    >>> xs = range(100)\n"
+"    >>> random.shuffle(xs)\n"
+"    >>> ls = LazySorted(xs)\n"
+"    >>> ls[26]\n"
+"    26\n"
+"    >>> ls[5:10]\n"
+"    [5, 6, 7, 8, 9]\n"
+"    >>> ls[::20]\n"
+"    [0, 20, 40, 60, 80]"
+)},
+    {"between", (PyCFunction)between, METH_VARARGS,
+        PyDoc_STR(
+"between allows you to access all points that are between particular\n"
+"indices. The order of the points it returns, however, is undefined. This is\n"
+"useful if you want to throw away outliers in some data set, for example.\n"
+"\n"
+"Examples:\n\n"
+"    >>> xs = range(100)\n"
+"    >>> random.shuffle(xs)\n"
+"    >>> ls = LazySorted(xs)\n"
+"    >>> set(ls.between(5, 95)) == set(range(5, 95))\n"
+"    True"
+)},
+    {"weighted_quantile", (PyCFunction)ls_weighted_quantile, METH_VARARGS,
+        PyDoc_STR(
+"weighted_quantile(q) -> item\n"
+"\n"
+"For a LazySorted object made with weights, returns the first item in\n"
+"sorted order at which the total weight of the items so far reaches q times\n"
+"the total weight of all of them, (0 <= q <= 1). Items with no weight are\n"
+"never returned. The pivots remember the weight before them, so later\n"
+"weighted queries reuse the partitioning."
+)},
+    {"weighted_median", (PyCFunction)ls_weighted_median, METH_NOARGS,
+        PyDoc_STR(
+"Returns weighted_quantile(0.5)"
+)},
+#if PY_VERSION_HEX >= 0x02060000
+    {"from_records", (PyCFunction)from_records,
+        METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+        PyDoc_STR(
+"from_records(buffer, format, field=0, **kwargs) -> LazySorted\n"
+"\n"
+"Makes a LazySorted of the records in buffer, packed one after another as\n"
+"the struct format says, ordered by the field'th field, which must be an\n"
+"int or float. The items are the numbers of the records, so indexing and\n"
+"iterating give record numbers, but slices and between return the records\n"
+"themselves as bytes, ready for struct.iter_unpack or numpy.frombuffer. The\n"
+"other keyword arguments are passed on to LazySorted."
+)},
+#endif
+    {"from_columns", (PyCFunction)from_columns,
+        METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+        PyDoc_STR(
+"from_columns(columns, descending=None, **kwargs) -> LazySorted\n"
+"\n"
+"Makes a LazySorted of the row numbers of a table stored as columns, which\n"
+"are sequences or buffers of numbers or times, all of the same length. The\n"
+"rows are ordered by the first column, then by the second, and so on, in\n"
+"descending order for the columns whose flag in descending is true. NaNs go\n"
+"after every other value of their column. The other keyword arguments are\n"
+"passed on to LazySorted."
+)},
+    {"index", (PyCFunction)ls_index, METH_VARARGS,
+        PyDoc_STR(
+"Returns the first index of item in the list, or raises a ValueError if it\n"
+"isn't present"
+)},
+    {"count", (PyCFunction)ls_count, METH_VARARGS,
+        PyDoc_STR(
+"Returns the number of times the item appears in the list"
+)},
+    {"__sizeof__", (PyCFunction)ls_sizeof, METH_NOARGS,
+        PyDoc_STR(
+"Returns the size of the LazySorted object in memory, in bytes, including\n"
+"its copy of the list, its keys and its pivots, but not the items themselves"
+)},
+    {"memory_usage", (PyCFunction)ls_memory_usage, METH_NOARGS,
+        PyDoc_STR(
+"Returns a dict of how many bytes each part of the LazySorted object uses:\n"
+"'object' for the object itself, 'items' for its copy of the list, 'keys'\n"
+"for the keys computed by key or batch_key, (or just the list of them if\n"
+"they were passed in with keys), 'native_keys' for the keys it compares\n"
+"natively, 'pivots' for the pivot tree, 'hash_index' for the membership\n"
+"index, and 'total' for all of them, which is what sys.getsizeof reports,\n"
+"(apart from any garbage collector overhead). The pivot tree grows as the\n"
+"object is queried."
+)},
+    {"compact", (PyCFunction)ls_compact, METH_VARARGS,
+        PyDoc_STR(
+"compact([max_pivots])\n"
+"\n"
+"Forgets all but max_pivots of the pivots that the LazySorted object keeps\n"
+"track of, (by default, half of them), and frees their memory. The pivots\n"
+"that bound the smallest unsorted regions go first, and the ones at the\n"
+"ends of sorted regions last. Nothing is lost but the work of partitioning\n"
+"those regions again."
+)},
+    {"iter_unique", (PyCFunction)ls_iter_unique, METH_NOARGS,
+        PyDoc_STR(
+"Returns an iterator over the distinct keys in sorted order, which yields\n"
+"the first item of each run of items with equal keys. Each run is skipped\n"
+"over without sorting it, so the first few distinct items of a list with\n"
+"many duplicates are cheap."
+)},
+    {"_pivots", (PyCFunction)ls_pivots, METH_NOARGS,
+        PyDoc_STR(
+"Returns the list of pivot indices, for debugging"
+)},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PyObject *
+ls_get_nan_count(LSObject *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->nan_count);
+}
+
+static PyObject *
+ls_get_null_count(LSObject *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->null_count);
+}
+
+/* The bytes of the native keys, weights and pivot tree that are on the
+ * kind of pages in closure, (see PAGES_*) */
+static PyObject *
+ls_get_pages(LSObject *self, void *closure)
+{
+    PivotTree *tree = &self->pivots;
+    int pages = (int)(intptr_t)closure;
+    return PyInt_FromSsize_t(storage_pages(self->nkeys, pages) +
+                             storage_pages(self->weights, pages) +
+                             storage_pages(tree->nodes, pages) +
+                             storage_pages(tree->idx_hi, pages) +
+                             storage_pages(tree->cum, pages));
+}
+
+static PyGetSetDef LS_getset[] = {
+    {"nan_count", (getter)ls_get_nan_count, NULL,
+        PyDoc_STR(
+"The number of items with NaN keys, which are either at the end of the list\n"
+"with nan='last', or were dropped from it with nan='drop'. Always 0 without\n"
+"the nan option."
+)},
+    {"null_count", (getter)ls_get_null_count, NULL,
+        PyDoc_STR(
+"The number of items that the mask marks as null, which were either dropped\n"
+"from the list, (the default), or are at its start with nulls='first' or its\n"
+"end with nulls='last'. Always 0 without the mask option."
+)},
+    {"huge_pages", (getter)ls_get_pages, NULL,
+        PyDoc_STR(
+"How many bytes of the native keys, weights and pivot tree are on explicit\n"
+"huge pages. Arrays of 4MB or more get them on Linux if the administrator\n"
+"has reserved some, (see vm.nr_hugepages), and otherwise this is 0."
+), (void *)PAGES_HUGETLB},
+    {"huge_pages_advised", (getter)ls_get_pages, NULL,
+        PyDoc_STR(
+"How many bytes of the native keys, weights and pivot tree are in mappings\n"
+"advised to use transparent huge pages, which arrays of 4MB or more are on\n"
+"Linux if explicit huge pages aren't available. Whether the kernel actually\n"
+"backs them with huge pages depends on its settings, (see AnonHugePages in\n"
+"/proc/self/smaps)."
+), (void *)PAGES_ADVISED},
+    {NULL}          /* sentinel */
+};
+
+static PySequenceMethods ls_as_sequence = {
+    (lenfunc)ls_length,                         /* sq_length */
+    0,                                          /* sq_concat */
+    0,                                          /* sq_repeat */
+    0,                                          /* sq_item */
+    0,                                          /* sq_slice */
+    0,                                          /* sq_ass_item */
+    0,                                          /* sq_ass_slice */
+    (objobjproc)ls_contains,                    /* sq_contains */
+    0,                                          /* sq_inplace_concat */
+    0,                                          /* sq_inplace_repeat */
+};
+
+static PyMappingMethods ls_as_mapping = {
+    (lenfunc)ls_length,
+    (binaryfunc)ls_subscript,
+    NULL,
+};
+
+static PyTypeObject LS_Type = {
+    /* The ob_type field must be initialized in the module init function
+     * to be portable to Windows without using C++. */
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lazysorted.LazySorted",/*tp_name*/
+    sizeof(LSObject),       /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)LS_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    &ls_as_sequence,        /*tp_as_sequence*/
+    &ls_as_mapping,         /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_BASETYPE,    /*tp_flags*/
+    0,                      /*tp_doc*/
+    0,                      /*tp_traverse*/
+    0,                      /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    LSObject_iter,          /*tp_iter*/
+    0,                      /*tp_iternext*/
+    LS_methods,             /*tp_methods*/
+    0,                      /*tp_members*/
+    LS_getset,              /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    0,                      /*tp_init*/
+    PyType_GenericAlloc,    /*tp_alloc*/
+    newLSObject,            /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* The C API, (see lazysorted.h). These check their arguments, since they are
+ * called from other extensions, but are otherwise thin wrappers around the
+ * functions above. */
+
+/* Returns 0 if ls is a LazySorted with 0 <= start <= stop <= len(ls), or sets
+ * an exception and returns -1 */
+static int
+capi_check(PyObject *ls, Py_ssize_t start, Py_ssize_t stop)
+{
+    if (!PyObject_TypeCheck(ls, &LS_Type)) {
+        PyErr_SetString(PyExc_TypeError, "expected a LazySorted object");
+        return -1;
+    }
+    if (start < 0 || start > stop || stop > Py_SIZE(((LSObject *)ls)->xs)) {
+        PyErr_SetString(PyExc_IndexError, "LazySorted index out of range");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+capi_from_array(PyObject *const *items, Py_ssize_t n, PyObject *key,
+                int reverse)
+{
+    PyObject *result = NULL;
+    PyObject *xs = PyList_New(n);
+    if (xs == NULL)
+        return NULL;
+
+    Py_ssize_t i;
+    for (i = 0; i < n; i++) {
+        Py_INCREF(items[i]);
+        PyList_SET_ITEM(xs, i, items[i]);
+    }
+
+    PyObject *args = PyTuple_Pack(1, xs);
+    PyObject *kwds = Py_BuildValue("{s:O,s:i}", "key",
+                                   key != NULL ? key : Py_None,
+                                   "reverse", reverse);
+    if (args != NULL && kwds != NULL)
+        result = newLSObject(&LS_Type, args, kwds);
+
+    Py_DECREF(xs);
+    Py_XDECREF(args);
+    Py_XDECREF(kwds);
+    return result;
+}
+
+static PyObject *
+capi_from_buffer(PyObject *buffer, int reverse)
+{
+    PyObject *result = NULL;
+    PyObject *args = PyTuple_Pack(1, buffer);
+    PyObject *kwds = Py_BuildValue("{s:O,s:i}", "keys", buffer,
+                                   "reverse", reverse);
+    if (args != NULL && kwds != NULL)
+        result = newLSObject(&LS_Type, args, kwds);
+
+    Py_XDECREF(args);
+    Py_XDECREF(kwds);
+    return result;
+}
+
+static PyObject *
+capi_select(PyObject *ls, Py_ssize_t k)
+{
+    if (capi_check(ls, k, k) < 0)
+        return NULL;
+    if (k == Py_SIZE(((LSObject *)ls)->xs)) {
+        PyErr_SetString(PyExc_IndexError, "LazySorted index out of range");
+        return NULL;
+    }
+    if (sort_index((LSObject *)ls, &((LSObject *)ls)->readahead, k) < 0)
+        return NULL;
+
+    Py_INCREF(((LSObject *)ls)->xs->ob_item[k]);
+    return ((LSObject *)ls)->xs->ob_item[k];
+}
+
+static int
+capi_sort_range(PyObject *ls, Py_ssize_t start, Py_ssize_t stop)
+{
+    if (capi_check(ls, start, stop) < 0)
+        return -1;
+    if (start == stop)
+        return 0;
+    return sort_range((LSObject *)ls, start, stop);
+}
+
+static PyObject *
+capi_between(PyObject *ls, Py_ssize_t start, Py_ssize_t stop)
+{
+    if (capi_check(ls, start, stop) < 0)
+        return NULL;
+    if (start == stop)
+        return PyList_New(0);
+    if (select_range((LSObject *)ls, start, stop) < 0)
+        return NULL;
+    return list_range((LSObject *)ls, start, stop);
+}
+
+static Py_ssize_t
+capi_rank(PyObject *ls, PyObject *key)
+{
+    if (capi_check(ls, 0, 0) < 0)
+        return -1;
+    return rank_key((LSObject *)ls, key, 0);
+}
 
-        if (sort_point(self, k) < 0)
-            return NULL;
+static PyObject **
+capi_range(PyObject *ls, Py_ssize_t start, Py_ssize_t stop, int sorted)
+{
+    LSObject *self = (LSObject *)ls;
 
-        Py_INCREF(self->xs->ob_item[k]);
-        return self->xs->ob_item[k];
+    if (capi_check(ls, start, stop) < 0)
+        return NULL;
+    if (start < stop) {
+        if ((sorted ? sort_range(self, start, stop)
+                    : select_range(self, start, stop)) < 0)
+            return NULL;
     }
-    else if (PySlice_Check(item)) {
-        Py_ssize_t start, stop, step, slicelength;
+    return self->xs->ob_item + start;
+}
 
-        if (PySlice_GetIndicesEx(item, Py_SIZE(self->xs),
-                         &start, &stop, &step, &slicelength) < 0) {
-            return NULL;
-        }
+static LazySorted_CAPIObject capi = {
+    LAZYSORTED_CAPI_VERSION,
+    &LS_Type,
+    capi_from_array,
+    capi_from_buffer,
+    capi_select,
+    capi_sort_range,
+    capi_between,
+    capi_rank,
+    capi_range,
+};
 
-        if (slicelength <= 0) {
-            return PyList_New(0);
-        }
-        else if (-CONTIG_THRESH <= step && step <= CONTIG_THRESH) {
-            Py_ssize_t left = start < stop ? start : stop;
-            Py_ssize_t right = start < stop ? stop : start;
+/* Adds the C API capsule to the module m. Returns 0 on success and -1 on
+ * error. */
+static int
+add_capi(PyObject *m)
+{
+#ifdef HAVE_CAPSULE
+    PyObject *capsule = PyCapsule_New(&capi, LAZYSORTED_CAPSULE_NAME, NULL);
+    if (capsule == NULL)
+        return -1;
+    return PyModule_AddObject(m, "_C_API", capsule);
+#else
+    return 0;
+#endif
+}
 
-            if (step < 0) {
-                left++;
-                right++;
-            }
+/* Batched selection. Finding a few order statistics in each of many small
+ * groups doesn't need a LazySorted object per group, or any pivots, since
+ * each group is only queried once. Instead, the groups are laid out one after
+ * another in a single array of native keys, and each is quickselected in
+ * place. */
 
-            if (sort_range(self, left, right) < 0) {
-                return NULL;
-            }
+/* Plain quickselect of the native keys left <= i < right, from the C++
+ * engine, (see lazysorted_engine.cpp) */
+void lazysorted_native_select(int64_t *, ptrdiff_t, ptrdiff_t, ptrdiff_t);
 
-            PyListObject *result = (PyListObject *)PyList_New(slicelength);
-            if (result == NULL)
-                return NULL;
+/* A growable array of native keys */
+typedef struct {
+    int64_t *keys;
+    Py_ssize_t len;
+    Py_ssize_t allocated;
+} NativeArray;
 
-            Py_ssize_t k, j;
-            for (k = start, j = 0; j < slicelength; k += step, j++) {
-                Py_INCREF(self->xs->ob_item[k]);
-                result->ob_item[j] = self->xs->ob_item[k];
-            }
+/* Makes room for n more keys. Returns 0 on success and -1 on error. */
+static int
+reserve_keys(NativeArray *arr, Py_ssize_t n)
+{
+    if (arr->len + n <= arr->allocated)
+        return 0;
 
-            return (PyObject *)result;
+    Py_ssize_t allocated = arr->allocated * 2;
+    if (allocated < arr->len + n)
+        allocated = arr->len + n;
+    int64_t *keys = PyMem_Resize(arr->keys, int64_t, allocated);
+    if (keys == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    arr->keys = keys;
+    arr->allocated = allocated;
+    return 0;
+}
+
+/* Appends the native keys of obj, which must be a sequence of ints and floats,
+ * (or a buffer of numbers), to arr. The kind of the keys goes in kind: floats
+ * if there are any, and ints otherwise. what is the name of obj for error
+ * messages. Returns 0 on success and -1 on error. */
+static int
+append_numbers(NativeArray *arr, PyObject *obj, int *kind, const char *what)
+{
+#if PY_VERSION_HEX >= 0x02060000
+    Py_buffer view;
+    char format;
+    Py_ssize_t nans = 0;
+
+    if (open_numeric_buffer(obj, &view, &format)) {
+        if (reserve_keys(arr, view.shape[0]) < 0) {
+            PyBuffer_Release(&view);
+            return -1;
         }
-        else {
-            PyListObject *result = (PyListObject *)PyList_New(slicelength);
-            if (result == NULL)
-                return NULL;
+        int ok = convert_buffer(&view, format, 0, arr->keys + arr->len, &nans);
+        Py_ssize_t n = view.shape[0];
+        PyBuffer_Release(&view);
+        if (ok) {
+            arr->len += n;
+            *kind = strchr("fd", format) != NULL ? NATIVE_FLOAT : NATIVE_INT;
+            return 0;
+        }
+        /* Otherwise, let the slow path below find out what's wrong */
+    }
+#endif
 
-            Py_ssize_t k, j;
-            for (k = start, j = 0; j < slicelength; k += step, j++) {
-                if (sort_point(self, k) < 0)
-                    return NULL;
-                Py_INCREF(self->xs->ob_item[k]);
-                result->ob_item[j] = self->xs->ob_item[k];
-            }
+    PyObject *seq = PySequence_Fast(obj, "expected a sequence");
+    if (seq == NULL)
+        return -1;
 
-            return (PyObject *)result;
-        }
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+    Py_ssize_t i, n = PySequence_Fast_GET_SIZE(seq);
+    if (reserve_keys(arr, n) < 0) {
+        Py_DECREF(seq);
+        return -1;
     }
-    else {
-        PyErr_Format(PyExc_TypeError,
-                     "list indices must be integers, not %.200s",
-                     item->ob_type->tp_name);
-        return NULL;
+
+    int64_t *out = arr->keys + arr->len;
+    *kind = NATIVE_INT;
+    for (i = 0; i < n; i++) {
+        if (to_native(items[i], *kind, &out[i]))
+            continue;
+        /* Ints mixed with floats are compared as floats */
+        if (*kind == NATIVE_INT && PyFloat_CheckExact(items[i])) {
+            *kind = NATIVE_FLOAT;
+            i = -1;
+            continue;
+        }
+        if (is_nan(items[i])) {
+            PyErr_Format(PyExc_ValueError, "%s can't contain NaNs", what);
+        }
+        else {
+            PyErr_Format(PyExc_TypeError,
+                         "%s must be ints and floats that fit in 64 bits",
+                         what);
+        }
+        Py_DECREF(seq);
+        return -1;
     }
+
+    arr->len += n;
+    Py_DECREF(seq);
+    return 0;
 }
 
-/* Returns (possibly unsorted) data in a specified contiguous range */
-static PyObject *
-between(LSObject *self, PyObject *args)
+/* Returns the native key v of the given kind as a double */
+static double
+native_as_double(int64_t v, int kind)
 {
-    Py_ssize_t left;
-    Py_ssize_t right;
+    return kind == NATIVE_FLOAT ? native_to_double(v) : (double)v;
+}
 
-    if (!PyArg_ParseTuple(args, "nn:list", &left, &right))
+/* Returns a new array.array of the n items of data, which take up size bytes
+ * each, with the given type code, or NULL on error */
+static PyObject *
+new_array(const char *typecode, const void *data, Py_ssize_t n,
+          Py_ssize_t size)
+{
+    PyObject *module = PyImport_ImportModule("array");
+    if (module == NULL)
+        return NULL;
+    PyObject *result = PyObject_CallMethod(module, "array", "s", typecode);
+    Py_DECREF(module);
+    if (result == NULL)
         return NULL;
 
-    Py_ssize_t xlen = Py_SIZE(self->xs);
-    if (left < 0) {
-        left += xlen;
-    }
-    else if (left > xlen) {
-        left = xlen;
-    }
-
-    if (right < 0) {
-        right += xlen;
-    }
-    else if (right > xlen) {
-        right = xlen;
+#if PY_MAJOR_VERSION >= 3
+    PyObject *bytes = PyBytes_FromStringAndSize((const char *)data, n * size);
+    const char *method = "frombytes";
+#else
+    PyObject *bytes = PyString_FromStringAndSize((const char *)data, n * size);
+    const char *method = "fromstring";
+#endif
+    if (bytes == NULL) {
+        Py_DECREF(result);
+        return NULL;
     }
-
-    if (left >= right || right <= 0) {
-        return PyList_New(0);
+    PyObject *res = PyObject_CallMethod(result, (char *)method, "(O)", bytes);
+    Py_DECREF(bytes);
+    if (res == NULL) {
+        Py_DECREF(result);
+        return NULL;
     }
+    Py_DECREF(res);
+    return result;
+}
 
-    if (left != 0 && sort_point(self, left) < 0)
+/* Returns a new array.array of n zeros with the given type code, and points
+ * data at its items, or returns NULL on error */
+static PyObject *
+new_zeroed_array(const char *typecode, Py_ssize_t n, void **data)
+{
+    PyObject *module = PyImport_ImportModule("array");
+    if (module == NULL)
         return NULL;
-    if (right != xlen && sort_point(self, right) < 0)
+    PyObject *zero = PyObject_CallMethod(module, "array", "s[i]", typecode,
+                                         0);
+    Py_DECREF(module);
+    if (zero == NULL)
         return NULL;
-
-    PyListObject *result = (PyListObject *)PyList_New(right - left);
+    /* Repeating doubles the array with memcpy, which beats filling it in */
+    PyObject *result = PySequence_Repeat(zero, n);
+    Py_DECREF(zero);
     if (result == NULL)
         return NULL;
 
-    Py_ssize_t k;
-    for (k = left; k < right; k++) {
-        Py_INCREF(self->xs->ob_item[k]);
-        result->ob_item[k - left] = self->xs->ob_item[k];
+#if PY_MAJOR_VERSION >= 3
+    Py_buffer view;
+    if (PyObject_GetBuffer(result, &view, PyBUF_WRITABLE) < 0) {
+        Py_DECREF(result);
+        return NULL;
     }
-
-    return (PyObject *)result;
+    /* The array is ours alone, so its items won't move */
+    *data = view.buf;
+    PyBuffer_Release(&view);
+#else
+    Py_ssize_t len;
+    if (PyObject_AsWriteBuffer(result, data, &len) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+#endif
+    return result;
 }
 
+/* Returns a new array.array of the n native keys of the given kind that are
+ * step apart from keys on, (or a list, if array has no 64 bit integer type),
+ * or NULL on error. With reverse, the keys are un-reversed on the way. */
 static PyObject *
-ls_index(LSObject *self, PyObject *args)
+strided_native_array(const int64_t *keys, Py_ssize_t step, Py_ssize_t n,
+                     int kind, int reverse)
 {
-    PyObject *item;
-    if (!PyArg_ParseTuple(args, "O:list", &item))
-        return NULL;
+    Py_ssize_t i;
+    PyObject *result;
 
-    Py_ssize_t index = find_item(self, item);
-    if (index == -2) {
-        return NULL;
-    }
-    else if (index == -1) {
-        PyObject *err_format, *err_string, *format_tuple;
-        err_format = PyString_FromString("%r is not in list");
-        if (err_format == NULL)
-            return NULL;
-        format_tuple = PyTuple_Pack(1, item);
-        if (format_tuple == NULL)
-            return NULL;
-        err_string = PyString_Format(err_format, format_tuple);
-        Py_DECREF(format_tuple);
-        if (err_string == NULL)
+    if (kind == NATIVE_FLOAT) {
+        double *values;
+        result = new_zeroed_array("d", n, (void **)&values);
+        if (result == NULL)
             return NULL;
-        PyErr_SetObject(PyExc_ValueError, err_string);
-        Py_DECREF(err_string);
-        return NULL;
+        for (i = 0; i < n; i++) {
+            int64_t v = keys[i * step];
+            /* Reversing leaves NaNs alone, (see reverse_native_keys) */
+            values[i] = native_to_double(reverse && v != NAN_KEY ? ~v : v);
+        }
+        return result;
     }
-    else {
-        return PyInt_FromSsize_t(index);
+
+#if PY_VERSION_HEX >= 0x03030000 || SIZEOF_LONG == 8
+    int64_t *values;
+#if PY_VERSION_HEX >= 0x03030000
+    result = new_zeroed_array("q", n, (void **)&values);
+#else
+    result = new_zeroed_array("l", n, (void **)&values);
+#endif
+    if (result == NULL)
+        return NULL;
+    for (i = 0; i < n; i++)
+        values[i] = reverse ? ~keys[i * step] : keys[i * step];
+    return result;
+#else
+    result = PyList_New(n);
+    if (result == NULL)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        PyObject *item = PyLong_FromLongLong(reverse ? ~keys[i * step]
+                                                     : keys[i * step]);
+        if (item == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, item);
     }
+    return result;
+#endif
 }
 
+/* Returns a new array.array of the n native keys of the given kind, (or a
+ * list, if array has no 64 bit integer type), or NULL on error */
 static PyObject *
-ls_count(LSObject *self, PyObject *args)
+native_array(const int64_t *keys, Py_ssize_t n, int kind)
 {
-    PyObject *item;
-    if (!PyArg_ParseTuple(args, "O:list", &item))
-        return NULL;
+    return strided_native_array(keys, 1, n, kind, 0);
+}
 
-    Py_ssize_t k = find_item(self, item);
-    if (k == -2) {
-        return NULL;
+/* A group id and a value, for grouping sparse ids by sorting */
+typedef struct {
+    int64_t group;
+    int64_t value;
+} GroupedValue;
+
+static int
+compare_groups(const void *a, const void *b)
+{
+    int64_t x = ((const GroupedValue *)a)->group;
+    int64_t y = ((const GroupedValue *)b)->group;
+    return (x > y) - (x < y);
+}
+
+/* Reorders the n values so that the values of each group are together, with
+ * the groups in order of id. The distinct ids go in groups, (which has room
+ * for n), and group i is in values[starts[i]:starts[i + 1]], (so starts has
+ * room for n + 1). Returns the number of groups, or -1 on error. */
+static Py_ssize_t
+group_values(int64_t *values, const int64_t *ids, Py_ssize_t n,
+             int64_t *groups, Py_ssize_t *starts)
+{
+    Py_ssize_t i, g = 0;
+
+    if (n == 0) {
+        starts[0] = 0;
+        return 0;
     }
 
-    if (k == -1) {
-        return PyInt_FromSsize_t(0);
+    int64_t lo = ids[0], hi = ids[0];
+    for (i = 1; i < n; i++) {
+        if (ids[i] < lo)
+            lo = ids[i];
+        if (ids[i] > hi)
+            hi = ids[i];
     }
-    else {
-        /* Figure out where items may be */
-        PivotNode *left, *right;
-        bound_idx(k, self->root, &left, &right);
-        if (right == NULL) {
-            right = next_pivot(left);
-        }
 
-        int xs_len = Py_SIZE(self->xs);
-        int cmp;
-        for (cmp = 1; right->idx < xs_len && cmp; right = next_pivot(right)) {
-            cmp = PyObject_RichCompareBool(item,
-                                           self->xs->ob_item[right->idx],
-                                           Py_EQ);
-            if (cmp < 0) {
-                return NULL;
-            }
+    /* Dense ids, (like 0 to ngroups - 1), are grouped in linear time by
+     * counting sort */
+    if ((uint64_t)hi - (uint64_t)lo < (uint64_t)n) {
+        Py_ssize_t span = (Py_ssize_t)((uint64_t)hi - (uint64_t)lo) + 1;
+        Py_ssize_t *counts = PyMem_New(Py_ssize_t, span + 1);
+        int64_t *grouped = PyMem_New(int64_t, n);
+        if (counts == NULL || grouped == NULL) {
+            PyMem_Free(counts);
+            PyMem_Free(grouped);
+            PyErr_NoMemory();
+            return -1;
         }
 
-        /* TODO: do some additional sorting here to take advantage of the
-         * compares. Or refactor the code substantially or something. */
-        Py_ssize_t count = 1;
-        for (k++; k < right->idx; k++) {
-            cmp = PyObject_RichCompareBool(item, self->xs->ob_item[k], Py_EQ);
-            if (cmp < 0) {
-                return NULL;
-            }
-            else if (cmp) {
-                count++;
+        memset(counts, 0, (span + 1) * sizeof(Py_ssize_t));
+        for (i = 0; i < n; i++)
+            counts[ids[i] - lo + 1]++;
+        for (i = 0; i < span; i++) {
+            if (counts[i + 1] > 0) {
+                groups[g] = lo + i;
+                starts[g++] = counts[i];
             }
+            counts[i + 1] += counts[i];
         }
-        return PyInt_FromSsize_t(count);
+        starts[g] = n;
+        for (i = 0; i < n; i++)
+            grouped[counts[ids[i] - lo]++] = values[i];
+
+        memcpy(values, grouped, n * sizeof(int64_t));
+        PyMem_Free(counts);
+        PyMem_Free(grouped);
+        return g;
     }
-}
 
-static int
-ls_contains(LSObject *self, PyObject *item)
-{
-    Py_ssize_t idx = find_item(self, item);
-    if (idx == -2) {
+    GroupedValue *pairs = PyMem_New(GroupedValue, n);
+    if (pairs == NULL) {
+        PyErr_NoMemory();
         return -1;
     }
-    else if (idx == -1) {
-        return 0;
+    for (i = 0; i < n; i++) {
+        pairs[i].group = ids[i];
+        pairs[i].value = values[i];
     }
-    else {
-        return 1;
+    qsort(pairs, n, sizeof(GroupedValue), compare_groups);
+
+    for (i = 0; i < n; i++) {
+        if (i == 0 || pairs[i].group != pairs[i - 1].group) {
+            groups[g] = pairs[i].group;
+            starts[g++] = i;
+        }
+        values[i] = pairs[i].value;
+    }
+    starts[g] = n;
+    PyMem_Free(pairs);
+    return g;
+}
+
+/* Selects the ranks, (which must be in increasing order), of the n keys,
+ * leaving each of them at its sorted index */
+static void
+select_ranks(int64_t *keys, Py_ssize_t n, const Py_ssize_t *ranks,
+             Py_ssize_t nranks)
+{
+    Py_ssize_t i, left = 0;
+
+    for (i = 0; i < nranks; i++) {
+        /* Everything after the last rank is at least as big as it */
+        if (ranks[i] >= left) {
+            lazysorted_native_select(keys, left, n, ranks[i]);
+            left = ranks[i] + 1;
+        }
     }
 }
 
 static PyObject *
-ls_pivots(LSObject *self)
+group_select(PyObject *self, PyObject *args)
 {
-    PyObject *result = PyList_New(0);
-    if (result == NULL) 
+    PyObject *values_obj, *ids_obj, *ranks_obj;
+    NativeArray values = {NULL, 0, 0};
+    NativeArray ids = {NULL, 0, 0};
+    PyObject *ranks_seq = NULL;
+    PyObject **rank_items;
+    Py_ssize_t *ranks = NULL;
+    double *qs = NULL;
+    int64_t *groups = NULL;
+    Py_ssize_t *starts = NULL;
+    Py_ssize_t *positions = NULL;
+    int64_t *out = NULL;
+    PyObject *group_array, *out_array;
+    PyObject *result = NULL;
+    Py_ssize_t i, g, nranks, ngroups;
+    int kind, id_kind;
+    int quantiles = 0;
+
+    if (!PyArg_ParseTuple(args, "OOO:group_select", &values_obj, &ids_obj,
+                          &ranks_obj))
         return NULL;
 
-    PyObject *unsorted = PyString_FromString("UNSORTED");
-    if (unsorted == NULL)
-        return NULL;
-    PyObject *sortedright = PyString_FromString("SORTED_RIGHT");
-    if (sortedright == NULL)
-        return NULL;
-    PyObject *sortedleft = PyString_FromString("SORTED_LEFT");
-    if (sortedleft == NULL)
-        return NULL;
-    PyObject *sortedboth = PyString_FromString("SORTED_BOTH");
-    if (sortedboth == NULL)
-        return NULL;
+    if (append_numbers(&values, values_obj, &kind, "values") < 0 ||
+        append_numbers(&ids, ids_obj, &id_kind, "group_ids") < 0)
+        goto done;
+    if (id_kind != NATIVE_INT) {
+        PyErr_SetString(PyExc_TypeError, "group_ids must be ints");
+        goto done;
+    }
+    if (values.len != ids.len) {
+        PyErr_SetString(PyExc_ValueError,
+                        "values and group_ids must have the same length");
+        goto done;
+    }
 
-    PyObject *flags[4] = {unsorted, sortedright, sortedleft, sortedboth};
+    /* Integer ranks are indices into each sorted group, like LazySorted
+     * indices, and floats are quantiles, interpolated linearly */
+    ranks_seq = PySequence_Fast(ranks_obj, "ranks must be a sequence");
+    if (ranks_seq == NULL)
+        goto done;
+    nranks = PySequence_Fast_GET_SIZE(ranks_seq);
+    rank_items = PySequence_Fast_ITEMS(ranks_seq);
+    ranks = PyMem_New(Py_ssize_t, nranks > 0 ? nranks : 1);
+    qs = PyMem_New(double, nranks > 0 ? nranks : 1);
+    positions = PyMem_New(Py_ssize_t, 2 * nranks + 1);
+    if (ranks == NULL || qs == NULL || positions == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < nranks; i++) {
+        if (PyFloat_Check(rank_items[i]))
+            quantiles = 1;
+    }
+    for (i = 0; i < nranks; i++) {
+        if (quantiles) {
+            qs[i] = PyFloat_AsDouble(rank_items[i]);
+            if (qs[i] == -1.0 && PyErr_Occurred())
+                goto done;
+            if (!(0.0 <= qs[i] && qs[i] <= 1.0)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "quantiles must be between 0 and 1");
+                goto done;
+            }
+        }
+        else {
+            ranks[i] = PyNumber_AsSsize_t(rank_items[i], PyExc_IndexError);
+            if (ranks[i] == -1 && PyErr_Occurred())
+                goto done;
+        }
+    }
 
-    PivotNode *curr = self->root;
-    while (curr->left != NULL)
-        curr = curr->left;
+    groups = PyMem_New(int64_t, values.len > 0 ? values.len : 1);
+    starts = PyMem_New(Py_ssize_t, values.len + 1);
+    if (groups == NULL || starts == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    ngroups = group_values(values.keys, ids.keys, values.len, groups, starts);
+    if (ngroups < 0)
+        goto done;
+
+    out = PyMem_New(int64_t, ngroups * nranks > 0 ? ngroups * nranks : 1);
+    if (out == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
 
-    Py_ssize_t i;
-    PyObject *index;
-    PyObject *tuple;
-    for (i = 0; curr != NULL; i++, curr = next_pivot(curr)) {
-        index = PyInt_FromSsize_t(curr->idx);
-        if (index == NULL) {
-            Py_DECREF(result);
-            return NULL;
+    for (g = 0; g < ngroups; g++) {
+        int64_t *keys = values.keys + starts[g];
+        Py_ssize_t n = starts[g + 1] - starts[g];
+        Py_ssize_t npositions = 0;
+
+        /* Find the indices each rank needs, then select them all at once */
+        for (i = 0; i < nranks; i++) {
+            if (quantiles) {
+                Py_ssize_t lo = (Py_ssize_t)(qs[i] * (n - 1));
+                positions[npositions++] = lo;
+                if (lo + 1 < n)
+                    positions[npositions++] = lo + 1;
+            }
+            else {
+                Py_ssize_t r = ranks[i] < 0 ? ranks[i] + n : ranks[i];
+                if (r < 0 || r >= n) {
+                    PyErr_Format(PyExc_IndexError,
+                                 "rank %zd out of range for group %lld of "
+                                 "size %zd", ranks[i], (long long)groups[g],
+                                 n);
+                    goto done;
+                }
+                positions[npositions++] = r;
+            }
         }
-        tuple = PyTuple_Pack(2, index, flags[curr->flags]);
-        if (tuple == NULL) {
-            Py_DECREF(index);
-            Py_DECREF(result);
-            return NULL;
+        qsort(positions, npositions, sizeof(Py_ssize_t), compare_ssize);
+        select_ranks(keys, n, positions, npositions);
+
+        for (i = 0; i < nranks; i++) {
+            int64_t *res = &out[g * nranks + i];
+            if (quantiles) {
+                double h = qs[i] * (n - 1);
+                Py_ssize_t lo = (Py_ssize_t)h;
+                double v = native_as_double(keys[lo], kind);
+                if (lo + 1 < n && h > lo) {
+                    double w = native_as_double(keys[lo + 1], kind);
+                    v += (w - v) * (h - lo);
+                }
+                *res = double_to_native(v);
+            }
+            else {
+                *res = keys[ranks[i] < 0 ? ranks[i] + n : ranks[i]];
+            }
         }
-        PyList_Append(result, tuple);
     }
 
-    return (PyObject*)result;
+    group_array = native_array(groups, ngroups, NATIVE_INT);
+    if (group_array == NULL)
+        goto done;
+    out_array = native_array(out, ngroups * nranks,
+                             quantiles ? NATIVE_FLOAT : kind);
+    if (out_array == NULL) {
+        Py_DECREF(group_array);
+        goto done;
+    }
+    result = Py_BuildValue("(NN)", group_array, out_array);
+
+done:
+    PyMem_Free(values.keys);
+    PyMem_Free(ids.keys);
+    Py_XDECREF(ranks_seq);
+    PyMem_Free(ranks);
+    PyMem_Free(qs);
+    PyMem_Free(groups);
+    PyMem_Free(starts);
+    PyMem_Free(positions);
+    PyMem_Free(out);
+    return result;
 }
 
-static Py_ssize_t
-ls_length(LSObject *self)
+static PyObject *
+median_many(PyObject *self, PyObject *seqs)
 {
-    return Py_SIZE(self->xs);
+    NativeArray values = {NULL, 0, 0};
+    Py_ssize_t *starts = NULL;
+    char *kinds = NULL;
+    double *medians = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t g;
+    int kind;
+
+    PyObject *seq = PySequence_Fast(seqs, "expected a sequence of sequences");
+    if (seq == NULL)
+        return NULL;
+    Py_ssize_t ngroups = PySequence_Fast_GET_SIZE(seq);
+
+    starts = PyMem_New(Py_ssize_t, ngroups + 1);
+    kinds = PyMem_New(char, ngroups > 0 ? ngroups : 1);
+    medians = PyMem_New(double, ngroups > 0 ? ngroups : 1);
+    if (starts == NULL || kinds == NULL || medians == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* Each group keeps its own kind, so ints stay exact even if other groups
+     * are floats */
+    for (g = 0; g < ngroups; g++) {
+        starts[g] = values.len;
+        if (append_numbers(&values, PySequence_Fast_GET_ITEM(seq, g), &kind,
+                           "sequences") < 0)
+            goto done;
+        if (values.len == starts[g]) {
+            PyErr_SetString(PyExc_ValueError, "median of an empty sequence");
+            goto done;
+        }
+        kinds[g] = (char)kind;
+    }
+    starts[ngroups] = values.len;
+
+    for (g = 0; g < ngroups; g++) {
+        int64_t *keys = values.keys + starts[g];
+        Py_ssize_t n = starts[g + 1] - starts[g];
+        Py_ssize_t mid[2];
+
+        mid[0] = (n - 1) / 2;
+        mid[1] = n / 2;
+        select_ranks(keys, n, mid, 2);
+        medians[g] = (native_as_double(keys[mid[0]], kinds[g]) +
+                      native_as_double(keys[mid[1]], kinds[g])) / 2;
+    }
+
+    result = new_array("d", medians, ngroups, sizeof(double));
+
+done:
+    Py_DECREF(seq);
+    PyMem_Free(values.keys);
+    PyMem_Free(starts);
+    PyMem_Free(kinds);
+    PyMem_Free(medians);
+    return result;
 }
 
-/* The LazySorted iterator object */
-/* TODO: Be a little smarter here, (keep track of pivots, etc) */
+/* List of functions defined in the module */
+/* Joins. Two LazySorted objects are joined by leapfrogging: each side jumps
+ * straight to the first key that is not less than the other side's current
+ * key, with the same search that bisect uses, so whole ranges of keys that
+ * have no match on the other side are skipped without being sorted. */
+
 typedef struct {
     PyObject_HEAD
-    LSObject            *ls;            /* The referenced lazysorted object */
-    Py_ssize_t          i;              /* The next location to check */
-} LSIterObject;
-
-static PyTypeObject LSIter_Type;
-#define LSIterObject_Check(v)      (Py_TYPE(v) == &LSIter_Type)
+    LSObject            *a;
+    LSObject            *b;
+    Py_ssize_t          i;              /* Where to look next in a */
+    Py_ssize_t          j;              /* Where to look next in b */
+    int                 pairs;          /* 1 for merge_join, 0 for intersect */
+    PyObject            *a_run;         /* The matching items of a, or NULL */
+    PyObject            *b_run;         /* The matching items of b */
+    Py_ssize_t          p, q;           /* The next pair of them */
+} JoinObject;
 
-static PyMethodDef LSIterObject_methods[] = {
-    {NULL, NULL}           /* sentinel */
-};
+static void
+JoinObject_dealloc(JoinObject *join)
+{
+    Py_DECREF(join->a);
+    Py_DECREF(join->b);
+    Py_XDECREF(join->a_run);
+    Py_XDECREF(join->b_run);
+    PyObject_Del(join);
+}
 
-PyObject*
-LSObject_iter(PyObject *self)
+/* Finds the next key that both sides have. Sets *a_end and *b_end to the
+ * ends of its runs of items, which start at join->i and join->j. Returns 1 if
+ * there is one, 0 if not, and -1 on error. */
+static int
+next_match(JoinObject *join, Py_ssize_t *a_end, Py_ssize_t *b_end)
 {
-    LSIterObject *it;
+    LSObject *a = join->a;
+    LSObject *b = join->b;
+    PyObject *a_key, *b_key;
+    Py_ssize_t next;
+    int lt;
+
+    while (join->i < Py_SIZE(a->xs) && join->j < Py_SIZE(b->xs)) {
+        if (limit_pivots(a) < 0 || sort_point(a, join->i) < 0)
+            return -1;
+        if ((a_key = key_at(a, join->i)) == NULL)
+            return -1;
+        if ((next = rank_key(b, a_key, 0)) < 0) {
+            Py_DECREF(a_key);
+            return -1;
+        }
+        join->j = next > join->j ? next : join->j;
+        if (join->j == Py_SIZE(b->xs)) {
+            Py_DECREF(a_key);
+            return 0;
+        }
 
-    if (!LSObject_Check(self)) {
-        PyErr_BadInternalCall();
-        return NULL;
-    }
-    it = PyObject_GC_New(LSIterObject, &LSIter_Type);
-    if (it == NULL)
-        return NULL;
-    it->i = 0;
-    Py_INCREF(self);
-    it->ls = (LSObject *)self;
+        if (limit_pivots(b) < 0 || sort_point(b, join->j) < 0 ||
+            (b_key = key_at(b, join->j)) == NULL) {
+            Py_DECREF(a_key);
+            return -1;
+        }
 
-    return (PyObject *)it;
-}
+        /* b's key isn't less than a's, so they match unless it's greater */
+        lt = islt(a_key, b_key, a);
+        if (lt == 0) {
+            *a_end = rank_key(a, a_key, 1);
+            *b_end = *a_end < 0 ? -1 : rank_key(b, b_key, 1);
+        }
+        else if (lt == 1) {
+            next = rank_key(a, b_key, 0);
+        }
+        Py_DECREF(a_key);
+        Py_DECREF(b_key);
+        if (lt < 0)
+            return -1;
 
-static void
-LSIterObject_dealloc(LSIterObject *it)
-{
-    Py_XDECREF(it->ls);
-    PyObject_GC_Del(it);
+        if (lt == 1) {
+            if (next < 0)
+                return -1;
+            join->i = next > join->i ? next : join->i + 1;
+        }
+        else {
+            if (*a_end < 0 || *b_end < 0)
+                return -1;
+            /* Keys that don't compare sensibly, like NaNs, still move on */
+            *a_end = *a_end > join->i ? *a_end : join->i + 1;
+            *b_end = *b_end > join->j ? *b_end : join->j + 1;
+            return 1;
+        }
+    }
+    return 0;
 }
 
-PyObject*
-LSObject_iternext(PyObject *self)
+static PyObject *
+JoinObject_iternext(JoinObject *join)
 {
-    LSIterObject *lsi = (LSIterObject *)self;
-    if (lsi->i < ls_length(lsi->ls)) {
-        if (sort_point(lsi->ls, lsi->i) < 0) {
-            return NULL;    
+    Py_ssize_t a_end = 0;
+    Py_ssize_t b_end = 0;
+
+    if (join->a_run == NULL) {
+        if (next_match(join, &a_end, &b_end) <= 0)
+            return NULL;
+
+        if (!join->pairs) {
+            PyObject *item = join->a->xs->ob_item[join->i];
+            Py_INCREF(item);
+            join->i = a_end;
+            join->j = b_end;
+            return item;
         }
-        PyObject *res = lsi->ls->xs->ob_item[lsi->i];
-        Py_INCREF(res);
-        (lsi->i)++;
-        return res;
-    } else {
-        PyErr_SetNone(PyExc_StopIteration);
+
+        /* Copy the runs out, since other queries on a or b could move the
+         * items around while the pairs are handed out */
+        join->a_run = list_range(join->a, join->i, a_end);
+        join->b_run = list_range(join->b, join->j, b_end);
+        if (join->a_run == NULL || join->b_run == NULL) {
+            Py_CLEAR(join->a_run);
+            Py_CLEAR(join->b_run);
+            return NULL;
+        }
+        join->i = a_end;
+        join->j = b_end;
+        join->p = join->q = 0;
+    }
+
+    PyObject *pair = PyTuple_Pack(2, PyList_GET_ITEM(join->a_run, join->p),
+                                  PyList_GET_ITEM(join->b_run, join->q));
+    if (pair == NULL)
         return NULL;
+    if (++join->q == PyList_GET_SIZE(join->b_run)) {
+        join->q = 0;
+        if (++join->p == PyList_GET_SIZE(join->a_run)) {
+            Py_CLEAR(join->a_run);
+            Py_CLEAR(join->b_run);
+        }
     }
+    return pair;
 }
 
-static PyTypeObject LSIter_Type = {
+static PyTypeObject Join_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "LazySortedIterator",                       /* tp_name */
-    sizeof(LSIterObject),                       /* tp_basicsize */
+    "LazySortedJoinIterator",                   /* tp_name */
+    sizeof(JoinObject),                         /* tp_basicsize */
     0,                                          /* tp_itemsize */
     /* methods */
-    (destructor)LSIterObject_dealloc,           /* tp_dealloc */
+    (destructor)JoinObject_dealloc,             /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -1410,133 +5893,115 @@ static PyTypeObject LSIter_Type = {
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)LSObject_iternext,            /* tp_iternext */
-    LSIterObject_methods,                       /* tp_methods */
-    0,                                          /* tp_members */
+    (iternextfunc)JoinObject_iternext,          /* tp_iternext */
 };
 
+static PyObject *
+new_join(PyObject *args, const char *format, int pairs)
+{
+    LSObject *a, *b;
+    if (!PyArg_ParseTuple(args, format, &LS_Type, &a, &LS_Type, &b))
+        return NULL;
+    if (a->reverse != b->reverse) {
+        PyErr_SetString(PyExc_ValueError,
+                        "both LazySorted objects must have the same reverse");
+        return NULL;
+    }
+
+    JoinObject *join = PyObject_New(JoinObject, &Join_Type);
+    if (join == NULL)
+        return NULL;
+    Py_INCREF(a);
+    Py_INCREF(b);
+    join->a = a;
+    join->b = b;
+    join->i = join->j = 0;
+    join->pairs = pairs;
+    join->a_run = join->b_run = NULL;
+    join->p = join->q = 0;
+    return (PyObject *)join;
+}
 
-/* TODO: This documentation sucks */
-static PyMethodDef LS_methods[] = {
-    {"__getitem__", (PyCFunction)ls_subscript, METH_O|METH_COEXIST,
+static PyObject *
+merge_join(PyObject *self, PyObject *args)
+{
+    return new_join(args, "O!O!:merge_join", 1);
+}
+
+static PyObject *
+intersect(PyObject *self, PyObject *args)
+{
+    return new_join(args, "O!O!:intersect", 0);
+}
+
+static PyMethodDef ls_methods[] = {
+    {"group_select", (PyCFunction)group_select, METH_VARARGS,
         PyDoc_STR(
-"__getitem__ allows you to access items from the LazySorted instance. It is\n"
-"equivalent to the subscript notation, ie, LS.__getitem__(x) is the same\n"
-"thing as LS[x], where x is integer or slice object.\n"
-"When __getitem__ is called, it sorts the internal list only enough so that\n"
-"it can get your query, and then returns it.\n"
+"group_select(values, group_ids, ranks) -> (groups, results)\n"
 "\n"
-"Examples:\n"
-"    >>> xs = range(100)\n"
-"    >>> random.shuffle(xs)\n"
-"    >>> ls = LazySorted(xs)\n"
-"    >>> ls[26]\n"
-"    26\n"
-"    >>> ls[5:10]\n"
-"    [5, 6, 7, 8, 9]\n"
-"    >>> ls[::20]\n"
-"    [0, 20, 40, 60, 80]"
-)},
-    {"between", (PyCFunction)between, METH_VARARGS,
-        PyDoc_STR(
-"between allows you to access all points that are between particular\n"
-"indices. The order of the points it returns, however, is undefined. This is\n"
-"useful if you want to throw away outliers in some data set, for example.\n"
+"Finds order statistics of many groups of numbers at once, which is much\n"
+"faster than making a LazySorted of each group. values and group_ids are\n"
+"sequences, (or buffers, like array.array or numpy arrays), of the same\n"
+"length, where values are ints or floats and group_ids are ints. ranks are\n"
+"either ints, which are indices into each sorted group, (negative ones\n"
+"counting from the end), or floats between 0 and 1, which are quantiles,\n"
+"interpolated linearly between the two nearest items like numpy does, (if\n"
+"any rank is a float, they are all taken to be quantiles).\n"
+"\n"
+"Returns an array.array of the distinct group ids, in increasing order, and\n"
+"an array.array of len(ranks) results for each of those groups, one group\n"
+"after another.\n"
 "\n"
 "Examples:\n\n"
-"    >>> xs = range(100)\n"
-"    >>> random.shuffle(xs)\n"
-"    >>> ls = LazySorted(xs)\n"
-"    >>> set(ls.between(5, 95)) == set(range(5, 95))\n"
-"    True"
+"    >>> groups, medians = group_select([5, 1, 9, 3, 4], [0, 0, 1, 1, 1],\n"
+"    ...                                [0.5])\n"
+"    >>> list(groups), list(medians)\n"
+"    ([0, 1], [3.0, 4.0])"
 )},
-    {"index", (PyCFunction)ls_index, METH_VARARGS,
+    {"median_many", (PyCFunction)median_many, METH_O,
         PyDoc_STR(
-"Returns the first index of item in the list, or raises a ValueError if it\n"
-"isn't present"
+"median_many(sequences) -> array\n"
+"\n"
+"Returns an array.array('d') of the median of each of the sequences of ints\n"
+"and floats, (the mean of the middle two items for sequences of even\n"
+"length), computed in one pass without making a LazySorted of each.\n"
+"\n"
+"Examples:\n\n"
+"    >>> list(median_many([[3, 1, 2], [4, 1, 3, 2]]))\n"
+"    [2.0, 2.5]"
 )},
-    {"count", (PyCFunction)ls_count, METH_VARARGS,
+    {"merge_join", (PyCFunction)merge_join, METH_VARARGS,
         PyDoc_STR(
-"Returns the number of times the item appears in the list"
+"merge_join(a, b) -> iterator\n"
+"\n"
+"Joins the LazySorted objects a and b on their keys, yielding an (x, y)\n"
+"pair for every item x of a and item y of b with equal keys, in order of\n"
+"their keys. Both objects must sort the same way, (with the same reverse,\n"
+"and keys that are comparable with each other). Ranges of keys that only\n"
+"one side has are skipped over without sorting them, so a sparse join, or\n"
+"one that isn't run to the end, costs much less than sorting both sides.\n"
+"\n"
+"Examples:\n\n"
+"    >>> a = LazySorted([3, 1, 4, 1, 5])\n"
+"    >>> b = LazySorted([5, 1, 2, 6])\n"
+"    >>> list(merge_join(a, b))\n"
+"    [(1, 1), (1, 1), (5, 5)]"
 )},
-    {"_pivots", (PyCFunction)ls_pivots, METH_NOARGS,
+    {"intersect", (PyCFunction)intersect, METH_VARARGS,
         PyDoc_STR(
-"Returns the list of pivot indices, for debugging"
+"intersect(a, b) -> iterator\n"
+"\n"
+"Yields an item of the LazySorted object a for each distinct key that both\n"
+"a and b have, in sorted order, skipping over keys that only one of them has\n"
+"as merge_join does.\n"
+"\n"
+"Examples:\n\n"
+"    >>> list(intersect(LazySorted([3, 1, 4, 1, 5]), LazySorted([5, 1, 2])))\n"
+"    [1, 5]"
 )},
     {NULL,              NULL}           /* sentinel */
 };
 
-static PySequenceMethods ls_as_sequence = {
-    (lenfunc)ls_length,                         /* sq_length */
-    0,                                          /* sq_concat */
-    0,                                          /* sq_repeat */
-    0,                                          /* sq_item */
-    0,                                          /* sq_slice */
-    0,                                          /* sq_ass_item */
-    0,                                          /* sq_ass_slice */
-    (objobjproc)ls_contains,                    /* sq_contains */
-    0,                                          /* sq_inplace_concat */
-    0,                                          /* sq_inplace_repeat */
-};
-
-static PyMappingMethods ls_as_mapping = {
-    (lenfunc)ls_length,
-    (binaryfunc)ls_subscript,
-    NULL,
-};
-
-static PyTypeObject LS_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "lazysorted.LazySorted",/*tp_name*/
-    sizeof(LSObject),       /*tp_basicsize*/
-    0,                      /*tp_itemsize*/
-    /* methods */
-    (destructor)LS_dealloc, /*tp_dealloc*/
-    0,                      /*tp_print*/
-    0,                      /*tp_getattr*/
-    0,                      /*tp_setattr*/
-    0,                      /*tp_compare*/
-    0,                      /*tp_repr*/
-    0,                      /*tp_as_number*/
-    &ls_as_sequence,        /*tp_as_sequence*/
-    &ls_as_mapping,         /*tp_as_mapping*/
-    0,                      /*tp_hash*/
-    0,                      /*tp_call*/
-    0,                      /*tp_str*/
-    0,                      /*tp_getattro*/
-    0,                      /*tp_setattro*/
-    0,                      /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT |
-    Py_TPFLAGS_BASETYPE,    /*tp_flags*/
-    0,                      /*tp_doc*/
-    0,                      /*tp_traverse*/
-    0,                      /*tp_clear*/
-    0,                      /*tp_richcompare*/
-    0,                      /*tp_weaklistoffset*/
-    LSObject_iter,          /*tp_iter*/
-    0,                      /*tp_iternext*/
-    LS_methods,             /*tp_methods*/
-    0,                      /*tp_members*/
-    0,                      /*tp_getset*/
-    0,                      /*tp_base*/
-    0,                      /*tp_dict*/
-    0,                      /*tp_descr_get*/
-    0,                      /*tp_descr_set*/
-    0,                      /*tp_dictoffset*/
-    0,                      /*tp_init*/
-    PyType_GenericAlloc,    /*tp_alloc*/
-    newLSObject,            /*tp_new*/
-    0,                      /*tp_free*/
-    0,                      /*tp_is_gc*/
-};
-
-/* List of functions defined in the module */
-static PyMethodDef ls_methods[] = {
-    {NULL,              NULL}           /* sentinel */
-};
-
 PyDoc_STRVAR(module_doc,
 "lazysorted is a Python extension module for sorting sequences lazily. It\n"
 "presents the programmer with the abstraction that they are actually working\n"
@@ -1563,6 +6028,12 @@ PyInit_lazysorted(void)
 
     if (PyType_Ready(&LS_Type) < 0)
         return NULL;
+    if (PyType_Ready(&Join_Type) < 0)
+        return NULL;
+
+    PyDateTime_IMPORT;
+    if (PyDateTimeAPI == NULL)
+        return NULL;
 
     /* Create the module and add the functions */
     static struct PyModuleDef moduledef = {
@@ -1581,6 +6052,8 @@ PyInit_lazysorted(void)
         return NULL;
 
     PyModule_AddObject(m, "LazySorted", (PyObject *)&LS_Type);
+    if (add_capi(m) < 0)
+        return NULL;
     return m;
 }
 #else
@@ -1596,6 +6069,12 @@ initlazysorted(void)
 
     if (PyType_Ready(&LS_Type) < 0)
         return;
+    if (PyType_Ready(&Join_Type) < 0)
+        return;
+
+    PyDateTime_IMPORT;
+    if (PyDateTimeAPI == NULL)
+        return;
 
     /* Create the module and add the functions */
     m = Py_InitModule3("lazysorted", ls_methods, module_doc);
@@ -1603,6 +6082,7 @@ initlazysorted(void)
         return;
 
     PyModule_AddObject(m, "LazySorted", (PyObject *)&LS_Type);
+    add_capi(m);
     return;
 }
 #endif
@@ -0,0 +1,100 @@
+/* The C API of the lazysorted module.
+ *
+ * Other extensions can use LazySorted objects without going through python
+ * attribute lookups and calls by importing this API, which the module exports
+ * as a PyCapsule:
+ *
+ *     #include "lazysorted.h"
+ *
+ *     if (LazySorted_ImportCAPI() < 0)
+ *         return NULL;
+ *     ls = LazySorted_CAPI->FromBuffer(scores, 0);
+ *     median = LazySorted_CAPI->Select(ls, n / 2);
+ *
+ * Unless noted otherwise, indices must satisfy 0 <= start <= stop <= len(ls)
+ * and 0 <= k < len(ls), and functions set a python exception on error.
+ *
+ * The version is bumped whenever the struct changes incompatibly; new
+ * functions are only ever added to the end.
+ */
+
+#ifndef LAZYSORTED_H
+#define LAZYSORTED_H
+
+#include <Python.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LAZYSORTED_CAPI_VERSION 1
+#define LAZYSORTED_CAPSULE_NAME "lazysorted._C_API"
+
+typedef struct {
+    int version;                /* LAZYSORTED_CAPI_VERSION of the module */
+    PyTypeObject *Type;         /* The LazySorted type */
+
+    /* Returns a new LazySorted of the n items, as LazySorted(items, key=key,
+     * reverse=reverse), where key may be NULL. Returns NULL on error. */
+    PyObject *(*FromArray)(PyObject *const *items, Py_ssize_t n,
+                           PyObject *key, int reverse);
+
+    /* Returns a new LazySorted of a sequence that is also a one dimensional
+     * buffer of numbers, (like an array.array or a numpy array), comparing its
+     * values natively. Returns NULL on error. */
+    PyObject *(*FromBuffer)(PyObject *buffer, int reverse);
+
+    /* Returns a new reference to the kth item in sorted order, or NULL on
+     * error */
+    PyObject *(*Select)(PyObject *ls, Py_ssize_t k);
+
+    /* Sorts the items whose sorted indices are in [start, stop). Returns 0 on
+     * success and -1 on error. */
+    int (*SortRange)(PyObject *ls, Py_ssize_t start, Py_ssize_t stop);
+
+    /* Returns a new list of the items whose sorted indices are in
+     * [start, stop), in no particular order, or NULL on error */
+    PyObject *(*Between)(PyObject *ls, Py_ssize_t start, Py_ssize_t stop);
+
+    /* Returns the number of items whose keys are less than key, (which is the
+     * item itself if there is no key function), or -1 on error */
+    Py_ssize_t (*Rank)(PyObject *ls, PyObject *key);
+
+    /* Returns a pointer to the stop - start items whose sorted indices are in
+     * [start, stop), in sorted order if sorted is nonzero and in no
+     * particular order otherwise, or NULL on error. The references are
+     * borrowed from ls, and are only valid until ls is next used. */
+    PyObject **(*Range)(PyObject *ls, Py_ssize_t start, Py_ssize_t stop,
+                        int sorted);
+} LazySorted_CAPIObject;
+
+#ifndef LAZYSORTED_MODULE
+
+static LazySorted_CAPIObject *LazySorted_CAPI = NULL;
+
+/* Imports the C API into LazySorted_CAPI. Returns 0 on success and -1 with an
+ * exception set on error. */
+static int
+LazySorted_ImportCAPI(void)
+{
+    LazySorted_CAPIObject *api = (LazySorted_CAPIObject *)
+        PyCapsule_Import(LAZYSORTED_CAPSULE_NAME, 0);
+    if (api == NULL)
+        return -1;
+    if (api->version != LAZYSORTED_CAPI_VERSION) {
+        PyErr_Format(PyExc_ImportError,
+                     "lazysorted C API version %d, expected %d",
+                     api->version, LAZYSORTED_CAPI_VERSION);
+        return -1;
+    }
+    LazySorted_CAPI = api;
+    return 0;
+}
+
+#endif /* LAZYSORTED_MODULE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LAZYSORTED_H */
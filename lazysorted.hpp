@@ -0,0 +1,615 @@
+/* The lazysorted engine, as a header-only C++ library.
+ *
+ * This is the same lazy quickselect that lazysorted.c implements for python
+ * objects, specialized at compile time on the element type, the comparison
+ * and the width of the indices, so that comparisons are inlined. It is used
+ * both by C++ code that wants a lazy selector over native types:
+ *
+ *     #include "lazysorted.hpp"
+ *
+ *     lazysorted::LazySorted<double> ls(latencies.begin(), latencies.end());
+ *     double p99 = ls[ls.size() * 99 / 100];
+ *     ls.sort_range(0, 10);       // The ten fastest, in order
+ *
+ * and by the python module, whose native int64 keys are partitioned and sorted
+ * by the kernels below, (see lazysorted_engine.cpp).
+ *
+ * Like the python version, the list is only ever partially sorted, with a
+ * treap of pivots recording which indices already hold their final items and
+ * which regions between them are sorted. Comparisons must not throw.
+ */
+
+#ifndef LAZYSORTED_HPP
+#define LAZYSORTED_HPP
+
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace lazysorted {
+
+/* Sort if the region has SORT_THRESH or fewer elements */
+static const int SORT_THRESH = 16;
+
+namespace detail {
+
+/* Items that are moved around in parallel with the keys that are compared,
+ * like the python objects that go with native keys. NoPayload is for when the
+ * keys are the items themselves. */
+struct NoPayload {
+    struct value_type {};
+
+    template <class Index> void swap(Index, Index) {}
+    template <class Index> value_type get(Index) const { return value_type(); }
+    template <class Index> void set(Index, value_type) {}
+};
+
+template <class Item>
+struct ArrayPayload {
+    typedef Item value_type;
+    Item *items;
+
+    explicit ArrayPayload(Item *items) : items(items) {}
+
+    template <class Index> void swap(Index i, Index j) {
+        Item tmp = items[i];
+        items[i] = items[j];
+        items[j] = tmp;
+    }
+    template <class Index> value_type get(Index i) const { return items[i]; }
+    template <class Index> void set(Index i, value_type item) {
+        items[i] = item;
+    }
+};
+
+/* Two payloads that are moved around together, like the python objects that
+ * go with native keys and their weights */
+template <class First, class Second>
+struct PairPayload {
+    typedef std::pair<typename First::value_type,
+                      typename Second::value_type> value_type;
+    First first;
+    Second second;
+
+    PairPayload(First first, Second second) : first(first), second(second) {}
+
+    template <class Index> void swap(Index i, Index j) {
+        first.swap(i, j);
+        second.swap(i, j);
+    }
+    template <class Index> value_type get(Index i) const {
+        return value_type(first.get(i), second.get(i));
+    }
+    template <class Index> void set(Index i, value_type item) {
+        first.set(i, item.first);
+        second.set(i, item.second);
+    }
+};
+
+/* A random index in [left, right) */
+template <class Index, class Rng>
+inline Index random_index(Index left, Index right, Rng &rng)
+{
+    return left + static_cast<Index>(rng() % static_cast<unsigned long long>(
+                                                 right - left));
+}
+
+/* Returns whichever of idx1, idx2 and idx3 has the median key */
+template <class Key, class Index, class Compare>
+inline Index median_of_three(const Key *keys, Index idx1, Index idx2,
+                             Index idx3, Compare &lt)
+{
+    if (lt(keys[idx1], keys[idx3])) {
+        if (lt(keys[idx1], keys[idx2])) {
+            /* 1 2 3 vs. 1 3 2 */
+            return lt(keys[idx2], keys[idx3]) ? idx2 : idx3;
+        }
+        /* 2 1 3 */
+        return idx1;
+    }
+    else {
+        if (lt(keys[idx3], keys[idx2])) {
+            /* 3 1 2 vs 3 2 1 */
+            return lt(keys[idx1], keys[idx2]) ? idx1 : idx2;
+        }
+        /* 2 3 1 */
+        return idx3;
+    }
+}
+
+template <class Key, class Payload, class Index>
+inline void swap_at(Key *keys, Payload &payload, Index i, Index j)
+{
+    using std::swap;
+    swap(keys[i], keys[j]);
+    payload.swap(i, j);
+}
+
+/* Partitions the keys between left and right into
+ * [less than region | greater or equal to region]
+ * around a median of three pivot, and returns the pivot's index */
+template <class Key, class Payload, class Index, class Compare, class Rng>
+Index partition(Key *keys, Payload payload, Index left, Index right,
+                Compare &lt, Rng &rng)
+{
+    Index piv_idx = median_of_three(keys, random_index(left, right, rng),
+                                    random_index(left, right, rng),
+                                    random_index(left, right, rng), lt);
+    swap_at(keys, payload, left, piv_idx);
+
+    /* The pivot stays at left until the end, since last_less is incremented
+     * before every swap */
+    const Key &pivot = keys[left];
+    Index last_less = left;
+
+    for (Index i = left + 1; i < right; i++) {
+        if (lt(keys[i], pivot)) {
+            last_less++;
+            swap_at(keys, payload, i, last_less);
+        }
+    }
+
+    swap_at(keys, payload, left, last_less);
+    return last_less;
+}
+
+/* Runs insertion sort on the keys left <= i < right */
+template <class Key, class Payload, class Index, class Compare>
+void insertion_sort(Key *keys, Payload payload, Index left, Index right,
+                    Compare &lt)
+{
+    for (Index i = left + 1; i < right; i++) {
+        Key tmp = std::move(keys[i]);
+        typename Payload::value_type item = payload.get(i);
+        Index j;
+        for (j = i; j > left && lt(tmp, keys[j - 1]); j--) {
+            keys[j] = std::move(keys[j - 1]);
+            payload.set(j, payload.get(j - 1));
+        }
+        keys[j] = std::move(tmp);
+        payload.set(j, item);
+    }
+}
+
+/* Runs quicksort on the keys left <= i < right */
+template <class Key, class Payload, class Index, class Compare, class Rng>
+void quick_sort(Key *keys, Payload payload, Index left, Index right,
+                Compare &lt, Rng &rng)
+{
+    if (right - left <= SORT_THRESH) {
+        insertion_sort(keys, payload, left, right, lt);
+        return;
+    }
+
+    Index piv_idx = partition(keys, payload, left, right, lt, rng);
+    quick_sort(keys, payload, left, piv_idx, lt, rng);
+    quick_sort(keys, payload, static_cast<Index>(piv_idx + 1), right, lt,
+               rng);
+}
+
+/* Rearranges the keys left <= i < right so that keys[k] is the key that
+ * would be there if they were sorted, with only smaller keys before it and no
+ * smaller keys after it. This is plain quickselect, for when none of the
+ * pivots are worth keeping. */
+template <class Key, class Payload, class Index, class Compare, class Rng>
+void select(Key *keys, Payload payload, Index left, Index right, Index k,
+            Compare &lt, Rng &rng)
+{
+    while (right - left > SORT_THRESH) {
+        Index piv_idx = partition(keys, payload, left, right, lt, rng);
+        if (piv_idx == k)
+            return;
+        if (piv_idx < k)
+            left = static_cast<Index>(piv_idx + 1);
+        else
+            right = piv_idx;
+    }
+    insertion_sort(keys, payload, left, right, lt);
+}
+
+/* A small, fast generator for pivots and treap priorities */
+struct XorShift {
+    unsigned state;
+
+    explicit XorShift(unsigned seed) : state(seed != 0 ? seed : 1) {}
+
+    unsigned operator()() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+};
+
+}  /* namespace detail */
+
+/* SORTED_RIGHT means the pivot is to the right of a sorted region.
+ * SORTED_LEFT means the pivot is the left of a sorted region */
+enum {
+    UNSORTED = 0,
+    SORTED_RIGHT = 1,
+    SORTED_LEFT = 2,
+    SORTED_BOTH = 3
+};
+
+/* A partially and lazily sorted list of T, ordered by Compare. Index is the
+ * signed integer type of the indices, including those in the pivot treap, so
+ * a narrower Index makes for a smaller treap. */
+template <class T, class Compare = std::less<T>,
+          class Index = std::ptrdiff_t>
+class LazySorted {
+    static_assert(std::is_signed<Index>::value, "Index must be signed");
+
+public:
+    typedef T value_type;
+    typedef Index size_type;
+
+    template <class InputIt>
+    LazySorted(InputIt first, InputIt last, Compare lt = Compare(),
+               unsigned seed = 1)
+        : xs_(first, last), lt_(lt), rng_(seed), root_(NIL), free_(NIL)
+    {
+        init();
+    }
+
+    explicit LazySorted(std::vector<T> xs, Compare lt = Compare(),
+                        unsigned seed = 1)
+        : xs_(std::move(xs)), lt_(lt), rng_(seed), root_(NIL), free_(NIL)
+    {
+        init();
+    }
+
+    Index size() const { return static_cast<Index>(xs_.size()); }
+
+    /* The kth item in sorted order, for 0 <= k < size() */
+    const T &operator[](Index k)
+    {
+        sort_point(k);
+        return xs_[k];
+    }
+
+    /* Sorts the items whose sorted indices are in [start, stop), for
+     * 0 <= start <= stop <= size() */
+    void sort_range(Index start, Index stop)
+    {
+        if (start >= stop)
+            return;
+
+        sort_point(start);
+        sort_point(stop);
+
+        Index current, next;
+        bound(start, current, next);
+        if (node(current).idx == start)
+            next = successor(current);
+
+        while (node(current).idx < stop) {
+            if (!(node(current).flags & SORTED_LEFT)) {
+                detail::quick_sort(xs_.data(), detail::NoPayload(),
+                                   after(current), node(next).idx, lt_,
+                                   rng_);
+                node(current).flags |= SORTED_LEFT;
+                node(next).flags |= SORTED_RIGHT;
+            }
+
+            if (node(current).flags & SORTED_RIGHT)
+                erase(current);
+
+            current = next;
+            next = successor(current);
+        }
+
+        if (node(current).flags & SORTED_LEFT)
+            erase(current);
+    }
+
+    /* Returns a pointer to the stop - start items whose sorted indices are in
+     * [start, stop), in no particular order. It is only valid until the next
+     * call to a non-const method. */
+    const T *between(Index start, Index stop)
+    {
+        if (start < stop) {
+            if (start != 0)
+                sort_point(start);
+            if (stop != size())
+                sort_point(stop);
+        }
+        return xs_.data() + start;
+    }
+
+    /* The number of items less than value, (ie, where std::lower_bound would
+     * put it if the list were sorted) */
+    Index rank(const T &value)
+    {
+        Index lo, hi;
+        locate(value, lo, hi);
+
+        /* The items between lo and hi are sorted */
+        while (lo < hi) {
+            Index mid = lo + (hi - lo) / 2;
+            if (lt_(xs_[mid], value))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    /* The first index of an item equivalent to value, or -1 if there isn't
+     * one */
+    Index find(const T &value)
+    {
+        Index k = rank(value);
+        return k < size() && !lt_(value, xs_[k]) ? k : -1;
+    }
+
+    bool contains(const T &value) { return find(value) >= 0; }
+
+    /* The items, in their current partially sorted order */
+    const std::vector<T> &data() const { return xs_; }
+
+    /* The number of pivots, including the two at -1 and size() */
+    Index pivot_count() const { return count(root_); }
+
+private:
+    static const Index NIL = -1;
+
+    struct Node {
+        Index idx;              /* The index it represents */
+        Index left;             /* Children, as positions in nodes_ */
+        Index right;
+        unsigned priority;      /* Priority in the treap */
+        unsigned char flags;    /* Descriptors of the data between pivots */
+    };
+
+    std::vector<T> xs_;
+    Compare lt_;
+    detail::XorShift rng_;
+    std::vector<Node> nodes_;
+    Index root_;
+    Index free_;                /* Freed nodes, linked through left */
+
+    Node &node(Index n) { return nodes_[n]; }
+    const Node &node(Index n) const { return nodes_[n]; }
+
+    /* The index just after node n's. (Index arithmetic is done in int when
+     * Index is narrower, so it has to be cast back for the kernels.) */
+    Index after(Index n) const
+    {
+        return static_cast<Index>(node(n).idx + 1);
+    }
+
+    void init()
+    {
+        insert(-1, UNSORTED);
+        insert(size(), UNSORTED);
+    }
+
+    Index count(Index t) const
+    {
+        return t == NIL ? 0 : 1 + count(node(t).left) + count(node(t).right);
+    }
+
+    bool equivalent(const T &x, const T &y) { return !lt_(x, y) && !lt_(y, x); }
+
+    /* Treap operations. Nodes never move within nodes_, so positions stay
+     * valid as the tree is rotated. */
+
+    void rotate_right(Index &t)
+    {
+        Index l = node(t).left;
+        node(t).left = node(l).right;
+        node(l).right = t;
+        t = l;
+    }
+
+    void rotate_left(Index &t)
+    {
+        Index r = node(t).right;
+        node(t).right = node(r).left;
+        node(r).left = t;
+        t = r;
+    }
+
+    void insert_at(Index &t, Index n)
+    {
+        if (t == NIL) {
+            t = n;
+        }
+        else if (node(n).idx < node(t).idx) {
+            insert_at(node(t).left, n);
+            if (node(node(t).left).priority > node(t).priority)
+                rotate_right(t);
+        }
+        else {
+            insert_at(node(t).right, n);
+            if (node(node(t).right).priority > node(t).priority)
+                rotate_left(t);
+        }
+    }
+
+    Index insert(Index idx, int flags)
+    {
+        Index n;
+        if (free_ != NIL) {
+            n = free_;
+            free_ = node(n).left;
+        }
+        else {
+            n = static_cast<Index>(nodes_.size());
+            nodes_.push_back(Node());
+        }
+        node(n).idx = idx;
+        node(n).left = NIL;
+        node(n).right = NIL;
+        node(n).priority = rng_();
+        node(n).flags = static_cast<unsigned char>(flags);
+        insert_at(root_, n);
+        return n;
+    }
+
+    void erase_at(Index &t, Index n)
+    {
+        if (t == n) {
+            if (node(t).left == NIL) {
+                t = node(t).right;
+            }
+            else if (node(t).right == NIL) {
+                t = node(t).left;
+            }
+            else if (node(node(t).left).priority >
+                     node(node(t).right).priority) {
+                rotate_right(t);
+                erase_at(node(t).right, n);
+                return;
+            }
+            else {
+                rotate_left(t);
+                erase_at(node(t).left, n);
+                return;
+            }
+            node(n).left = free_;
+            free_ = n;
+        }
+        else if (node(n).idx < node(t).idx) {
+            erase_at(node(t).left, n);
+        }
+        else {
+            erase_at(node(t).right, n);
+        }
+    }
+
+    void erase(Index n) { erase_at(root_, n); }
+
+    /* Finds the pivots left and right that bound the index k, with left the
+     * last pivot at or before k and right the first one after it */
+    void bound(Index k, Index &left, Index &right) const
+    {
+        left = right = NIL;
+        for (Index t = root_; t != NIL; ) {
+            if (node(t).idx <= k) {
+                left = t;
+                t = node(t).right;
+            }
+            else {
+                right = t;
+                t = node(t).left;
+            }
+        }
+    }
+
+    /* The next (bigger) pivot after n */
+    Index successor(Index n) const
+    {
+        Index left, right;
+        bound(node(n).idx, left, right);
+        return right;
+    }
+
+    /* If the item at middle is equivalent to the one at left and there is
+     * nothing between them, left is removed, and likewise for right. (The
+     * items between equivalent pivots needn't all be equivalent, so those
+     * pivots can only go if that region is empty.) */
+    void uniq_pivots(Index left, Index middle, Index right)
+    {
+        if (node(left).idx >= 0 && node(left).idx + 1 == node(middle).idx &&
+            equivalent(xs_[node(left).idx], xs_[node(middle).idx])) {
+            node(middle).flags |= node(left).flags & SORTED_RIGHT;
+            erase(left);
+        }
+        if (node(right).idx < size() &&
+            node(middle).idx + 1 == node(right).idx &&
+            equivalent(xs_[node(middle).idx], xs_[node(right).idx])) {
+            node(middle).flags |= node(right).flags & SORTED_LEFT;
+            erase(right);
+        }
+    }
+
+    /* Records that the items between the pivots left and right are sorted,
+     * and removes any pivots that become redundant */
+    void mark_sorted(Index left, Index right)
+    {
+        node(left).flags |= SORTED_LEFT;
+        node(right).flags |= SORTED_RIGHT;
+        if (node(left).flags & SORTED_RIGHT)
+            erase(left);
+        if (node(right).flags & SORTED_LEFT)
+            erase(right);
+    }
+
+    /* Sorts the list sufficiently such that xs_[k] is actually the kth value
+     * in sorted order */
+    void sort_point(Index k)
+    {
+        Index left, right;
+        bound(k, left, right);
+        if (node(left).idx == k || node(right).flags & SORTED_RIGHT)
+            return;
+
+        while (node(left).idx + 1 + SORT_THRESH <= node(right).idx) {
+            Index piv_idx = detail::partition(xs_.data(), detail::NoPayload(),
+                                              after(left), node(right).idx,
+                                              lt_, rng_);
+            Index middle = insert(piv_idx, UNSORTED);
+            uniq_pivots(left, middle, right);
+            if (piv_idx < k)
+                left = middle;
+            else if (piv_idx > k)
+                right = middle;
+            else
+                return;
+        }
+
+        detail::insertion_sort(xs_.data(), detail::NoPayload(), after(left),
+                               node(right).idx, lt_);
+        mark_sorted(left, right);
+    }
+
+    /* Sorts just enough of the list that every item less than value is
+     * before lo, every item greater than it is at or after hi, and the items
+     * in between are sorted */
+    void locate(const T &value, Index &lo, Index &hi)
+    {
+        Index left = NIL, right = NIL;
+        for (Index t = root_; t != NIL; ) {
+            Index idx = node(t).idx;
+            if (idx == -1 || (idx != size() && lt_(xs_[idx], value))) {
+                left = t;
+                t = node(t).right;
+            }
+            else {
+                right = t;
+                t = node(t).left;
+            }
+        }
+
+        if (!(node(left).flags & SORTED_LEFT)) {
+            while (node(left).idx + 1 + SORT_THRESH <= node(right).idx) {
+                Index piv_idx = detail::partition(
+                    xs_.data(), detail::NoPayload(), after(left),
+                    node(right).idx, lt_, rng_);
+                Index middle = insert(piv_idx, UNSORTED);
+                uniq_pivots(left, middle, right);
+                if (lt_(xs_[piv_idx], value))
+                    left = middle;
+                else
+                    right = middle;
+            }
+            detail::insertion_sort(xs_.data(), detail::NoPayload(),
+                                   after(left), node(right).idx, lt_);
+            lo = after(left);
+            hi = node(right).idx == size() ? size() : after(right);
+            mark_sorted(left, right);
+            return;
+        }
+
+        lo = after(left);
+        hi = node(right).idx == size() ? size() : after(right);
+    }
+};
+
+}  /* namespace lazysorted */
+
+#endif /* LAZYSORTED_HPP */
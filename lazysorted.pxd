@@ -0,0 +1,28 @@
+# Cython declarations for the lazysorted C API, (see lazysorted.h for the
+# documentation of each function). Usage:
+#
+#     cimport lazysorted
+#     lazysorted.LazySorted_ImportCAPI()
+#     median = lazysorted.LazySorted_CAPI.Select(ls, len(ls) // 2)
+
+from cpython.object cimport PyObject, PyTypeObject
+
+cdef extern from "lazysorted.h":
+    int LAZYSORTED_CAPI_VERSION
+
+    ctypedef struct LazySorted_CAPIObject:
+        int version
+        PyTypeObject *Type
+        object (*FromArray)(PyObject **items, Py_ssize_t n, PyObject *key,
+                            int reverse)
+        object (*FromBuffer)(object buffer, int reverse)
+        object (*Select)(object ls, Py_ssize_t k)
+        int (*SortRange)(object ls, Py_ssize_t start,
+                         Py_ssize_t stop) except -1
+        object (*Between)(object ls, Py_ssize_t start, Py_ssize_t stop)
+        Py_ssize_t (*Rank)(object ls, object key) except -1
+        PyObject **(*Range)(object ls, Py_ssize_t start, Py_ssize_t stop,
+                            int sorted) except NULL
+
+    LazySorted_CAPIObject *LazySorted_CAPI
+    int LazySorted_ImportCAPI() except -1
@@ -0,0 +1,151 @@
+/* The instantiations of the lazysorted engine that the python module uses.
+ *
+ * Native keys, (see lazysorted.c), are int64s that are compared directly and
+ * moved around in parallel with the python objects they belong to. The
+ * engine's kernels are compiled here for exactly that case, and exposed to
+ * the C module as plain functions. The objects are only moved, never looked
+ * at, so they are passed as void pointers, which keeps Python.h, (and its
+ * C++ warnings on older pythons), out of this file.
+ *
+ * The keys may also have been narrowed to unsigned offsets of 1, 2 or 4 bytes,
+ * (see native_key in lazysorted.c), and the kernels are compiled for each of
+ * those widths, so they move and compare only as many bytes as the keys need.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "lazysorted.hpp"
+
+namespace {
+
+typedef std::less<int64_t> NativeLess;
+typedef lazysorted::detail::ArrayPayload<void *> Objects;
+typedef lazysorted::detail::ArrayPayload<double> Weights;
+typedef lazysorted::detail::PairPayload<Objects, Weights> WeightedObjects;
+
+/* The module seeds rand() on import, so keep using it for the pivots */
+struct Rand {
+    unsigned operator()() const { return static_cast<unsigned>(rand()); }
+};
+
+template <class Key, class Payload>
+ptrdiff_t
+partition_keys(void *nkeys, Payload payload, ptrdiff_t left, ptrdiff_t right)
+{
+    std::less<Key> lt;
+    Rand rng;
+    return lazysorted::detail::partition(static_cast<Key *>(nkeys), payload,
+                                         left, right, lt, rng);
+}
+
+template <class Key, class Payload>
+void
+insertion_sort_keys(void *nkeys, Payload payload, ptrdiff_t left,
+                    ptrdiff_t right)
+{
+    std::less<Key> lt;
+    lazysorted::detail::insertion_sort(static_cast<Key *>(nkeys), payload,
+                                       left, right, lt);
+}
+
+template <class Key, class Payload>
+void
+quick_sort_keys(void *nkeys, Payload payload, ptrdiff_t left, ptrdiff_t right)
+{
+    std::less<Key> lt;
+    Rand rng;
+    lazysorted::detail::quick_sort(static_cast<Key *>(nkeys), payload, left,
+                                   right, lt, rng);
+}
+
+/* Returns kernel<Key> args for the type of key that width says */
+#define BY_WIDTH(width, kernel, args)           \
+    switch (width) {                            \
+    case 1: return kernel<uint8_t> args;        \
+    case 2: return kernel<uint16_t> args;       \
+    case 4: return kernel<uint32_t> args;       \
+    default: return kernel<int64_t> args;       \
+    }
+
+}  /* namespace */
+
+/* The optimized build, (python setup.py build_optimized), compiles each
+ * kernel for several instruction sets, and the loader picks the best one the
+ * CPU has. That needs gcc's ifuncs, so it's only done on x86-64 Linux. */
+#if defined(LAZYSORTED_ISA_CLONES) && defined(__GNUC__) && \
+    !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define ISA_CLONES __attribute__((target_clones("avx2", "sse4.2", "default")))
+#else
+#define ISA_CLONES
+#endif
+
+extern "C" {
+
+ISA_CLONES ptrdiff_t
+lazysorted_native_partition(void *nkeys, int width, void **ob_item,
+                            ptrdiff_t left, ptrdiff_t right)
+{
+    BY_WIDTH(width, partition_keys, (nkeys, Objects(ob_item), left, right));
+}
+
+ISA_CLONES void
+lazysorted_native_insertion_sort(void *nkeys, int width, void **ob_item,
+                                 ptrdiff_t left, ptrdiff_t right)
+{
+    BY_WIDTH(width, insertion_sort_keys,
+             (nkeys, Objects(ob_item), left, right));
+}
+
+ISA_CLONES void
+lazysorted_native_quick_sort(void *nkeys, int width, void **ob_item,
+                             ptrdiff_t left, ptrdiff_t right)
+{
+    BY_WIDTH(width, quick_sort_keys, (nkeys, Objects(ob_item), left, right));
+}
+
+/* The same kernels for objects that carry weights, (see weighted_select in
+ * lazysorted.c) */
+
+ISA_CLONES ptrdiff_t
+lazysorted_native_weighted_partition(void *nkeys, int width, void **ob_item,
+                                     double *weights, ptrdiff_t left,
+                                     ptrdiff_t right)
+{
+    BY_WIDTH(width, partition_keys,
+             (nkeys, WeightedObjects(Objects(ob_item), Weights(weights)),
+              left, right));
+}
+
+ISA_CLONES void
+lazysorted_native_weighted_insertion_sort(void *nkeys, int width,
+                                          void **ob_item, double *weights,
+                                          ptrdiff_t left, ptrdiff_t right)
+{
+    BY_WIDTH(width, insertion_sort_keys,
+             (nkeys, WeightedObjects(Objects(ob_item), Weights(weights)),
+              left, right));
+}
+
+ISA_CLONES void
+lazysorted_native_weighted_quick_sort(void *nkeys, int width, void **ob_item,
+                                      double *weights, ptrdiff_t left,
+                                      ptrdiff_t right)
+{
+    BY_WIDTH(width, quick_sort_keys,
+             (nkeys, WeightedObjects(Objects(ob_item), Weights(weights)),
+              left, right));
+}
+
+ISA_CLONES void
+lazysorted_native_select(int64_t *keys, ptrdiff_t left, ptrdiff_t right,
+                         ptrdiff_t k)
+{
+    NativeLess lt;
+    Rand rng;
+    lazysorted::detail::select(keys, lazysorted::detail::NoPayload(), left,
+                               right, k, lt, rng);
+}
+
+}  /* extern "C" */
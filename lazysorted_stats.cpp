@@ -0,0 +1,432 @@
+/* lazysorted-stats: quantiles, top k and trimmed means of the numbers in
+ * files or stdin, from the command line.
+ *
+ *     $ lazysorted-stats -q 0.5,0.99 -k 3 -t 0.05 latencies.txt
+ *     count           1000000
+ *     q0.5            12.5
+ *     q0.99           210.25
+ *     top3            9001 8870 8862.5
+ *     trimmed0.05     19.718
+ *
+ * The numbers are parsed straight into an array of doubles, (8 bytes each,
+ * rather than the 30 or so that a python float in a list takes), and selected
+ * with the quickselect kernel of the lazysorted engine in lazysorted.hpp.
+ * Regular files are mapped into memory and parsed in parallel, and when there
+ * are several statistics to find, the regions between them are selected in
+ * parallel too. Build it with `python setup.py build_tool`.
+ */
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
+
+#include "lazysorted.hpp"
+
+namespace {
+
+typedef std::less<double> Less;
+typedef lazysorted::detail::NoPayload NoPayload;
+
+/* Don't bother with threads for regions smaller than this */
+const std::ptrdiff_t PARALLEL_THRESH = 1 << 16;
+
+/* Longest number we accept, which is plenty for any double */
+const std::size_t MAX_TOKEN = 63;
+
+const char *program = "lazysorted-stats";
+
+void
+usage(int status)
+{
+    std::fprintf(status ? stderr : stdout,
+"usage: %s [-q Q[,Q...]] [-k K] [-t F] [-j THREADS] [FILE...]\n"
+"\n"
+"Prints statistics of the whitespace separated numbers in the FILEs, (or\n"
+"stdin if there are none, or for a FILE of -). NaNs are left out.\n"
+"\n"
+"  -q Q        the Q quantile, for 0 <= Q <= 1, interpolated linearly\n"
+"  -k K        the K largest numbers, from largest to smallest\n"
+"  -t F        the mean without the smallest and largest F of the numbers\n"
+"  -j THREADS  how many threads to use, (by default, one per core)\n"
+"\n"
+"The count is always printed. With no other statistics, the 0, 0.5 and 1\n"
+"quantiles are printed.\n", program);
+    std::exit(status);
+}
+
+void
+die(const std::string &message)
+{
+    std::fprintf(stderr, "%s: %s\n", program, message.c_str());
+    std::exit(1);
+}
+
+bool
+is_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' ||
+           c == '\v';
+}
+
+/* Parses the numbers in [begin, end) onto out, which must start and end on
+ * whitespace or the ends of the input. Returns the number of NaNs skipped. */
+std::size_t
+parse(const char *begin, const char *end, std::vector<double> &out)
+{
+    char token[MAX_TOKEN + 1];
+    std::size_t nans = 0;
+
+    for (const char *p = begin; p < end; ) {
+        if (is_space(*p)) {
+            p++;
+            continue;
+        }
+
+        const char *start = p;
+        while (p < end && !is_space(*p))
+            p++;
+        std::size_t len = static_cast<std::size_t>(p - start);
+        if (len > MAX_TOKEN)
+            die("number too long: " + std::string(start, MAX_TOKEN) + "...");
+        std::memcpy(token, start, len);
+        token[len] = '\0';
+
+        char *parsed;
+        double value = std::strtod(token, &parsed);
+        if (parsed != token + len)
+            die("not a number: " + std::string(token));
+        if (std::isnan(value))
+            nans++;
+        else
+            out.push_back(value);
+    }
+    return nans;
+}
+
+/* Parses a whole buffer with up to threads threads, splitting it on
+ * whitespace. Returns the number of NaNs skipped. */
+std::size_t
+parse_parallel(const char *begin, const char *end, unsigned threads,
+               std::vector<double> &out)
+{
+    std::size_t size = static_cast<std::size_t>(end - begin);
+    if (threads <= 1 || size < static_cast<std::size_t>(PARALLEL_THRESH) * 8)
+        return parse(begin, end, out);
+
+    std::vector<const char *> bounds(1, begin);
+    for (unsigned i = 1; i < threads; i++) {
+        const char *p = begin + size / threads * i;
+        if (p < bounds.back())
+            p = bounds.back();
+        while (p < end && !is_space(*p))
+            p++;
+        bounds.push_back(p);
+    }
+    bounds.push_back(end);
+
+    std::vector<std::vector<double> > parts(threads);
+    std::vector<std::size_t> nans(threads, 0);
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) {
+        workers.push_back(std::thread([&, i]() {
+            nans[i] = parse(bounds[i], bounds[i + 1], parts[i]);
+        }));
+    }
+    nans[0] = parse(bounds[0], bounds[1], parts[0]);
+    for (std::size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    std::size_t total = 0;
+    for (unsigned i = 0; i < threads; i++) {
+        out.insert(out.end(), parts[i].begin(), parts[i].end());
+        total += nans[i];
+    }
+    return total;
+}
+
+/* Parses a stream in chunks, carrying over any number that is cut off at the
+ * end of a chunk. Returns the number of NaNs skipped. */
+std::size_t
+parse_stream(std::FILE *f, const char *name, std::vector<double> &out)
+{
+    std::vector<char> buf(1 << 20);
+    std::size_t kept = 0, nans = 0;
+
+    while (true) {
+        std::size_t got = std::fread(&buf[kept], 1, buf.size() - kept, f);
+        if (got == 0) {
+            if (std::ferror(f))
+                die(std::string(name) + ": " + std::strerror(errno));
+            return nans + parse(&buf[0], &buf[0] + kept, out);
+        }
+
+        const char *end = &buf[0] + kept + got;
+        const char *cut = end;
+        while (cut > &buf[0] && !is_space(cut[-1]))
+            cut--;
+        if (cut == &buf[0] && kept + got > MAX_TOKEN)
+            die("number too long in " + std::string(name));
+
+        nans += parse(&buf[0], cut, out);
+        kept = static_cast<std::size_t>(end - cut);
+        std::memmove(&buf[0], cut, kept);
+    }
+}
+
+/* Reads the numbers of the file name, (or stdin for -). Returns the number of
+ * NaNs skipped. */
+std::size_t
+read_file(const char *name, unsigned threads, std::vector<double> &out)
+{
+    if (std::strcmp(name, "-") == 0)
+        return parse_stream(stdin, "stdin", out);
+
+#ifdef HAVE_MMAP
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        die(std::string(name) + ": " + std::strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(NULL, static_cast<std::size_t>(st.st_size),
+                          PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            const char *begin = static_cast<const char *>(data);
+            std::size_t nans = parse_parallel(begin, begin + st.st_size,
+                                              threads, out);
+            munmap(data, static_cast<std::size_t>(st.st_size));
+            close(fd);
+            return nans;
+        }
+    }
+    close(fd);
+#endif
+
+    std::FILE *f = std::fopen(name, "rb");
+    if (f == NULL)
+        die(std::string(name) + ": " + std::strerror(errno));
+    std::size_t nans = parse_stream(f, name, out);
+    std::fclose(f);
+    return nans;
+}
+
+/* Selects the n ranks, (sorted and distinct), of the keys left <= i < right,
+ * leaving each at its sorted index. The middle rank splits the rest into two
+ * independent problems, which get threads threads between them. */
+void
+multiselect(double *keys, std::ptrdiff_t left, std::ptrdiff_t right,
+            const std::ptrdiff_t *ranks, std::size_t n, unsigned threads)
+{
+    Less lt;
+    lazysorted::detail::XorShift rng(static_cast<unsigned>(left) * 2654435761u
+                                     + static_cast<unsigned>(right));
+
+    while (n > 0) {
+        std::size_t mid = n / 2;
+        std::ptrdiff_t rank = ranks[mid];
+        lazysorted::detail::select(keys, NoPayload(), left, right, rank, lt,
+                                   rng);
+
+        if (threads > 1 && right - left > PARALLEL_THRESH && mid > 0) {
+            try {
+                std::thread worker(multiselect, keys, left, rank, ranks, mid,
+                                   threads / 2);
+                multiselect(keys, rank + 1, right, ranks + mid + 1,
+                            n - mid - 1, threads - threads / 2);
+                worker.join();
+                return;
+            }
+            catch (const std::system_error &) {
+                /* No more threads, so carry on in this one */
+            }
+        }
+
+        multiselect(keys, left, rank, ranks, mid, 1);
+        left = rank + 1;
+        ranks += mid + 1;
+        n -= mid + 1;
+    }
+}
+
+/* Prints a double in as few digits as it takes to read it back exactly */
+void
+print_value(double value)
+{
+    char buf[32];
+    for (int precision = 15; precision <= 17; precision++) {
+        std::snprintf(buf, sizeof(buf), "%.*g", precision, value);
+        if (std::strtod(buf, NULL) == value)
+            break;
+    }
+    std::fputs(buf, stdout);
+}
+
+double
+parse_fraction(const char *arg, const char *what, double max)
+{
+    char *end;
+    double value = std::strtod(arg, &end);
+    if (end == arg || *end != '\0' || !(0.0 <= value && value <= max)) {
+        char message[64];
+        std::snprintf(message, sizeof(message),
+                      "%s must be between 0 and %g", what, max);
+        die(message);
+    }
+    return value;
+}
+
+}  /* namespace */
+
+int
+main(int argc, char **argv)
+{
+    std::vector<double> quantiles;
+    std::vector<double> trims;
+    long top = 0;
+    unsigned threads = std::thread::hardware_concurrency();
+    std::vector<const char *> files;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help")
+            usage(0);
+        if (arg.size() != 2 || arg[0] != '-') {
+            files.push_back(argv[i]);
+            continue;
+        }
+        if (i + 1 == argc)
+            usage(2);
+
+        const char *value = argv[++i];
+        switch (arg[1]) {
+        case 'q': {
+            std::string list = value;
+            std::size_t start = 0;
+            while (start <= list.size()) {
+                std::size_t comma = list.find(',', start);
+                if (comma == std::string::npos)
+                    comma = list.size();
+                quantiles.push_back(parse_fraction(
+                    list.substr(start, comma - start).c_str(), "quantiles",
+                    1.0));
+                start = comma + 1;
+            }
+            break;
+        }
+        case 'k':
+            top = std::strtol(value, NULL, 10);
+            if (top <= 0)
+                die("-k must be positive");
+            break;
+        case 't':
+            trims.push_back(parse_fraction(value, "-t", 0.5));
+            break;
+        case 'j':
+            threads = static_cast<unsigned>(std::strtoul(value, NULL, 10));
+            break;
+        default:
+            usage(2);
+        }
+    }
+    if (threads == 0)
+        threads = 1;
+    if (quantiles.empty() && trims.empty() && top == 0) {
+        quantiles.push_back(0.0);
+        quantiles.push_back(0.5);
+        quantiles.push_back(1.0);
+    }
+    if (files.empty())
+        files.push_back("-");
+
+    std::vector<double> xs;
+    std::size_t nans = 0;
+    for (std::size_t i = 0; i < files.size(); i++)
+        nans += read_file(files[i], threads, xs);
+    std::ptrdiff_t n = static_cast<std::ptrdiff_t>(xs.size());
+
+    std::printf("count\t\t%ld\n", static_cast<long>(n));
+    if (nans > 0)
+        std::printf("nans\t\t%lu\n", static_cast<unsigned long>(nans));
+    if (n == 0)
+        return 0;
+
+    /* Work out every index that is needed, and select them all at once */
+    std::vector<std::ptrdiff_t> ranks;
+    for (std::size_t i = 0; i < quantiles.size(); i++) {
+        std::ptrdiff_t lo = static_cast<std::ptrdiff_t>(quantiles[i] * (n - 1));
+        ranks.push_back(lo);
+        if (lo + 1 < n)
+            ranks.push_back(lo + 1);
+    }
+    if (top > n)
+        top = static_cast<long>(n);
+    if (top > 0)
+        ranks.push_back(n - top);
+    for (std::size_t i = 0; i < trims.size(); i++) {
+        std::ptrdiff_t cut = static_cast<std::ptrdiff_t>(trims[i] * n);
+        if (cut < n - cut) {
+            ranks.push_back(cut);
+            ranks.push_back(n - cut - 1);
+        }
+    }
+    std::sort(ranks.begin(), ranks.end());
+    ranks.erase(std::unique(ranks.begin(), ranks.end()), ranks.end());
+    if (!ranks.empty())
+        multiselect(&xs[0], 0, n, &ranks[0], ranks.size(), threads);
+
+    for (std::size_t i = 0; i < quantiles.size(); i++) {
+        double h = quantiles[i] * (n - 1);
+        std::ptrdiff_t lo = static_cast<std::ptrdiff_t>(h);
+        double value = xs[lo];
+        if (lo + 1 < n && h > lo)
+            value += (xs[lo + 1] - value) * (h - lo);
+        std::printf("q%g\t\t", quantiles[i]);
+        print_value(value);
+        std::putchar('\n');
+    }
+
+    if (top > 0) {
+        /* The top k are already the last k, so just put them in order */
+        Less lt;
+        lazysorted::detail::XorShift rng(1);
+        lazysorted::detail::quick_sort(&xs[0], NoPayload(), n - top, n, lt,
+                                       rng);
+        std::printf("top%ld\t\t", top);
+        for (std::ptrdiff_t i = n - 1; i >= n - top; i--) {
+            print_value(xs[i]);
+            std::putchar(i > n - top ? ' ' : '\n');
+        }
+    }
+
+    for (std::size_t i = 0; i < trims.size(); i++) {
+        std::ptrdiff_t cut = static_cast<std::ptrdiff_t>(trims[i] * n);
+        std::printf("trimmed%g\t", trims[i]);
+        if (cut >= n - cut) {
+            std::puts("nan");
+            continue;
+        }
+        /* Everything between the cuts is already between them */
+        long double sum = 0;
+        for (std::ptrdiff_t j = cut; j < n - cut; j++)
+            sum += xs[j];
+        print_value(static_cast<double>(sum / (n - 2 * cut)));
+        std::putchar('\n');
+    }
+
+    return 0;
+}
@@ -1,6 +1,93 @@
-from distutils.core import setup, Extension
+import os
+import subprocess
+import sys
+from distutils.core import setup, Extension, Command
+from distutils.ccompiler import new_compiler
+from distutils.errors import DistutilsPlatformError
+from distutils.sysconfig import customize_compiler
 
-module1 = Extension('lazysorted', sources=['lazysorted.c'])
+
+class build_tool(Command):
+    """Builds the lazysorted-stats command line tool, which isn't a python
+    module, so it isn't built or installed by default"""
+
+    description = "build the lazysorted-stats command line tool"
+    user_options = [('build-dir=', 'b', "directory to build the tool in")]
+
+    def initialize_options(self):
+        self.build_dir = None
+
+    def finalize_options(self):
+        if self.build_dir is None:
+            self.build_dir = 'build'
+
+    def run(self):
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        flags = []
+        if compiler.compiler_type == 'unix':
+            flags = ['-std=c++11', '-pthread']
+        objects = compiler.compile(['lazysorted_stats.cpp'],
+                                   output_dir=self.build_dir,
+                                   extra_preargs=flags)
+        compiler.link_executable(objects, 'lazysorted-stats',
+                                 output_dir=self.build_dir,
+                                 extra_preargs=flags, target_lang='c++')
+
+class build_optimized(Command):
+    """Builds lazysorted with -O3 and link time optimization, and then again
+    using a profile of benchmark.py, so the hot loops are laid out for the
+    way they are actually used. The native kernels are also compiled for
+    several instruction sets, and the best one is picked at import time.
+    Needs gcc; install afterwards with `python setup.py install`."""
+
+    description = "build lazysorted with LTO and profile guided optimization"
+    user_options = [('no-pgo', None, "skip profile guided optimization")]
+    boolean_options = ['no-pgo']
+
+    def initialize_options(self):
+        self.no_pgo = 0
+
+    def finalize_options(self):
+        pass
+
+    def build(self, flags):
+        module1.extra_compile_args = ['-O3', '-flto'] + flags
+        module1.extra_link_args = ['-O3', '-flto'] + flags
+        build_ext = self.reinitialize_command('build_ext')
+        build_ext.force = 1
+        self.run_command('build_ext')
+        return build_ext
+
+    def run(self):
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        if compiler.compiler_type != 'unix':
+            raise DistutilsPlatformError("build_optimized needs gcc")
+
+        if self.no_pgo:
+            self.build(['-DLAZYSORTED_ISA_CLONES'])
+            return
+
+        # The instrumented build can't have ISA clones, since their resolvers
+        # run before the profiling code is set up
+        build_ext = self.get_finalized_command('build_ext')
+        profile_dir = os.path.abspath(os.path.join(build_ext.build_temp,
+                                                   'profile'))
+        self.build(['-fprofile-generate=' + profile_dir])
+
+        env = dict(os.environ)
+        env['PYTHONPATH'] = os.path.abspath(build_ext.build_lib)
+        subprocess.check_call([sys.executable, 'benchmark.py', '--quick'],
+                              env=env)
+
+        self.build(['-DLAZYSORTED_ISA_CLONES', '-fprofile-use=' + profile_dir,
+                    '-fprofile-correction', '-Wno-missing-profile'])
+
+
+module1 = Extension('lazysorted',
+                    sources=['lazysorted.c', 'lazysorted_engine.cpp'],
+                    depends=['lazysorted.h', 'lazysorted.hpp'])
 
 f = open("README.txt")
 readme = f.read()
@@ -30,4 +117,7 @@ setup(name='lazysorted',
           "Topic :: Software Development :: Libraries :: Python Modules",
       ],
       ext_modules=[module1],
+      headers=['lazysorted.h', 'lazysorted.hpp'],
+      cmdclass={'build_tool': build_tool,
+                'build_optimized': build_optimized},
       long_description=readme)
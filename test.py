@@ -2,11 +2,44 @@
 
 import unittest
 import random
+from array import array
 from itertools import islice
 import doctest
+import ctypes
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+from datetime import datetime, date, timedelta, tzinfo
 import lazysorted
 from lazysorted import LazySorted
 
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def build_program(source, directory):
+    """Compiles the C++ program in source into directory and returns its
+    path, or None if there's no unix C++ compiler to do it with"""
+    try:
+        from distutils.ccompiler import new_compiler
+        from distutils.sysconfig import customize_compiler
+    except ImportError:
+        return None
+    compiler = new_compiler()
+    if compiler.compiler_type != 'unix':
+        return None
+    customize_compiler(compiler)
+    flags = ['-std=c++11', '-pthread']
+    objects = compiler.compile([os.path.join(HERE, source)],
+                               output_dir=directory, include_dirs=[HERE],
+                               extra_preargs=flags)
+    name = os.path.splitext(source)[0]
+    compiler.link_executable(objects, name, output_dir=directory,
+                             extra_preargs=flags, target_lang='c++')
+    return os.path.join(directory, name)
+
 
 class TestLazySorted(unittest.TestCase):
     test_lengths = range(18) + [31, 32, 33, 63, 64, 65, 127, 128, 129]
@@ -228,6 +261,41 @@ class TestLazySorted(unittest.TestCase):
             ls = LazySorted([0] * n)
             self.assertEqual(ls.count(0), n)
 
+    def test_pivots_duplicates(self):
+        """The pivot tree should stay consistent with many duplicate items"""
+        for rep in xrange(200):
+            xs = [random.randint(0, 4) for _ in xrange(random.randint(1, 300))]
+            ys = sorted(xs)
+            ls = LazySorted(xs)
+            for _ in xrange(20):
+                k = random.randrange(len(xs))
+                self.assertEqual(ls[k], ys[k])
+                self.assertEqual(ls.count(ys[k]), ys.count(ys[k]))
+                pivots = [idx for idx, flags in ls._pivots()]
+                self.assertEqual(pivots, sorted(set(pivots)))
+                self.assertEqual(pivots[0], -1)
+                self.assertEqual(pivots[-1], len(xs))
+            self.assertEqual(list(ls), ys)
+
+    def test_native_search(self):
+        """Searching should agree with the pivots' cached native keys"""
+        for rep in xrange(100):
+            n = random.randint(1, 500)
+            xs = [random.randint(-20, 20) for _ in xrange(n)]
+            if rep % 2:
+                xs = [x / 4.0 for x in xs]
+            for reverse in [True, False]:
+                ys = sorted(xs, reverse=reverse)
+                ls = LazySorted(xs, reverse=reverse, max_pivots=8)
+                for _ in xrange(30):
+                    k = random.randrange(n)
+                    self.assertEqual(ls[k], ys[k])
+                    y = random.choice(xs) + random.choice([0, 0.125])
+                    self.assertEqual(ls.count(y), ys.count(y))
+                    self.assertEqual(y in ls, y in ys)
+                    if y in ys:
+                        self.assertEqual(ls.index(y), ys.index(y))
+
     def test_sorting(self):
         """Iteration should be equivalent to sorting"""
         for length in TestLazySorted.test_lengths:
@@ -235,6 +303,28 @@ class TestLazySorted(unittest.TestCase):
             random.shuffle(items)
             self.assertEqual(list(LazySorted(items)), range(length))
 
+    def test_iter_unique(self):
+        """iter_unique should yield one item per distinct key, in order"""
+        for rep in xrange(100):
+            n = random.randint(0, 400)
+            xs = [random.randint(0, random.choice([3, 30, 3000]))
+                  for _ in xrange(n)]
+            for reverse in [True, False]:
+                ys = sorted(set(xs), reverse=reverse)
+                ls = LazySorted(xs, reverse=reverse)
+                self.assertEqual(list(ls.iter_unique()), ys)
+                ls = LazySorted([str(x) for x in xs], reverse=reverse)
+                self.assertEqual(list(islice(ls.iter_unique(), 5)),
+                                 sorted(set(str(x) for x in xs),
+                                        reverse=reverse)[:5])
+                self.assertEqual(sorted(ls), sorted(str(x) for x in xs))
+
+        ls = LazySorted(range(100), key=lambda x: x // 10)
+        self.assertEqual([x // 10 for x in ls.iter_unique()], range(10))
+        ls = LazySorted([1.5, float('nan'), 0.5, 1.5, float('nan')],
+                        nan='last')
+        self.assertEqual(len(list(ls.iter_unique())), 3)
+
     def test_interupted_iter(self):
         """Iteration should work even if it's interrupted by other calls"""
         for rep in xrange(100):
@@ -247,6 +337,35 @@ class TestLazySorted(unittest.TestCase):
             _ = random.randrange(-100, 600) in ls
             self.assertEqual(list(islice(it, 30)), range(30, 60))
 
+    def test_sequential_index(self):
+        """Indexing in sequential runs should read ahead correctly"""
+        for rep in xrange(20):
+            n = random.randint(1, 3000)
+            xs = [random.randint(0, n // 3) for _ in xrange(n)]
+            ys = sorted(xs)
+            ls = LazySorted(xs, max_pivots=random.choice([None, 4]))
+            for _ in xrange(10):
+                a, b = sorted(random.randrange(n) for _ in xrange(2))
+                run = range(a, b + 1)
+                if random.random() < 0.5:
+                    run.reverse()
+                for k in run:
+                    self.assertEqual(ls[k], ys[k])
+                self.assertEqual(ls[random.randrange(-n, n)] in xs, True)
+            self.assertEqual(list(ls), ys)
+
+        # The third lookup of a run already reads ahead, so the next ones
+        # don't touch the pivots
+        xs = range(1000)
+        random.shuffle(xs)
+        ls = LazySorted(xs)
+        for k in [500, 501, 502]:
+            self.assertEqual(ls[k], k)
+        pivots = ls._pivots()
+        for k in xrange(503, 540):
+            self.assertEqual(ls[k], k)
+        self.assertEqual(ls._pivots(), pivots)
+
     def test_reverse(self):
         """Reverse iteration should be equivalent to reverse sorting"""
         for length in TestLazySorted.test_lengths:
@@ -266,6 +385,942 @@ class TestLazySorted(unittest.TestCase):
                 self.assertEqual(list(LazySorted(items, key=lambda x: x[1])),
                                  sorted(items, key=lambda x: x[1]))
 
+    def test_batch_key(self):
+        """batch_key should be called once and sort like the equivalent key"""
+        calls = []
+
+        def first(xs):
+            calls.append(len(xs))
+            return [x[0] for x in xs]
+
+        for rep in xrange(100):
+            items = [(random.random(), random.random()) for _ in xrange(256)]
+            for reverse in [True, False]:
+                del calls[:]
+                ls = LazySorted(items, batch_key=first, reverse=reverse)
+                self.assertEqual(calls, [256])
+                self.assertEqual(list(ls), sorted(items, key=lambda x: x[0],
+                                                  reverse=reverse))
+                self.assertEqual(ls.index(items[7]),
+                                 list(ls).index(items[7]))
+                self.assertTrue(items[3] in ls)
+                self.assertFalse((2.0, 0.5) in ls)
+
+        # Iterators are handed to batch_key as a tuple, so it can't change
+        # the items that its keys go with
+        ls = LazySorted(iter([3, 1, 2]), batch_key=lambda xs: [-x for x in xs])
+        self.assertEqual(list(ls), [3, 2, 1])
+
+        def negated(xs):
+            self.assertTrue(isinstance(xs, tuple))
+            return [-x for x in xs]
+        ls = LazySorted(iter([3, 1, 2]), batch_key=negated)
+        self.assertEqual(list(ls), [3, 2, 1])
+
+        xs = range(10)
+        self.assertRaises(TypeError, lambda: LazySorted(xs, batch_key=5))
+        self.assertRaises(TypeError, lambda: LazySorted(xs, key=lambda x: x,
+                                                        batch_key=first))
+        self.assertRaises(ValueError, lambda: LazySorted(xs,
+                          batch_key=lambda xs: xs[1:]))
+
+    def test_datetimes(self):
+        """Datetimes, dates and timedeltas should sort as usual"""
+        class UTCOffset(tzinfo):
+            def __init__(self, hours):
+                self.hours = hours
+
+            def utcoffset(self, dt):
+                return timedelta(hours=self.hours)
+
+        base = datetime(2013, 7, 4, 12, 30)
+        for rep in xrange(10):
+            deltas = [timedelta(days=random.randint(-5 * 10 ** 5, 5 * 10 ** 5),
+                                seconds=random.randint(0, 86399),
+                                microseconds=random.randint(0, 999999))
+                      for _ in xrange(200)]
+            dates = [date.fromordinal(random.randint(1, 3652059))
+                     for _ in xrange(200)]
+            naive = [base + delta for delta in deltas]
+            aware = [dt.replace(tzinfo=UTCOffset(random.randint(-5, 5)))
+                     for dt in naive]
+            huge = deltas + [timedelta.max, timedelta.min]
+            tests = [deltas, dates, naive, aware, huge]
+            try:
+                from datetime import timezone
+                tests.append([dt.replace(tzinfo=timezone.utc) for dt in naive])
+            except ImportError:
+                pass
+            for xs in tests:
+                random.shuffle(xs)
+                for reverse in [True, False]:
+                    ys = sorted(xs, reverse=reverse)
+                    ls = LazySorted(xs, reverse=reverse)
+                    self.assertEqual(ls[len(xs) // 3], ys[len(xs) // 3])
+                    self.assertEqual(list(ls), ys)
+                    self.assertEqual(ls.index(xs[5]), ys.index(xs[5]))
+                    self.assertTrue(xs[7] in ls)
+
+        xs = [base + timedelta(minutes=i) for i in xrange(100)]
+        random.shuffle(xs)
+        ls = LazySorted(xs, key=lambda dt: dt - base)
+        self.assertEqual(ls[10], base + timedelta(minutes=10))
+        ls = LazySorted(xs, batch_key=lambda dts: [base - dt for dt in dts])
+        self.assertEqual(ls.count(base), 1)
+        self.assertEqual(ls.index(base + timedelta(minutes=90)), 9)
+        self.assertFalse(base + timedelta(days=1) in ls)
+
+        # Keys that aren't exactly datetimes are compared the slow way
+        class MyDatetime(datetime):
+            pass
+
+        class MyDate(date):
+            pass
+
+        class MyTimedelta(timedelta):
+            pass
+
+        for xs, probe in [([base + timedelta(hours=i) for i in xrange(100)],
+                           MyDatetime(2013, 7, 6, 14, 30)),
+                          ([date(2013, 7, 4) + timedelta(i)
+                            for i in xrange(100)], MyDate(2013, 8, 23)),
+                          ([timedelta(hours=i) for i in xrange(100)],
+                           MyTimedelta(hours=50))]:
+            random.shuffle(xs)
+            ls = LazySorted(xs, batch_key=list)
+            self.assertEqual(ls.index(probe), 50)
+
+    def test_native_ints(self):
+        """Integer keys should compare exactly, whatever their size"""
+        for xs in [range(-50, 50), [2 ** 63 - 1, -2 ** 63] + range(100),
+                   [2 ** 64, -2 ** 70, 5] + range(100)]:
+            for reverse in [True, False]:
+                random.shuffle(xs)
+                ls = LazySorted(xs, reverse=reverse)
+                self.assertEqual(list(ls), sorted(xs, reverse=reverse))
+                self.assertTrue(3.0 in ls)
+                self.assertFalse(3.5 in ls)
+                self.assertEqual(ls.count(True), 1)
+                self.assertRaises(ValueError, lambda: ls.index(2 ** 80))
+
+        ls = LazySorted(range(100), batch_key=lambda xs: [-x for x in xs])
+        self.assertEqual(ls[0], 99)
+        self.assertEqual(ls.index(10.0), 89)
+
+    def test_given_keys(self):
+        """Keys passed in explicitly should order the items"""
+        for rep in xrange(20):
+            n = random.randrange(1, 300)
+            items = ["item %d" % i for i in xrange(n)]
+            scores = [random.random() for _ in xrange(n)]
+            ranks = range(n)
+            random.shuffle(ranks)
+            for keys in [scores, array('d', scores), array('f', scores),
+                         ranks, array('i', ranks), array('B', [r % 256 for r in
+                                                               ranks]),
+                         [float(r) for r in ranks],
+                         [r + 0.5 if r % 2 else r for r in ranks]]:
+                for reverse in [True, False]:
+                    ls = LazySorted(items, keys=keys, reverse=reverse)
+                    expected = [item for key, item in
+                                sorted(zip(keys, items), reverse=reverse)]
+                    k = random.randrange(n)
+                    self.assertEqual(keys[items.index(ls[k])],
+                                     keys[items.index(expected[k])])
+                    self.assertEqual([keys[items.index(item)] for item in ls],
+                                     [keys[items.index(item)]
+                                      for item in expected])
+                    if len(set(keys)) == n:
+                        self.assertEqual(ls.index(items[n // 2]),
+                                         expected.index(items[n // 2]))
+                    self.assertTrue(items[-1] in ls)
+                    self.assertFalse("missing" in ls)
+                    self.assertEqual(ls.count(items[0]), 1)
+
+        # Unsigned keys too big for 64 bit signed ints still sort
+        big = array('L', [2 ** 63 + 5, 2 ** 63 - 5, 7])
+        self.assertEqual(list(LazySorted("abc", keys=big)), ["c", "b", "a"])
+        self.assertEqual(list(LazySorted("abc", keys=[-0.0, float('inf'), 0.0],
+                                         reverse=True)), ["b", "a", "c"])
+
+        xs = range(10)
+        self.assertRaises(ValueError, lambda: LazySorted(xs, keys=xs[1:]))
+        self.assertRaises(ValueError, lambda: LazySorted(xs,
+                                                         keys=array('d', xs[1:])))
+        self.assertRaises(TypeError, lambda: LazySorted(xs, keys=5))
+        self.assertRaises(TypeError, lambda: LazySorted(xs, keys=xs,
+                                                        key=lambda x: x))
+        self.assertRaises(TypeError, lambda: LazySorted(xs, keys=xs,
+                                                        batch_key=list))
+
+    def test_key_cache(self):
+        """A bounded key cache should give the same answers with fewer keys"""
+        class Key(object):
+            live = 0
+            calls = 0
+
+            def __init__(self, x):
+                Key.live += 1
+                Key.calls += 1
+                self.x = x
+
+            def __del__(self):
+                Key.live -= 1
+
+            def __lt__(self, other):
+                return self.x < other.x
+
+            def __eq__(self, other):
+                return self.x == other.x
+
+        for rep in xrange(20):
+            n = random.randrange(1, 500)
+            xs = range(n)
+            random.shuffle(xs)
+            for budget in [0, 1, 100, 10 ** 9]:
+                for reverse in [True, False]:
+                    ls = LazySorted(xs, key=Key, reverse=reverse,
+                                    key_cache=budget * 64)
+                    expected = sorted(xs, reverse=reverse)
+                    k = random.randrange(n)
+                    self.assertEqual(ls[k], expected[k])
+                    self.assertEqual(ls.index(xs[0]), expected.index(xs[0]))
+                    self.assertTrue(xs[-1] in ls)
+                    self.assertEqual(list(ls), expected)
+                    # Only the keys of the few leftover pivots are kept
+                    self.assertTrue(Key.live < 10)
+                    del ls
+
+        Key.calls = 0
+        ls = LazySorted(range(1000), key=Key, key_cache=0)
+        ls[500]
+        self.assertTrue(Key.live <= 1)
+        self.assertTrue(Key.calls > 1000)
+
+        # A key that doesn't fit the budget is still kept once it's been
+        # computed, rather than thrown away and computed again. (With equal
+        # keys every partition goes the same way, so the counts are exact.)
+        counts = []
+        for budget in [0, 1]:
+            Key.calls = 0
+            ls = LazySorted([0] * 40, key=Key, key_cache=budget)
+            ls[39]
+            counts.append(Key.calls)
+        self.assertTrue(counts[1] < counts[0])
+
+        # Without a cache, partitioning n items takes n - 1 keys plus the
+        # three to choose the pivot, whose key is reused. With 17 equal keys
+        # the pivot always ends up first, so there are three partitions, of
+        # 17, 16 and 15 items, before the rest is small enough to sort.
+        Key.calls = 0
+        LazySorted([0] * 17, key=Key, key_cache=0)[16]
+        self.assertEqual(Key.calls, (16 + 3) + (15 + 3) + (14 + 3))
+
+        xs = range(10)
+        self.assertRaises(TypeError, lambda: LazySorted(xs, key_cache=100))
+        self.assertRaises(ValueError, lambda: LazySorted(xs, key=abs,
+                                                         key_cache=-1))
+
+    def test_nan(self):
+        """NaNs should go last, or be dropped, with nan='last' or nan='drop'"""
+        nan = float('nan')
+        for rep in xrange(50):
+            n = random.randrange(1, 200)
+            xs = [random.random() if random.random() < 0.7 else nan
+                  for _ in xrange(n)]
+            if random.random() < 0.5:
+                xs = [random.randrange(100) if x == x else x for x in xs]
+            numbers = sorted(x for x in xs if x == x)
+            nans = n - len(numbers)
+            for reverse in [True, False]:
+                expected = sorted(numbers, reverse=reverse)
+                for keys in [None, xs, array('d', xs)]:
+                    items = range(n) if keys is not None else xs
+                    ls = LazySorted(items, keys=keys, reverse=reverse,
+                                    nan='last')
+                    self.assertEqual(ls.nan_count, nans)
+                    self.assertEqual(len(ls), n)
+                    k = random.randrange(n)
+                    got = ls[k] if keys is None else xs[ls[k]]
+                    if k < len(numbers):
+                        self.assertEqual(got, expected[k])
+                    else:
+                        self.assertTrue(got != got)
+                    got = list(ls) if keys is None else [xs[i] for i in ls]
+                    self.assertEqual(got[:len(numbers)], expected)
+                    self.assertTrue(all(x != x for x in got[len(numbers):]))
+
+                    ls = LazySorted(items, keys=keys, reverse=reverse,
+                                    nan='drop')
+                    self.assertEqual(ls.nan_count, nans)
+                    self.assertEqual(len(ls), len(numbers))
+                    got = list(ls) if keys is None else [xs[i] for i in ls]
+                    self.assertEqual(got, expected)
+                    self.assertFalse(nan in ls)
+                    if numbers and keys is None:
+                        self.assertTrue(numbers[0] in ls)
+
+        ls = LazySorted([3.0, nan, 1.0, 2.0], nan='last')
+        self.assertEqual(ls[:3], [1.0, 2.0, 3.0])
+        self.assertTrue(nan in ls)
+        self.assertEqual(ls.index(nan), 3)
+        self.assertEqual(LazySorted([nan, nan, 1.0], nan='drop')[:], [1.0])
+        self.assertEqual(LazySorted([3, 2]).nan_count, 0)
+
+        self.assertRaises(ValueError, lambda: LazySorted([1.0], nan='first'))
+        self.assertRaises(TypeError, lambda: LazySorted(["a"], nan='last'))
+        self.assertRaises(TypeError, lambda: LazySorted([1.0], key=float,
+                                                        key_cache=0,
+                                                        nan='last'))
+
+    def test_weighted_quantile(self):
+        """Weighted quantiles should match expanding the weights out"""
+        for rep in xrange(100):
+            n = random.randint(1, 300)
+            xs = [random.randint(-50, 50) for _ in xrange(n)]
+            ws = [random.randint(0, 5) for _ in xrange(n)]
+            ws[random.randrange(n)] += 1
+            if rep % 2:
+                xs = [x / 8.0 for x in xs]
+            for reverse in [True, False]:
+                expanded = sorted([x for x, w in zip(xs, ws)
+                                   for _ in xrange(w)], reverse=reverse)
+                total = len(expanded)
+                ls = LazySorted(xs, weights=ws, reverse=reverse, max_pivots=8)
+                for _ in xrange(10):
+                    q = random.choice([0.0, 1.0, random.random()])
+                    expected = expanded[max(0, -int(-q * total // 1) - 1)]
+                    self.assertEqual(ls.weighted_quantile(q), expected)
+                    k = random.randrange(n)
+                    self.assertEqual(ls[k], sorted(xs, reverse=reverse)[k])
+                self.assertEqual(ls.weighted_median(),
+                                 expanded[-int(-0.5 * total // 1) - 1])
+                self.assertEqual(list(ls), sorted(xs, reverse=reverse))
+
+        ls = LazySorted([3.0, float('nan'), 1.0, 2.0], weights=[1, 5, 1, 2],
+                        nan='drop')
+        self.assertEqual(ls.weighted_median(), 2.0)
+        self.assertRaises(TypeError, LazySorted, ["a"], weights=[1])
+        self.assertRaises(ValueError, LazySorted, [1, 2], weights=[1])
+        self.assertRaises(ValueError, LazySorted, [1], weights=[-1])
+        self.assertRaises(TypeError, LazySorted([1]).weighted_median)
+        self.assertRaises(ValueError, LazySorted([1], weights=[0])
+                          .weighted_median)
+        self.assertRaises(ValueError, LazySorted([1], weights=[1])
+                          .weighted_quantile, 1.5)
+
+    def test_out_array(self):
+        """out='array' should return the same items as an array.array"""
+        for rep in xrange(50):
+            n = random.randint(0, 300)
+            xs = [random.randint(-50, 50) for _ in xrange(n)]
+            if rep % 2:
+                xs = [x / 8.0 for x in xs]
+            for reverse in [True, False]:
+                ls = LazySorted(xs, reverse=reverse, out='array')
+                ys = sorted(xs, reverse=reverse)
+                for _ in xrange(10):
+                    a, b = random.randint(-n, n), random.randint(-n, n)
+                    step = random.choice([1, -1, 3, -40, 100])
+                    result = ls[a:b:step]
+                    self.assertTrue(isinstance(result, array))
+                    self.assertEqual(list(result), ys[a:b:step])
+                    between = ls.between(a, b)
+                    self.assertTrue(isinstance(between, array))
+                    self.assertEqual(sorted(between), sorted(ys[a:b]))
+                self.assertEqual(list(ls), ys)
+
+        nan = float('nan')
+        ls = LazySorted([2.5, nan, 0.5, 1], nan='last', reverse=True,
+                        out='array')
+        self.assertEqual(ls[:3].typecode, 'd')
+        self.assertEqual(list(ls[:3]), [2.5, 1.0, 0.5])
+        self.assertTrue(ls[3:][0] != ls[3:][0])
+        self.assertEqual(list(LazySorted([1, 2], out='list')[:]), [1, 2])
+        self.assertRaises(TypeError, LazySorted, ["a"], out='array')
+        self.assertRaises(TypeError, LazySorted, [1], key=abs, out='array')
+        self.assertRaises(TypeError, LazySorted, [date.today()], out='array')
+        self.assertRaises(ValueError, LazySorted, [1], out='numpy')
+
+    def test_from_records(self):
+        """from_records should select whole records by one of their fields"""
+        randint = random.randint
+        formats = [
+            ('<idh', lambda: (randint(-9, 9), random.random(),
+                              randint(-9, 9))),
+            ('>qf?', lambda: (randint(-2**40, 2**40), random.random(),
+                              random.random() < 0.5)),
+            ('=3sIb', lambda: (b"abc", randint(0, 2**32 - 1), randint(-9, 9))),
+            ('cxid', lambda: (b"x", randint(-9, 9), random.random())),
+            ('!2Hl', lambda: (randint(0, 9), randint(0, 9), randint(-9, 9))),
+        ]
+        for fmt, make in formats:
+            size = struct.calcsize(fmt)
+            n = random.randint(0, 200)
+            data = b"".join(struct.pack(fmt, *make()) for _ in xrange(n))
+            records = [struct.unpack(fmt, data[i * size:(i + 1) * size])
+                       for i in xrange(n)]
+            sample = make()
+            for field in xrange(len(sample)):
+                if isinstance(sample[field], bytes):
+                    self.assertRaises(TypeError, LazySorted.from_records,
+                                      data, fmt, field)
+                    continue
+                for reverse in [True, False]:
+                    keys = sorted([r[field] for r in records], reverse=reverse)
+                    ls = LazySorted.from_records(data, fmt, field=field,
+                                                 reverse=reverse)
+                    for _ in xrange(5):
+                        a, b = randint(-n, n), randint(-n, n)
+                        step = random.choice([1, -2, 100])
+                        rows = ls[a:b:step]
+                        self.assertEqual(
+                            [struct.unpack(fmt, rows[i:i + size])[field]
+                             for i in xrange(0, len(rows), size)],
+                            keys[a:b:step])
+                        rows = ls.between(a, b)
+                        got = [struct.unpack(fmt, rows[i:i + size])
+                               for i in xrange(0, len(rows), size)]
+                        self.assertEqual(sorted(r[field] for r in got),
+                                         sorted(keys[a:b]))
+                        for r in got:
+                            self.assertTrue(r in records)
+                    self.assertEqual([records[i][field] for i in ls], keys)
+
+        data = struct.pack('<3d', 2.5, float('nan'), 0.5)
+        ls = LazySorted.from_records(data, '<d', nan='drop')
+        self.assertEqual((list(ls), ls.nan_count), ([2, 0], 1))
+        self.assertRaises(IndexError, LazySorted.from_records, data, 'd', 1)
+        self.assertRaises(ValueError, LazySorted.from_records, data, 'ib')
+        self.assertRaises(TypeError, LazySorted.from_records, data, 'd',
+                          key=abs)
+
+    def test_from_columns(self):
+        """from_columns should order rows by their columns in turn"""
+        randint = random.randint
+        for rep in xrange(60):
+            n = random.randint(0, 200)
+            ncols = random.randint(1, 8)
+            columns = []
+            for c in xrange(ncols):
+                kind = random.choice(["int", "wide", "float", "array"])
+                if kind == "int":
+                    columns.append([randint(-3, 3) for _ in xrange(n)])
+                elif kind == "wide":
+                    columns.append([randint(-2**62, 2**62) for _ in xrange(n)])
+                elif kind == "float":
+                    columns.append([random.choice([random.random(), 0.5])
+                                    for _ in xrange(n)])
+                else:
+                    columns.append(array('d', [randint(0, 9) / 4.0
+                                               for _ in xrange(n)]))
+            descending = [random.random() < 0.5 for _ in xrange(ncols)]
+
+            def row_key(i):
+                return tuple(-col[i] if desc else col[i]
+                             for col, desc in zip(columns, descending))
+            keys = sorted(row_key(i) for i in xrange(n))
+            ls = LazySorted.from_columns(columns, descending=descending)
+            for _ in xrange(5):
+                a, b = randint(-n, n), randint(-n, n)
+                self.assertEqual([row_key(i) for i in ls[a:b]], keys[a:b])
+                k = randint(0, n)
+                if k < n:
+                    self.assertEqual(row_key(ls[k]), keys[k])
+            self.assertEqual(sorted(ls), list(xrange(n)))
+
+        # Too many distinct values to pack into one native key
+        columns = [random.sample(xrange(-2**62, 2**62, 2**50), 200)
+                   for _ in xrange(8)]
+        ls = LazySorted.from_columns(columns)
+        self.assertEqual([columns[0][i] for i in ls[:10]],
+                         sorted(columns[0])[:10])
+
+        nan = float('nan')
+        ls = LazySorted.from_columns([[1, 0, 1, 0], [nan, 2.0, 1.0, 3.0]],
+                                     descending=[False, True])
+        self.assertEqual(list(ls), [3, 1, 2, 0])
+        self.assertEqual(list(LazySorted.from_columns([[2, 1]],
+                                                      reverse=True)), [0, 1])
+        self.assertRaises(ValueError, LazySorted.from_columns, [])
+        self.assertRaises(ValueError, LazySorted.from_columns, [[1], [1, 2]])
+        self.assertRaises(ValueError, LazySorted.from_columns, [[1]],
+                          descending=[True, False])
+        self.assertRaises(TypeError, LazySorted.from_columns, [["a"]])
+        self.assertRaises(TypeError, LazySorted.from_columns, [[1]], key=abs)
+
+    def test_mask(self):
+        """Items that the mask marks as null should be dropped or moved"""
+        def bitmap(flags):
+            bits = bytearray((len(flags) + 7) // 8)
+            for i, flag in enumerate(flags):
+                if flag:
+                    bits[i >> 3] |= 1 << (i & 7)
+            return bytes(bits)
+
+        for rep in xrange(100):
+            n = random.randint(0, 200)
+            valid = [random.random() < 0.7 for _ in xrange(n)]
+            xs = [random.randint(-50, 50) for _ in xrange(n)]
+            if rep % 2:
+                xs = [x / 4.0 if v else float('nan')
+                      for x, v in zip(xs, valid)]
+            for nulls in [None, 'drop', 'first', 'last']:
+                for reverse in [True, False]:
+                    expected = sorted([x for x, v in zip(xs, valid) if v],
+                                      reverse=reverse)
+                    nc = n - len(expected)
+                    ls = LazySorted(xs, mask=bitmap(valid), nulls=nulls,
+                                    reverse=reverse, max_pivots=8)
+                    self.assertEqual(ls.null_count, nc)
+                    if nulls in [None, 'drop']:
+                        self.assertEqual(len(ls), len(expected))
+                        if expected:
+                            k = random.randrange(len(expected))
+                            self.assertEqual(ls[k], expected[k])
+                        self.assertEqual(list(ls), expected)
+                    elif nulls == 'first':
+                        self.assertEqual(ls[nc:], expected)
+                    else:
+                        self.assertEqual(ls[:len(expected)], expected)
+
+            ls = LazySorted(xrange(n), keys=array('d', xs), mask=bitmap(valid))
+            self.assertEqual([xs[i] for i in ls],
+                             sorted(x for x, v in zip(xs, valid) if v))
+
+        nan = float('nan')
+        ls = LazySorted([nan, 2.0, nan, 1.0], mask=bitmap([1, 1, 0, 1]),
+                        nan='drop')
+        self.assertEqual((list(ls), ls.nan_count, ls.null_count),
+                         ([1.0, 2.0], 1, 1))
+        self.assertEqual(LazySorted([1]).null_count, 0)
+        self.assertRaises(ValueError, LazySorted, range(9), mask=b"\xff")
+        self.assertRaises(TypeError, LazySorted, [1], nulls='last')
+        self.assertRaises(ValueError, LazySorted, [1], mask=b"\x01",
+                          nulls='middle')
+        self.assertRaises(TypeError, LazySorted, ["a"], mask=b"\x01")
+        self.assertRaises(ValueError, LazySorted, [2**63 - 1, 1],
+                          mask=b"\x01", nulls='last')
+
+        # Arrays can't hold nulls, so only dropping them works with them
+        ls = LazySorted([5, 1, 3, 9], mask=bitmap([1, 0, 0, 0]),
+                        out='array')
+        self.assertEqual(list(ls[0:4]), [5])
+        for nulls in ['first', 'last']:
+            for reverse in [False, True]:
+                self.assertRaises(TypeError, LazySorted, [5, 1, 3, 9],
+                                  mask=bitmap([1, 0, 0, 0]), nulls=nulls,
+                                  reverse=reverse, out='array')
+
+    def test_narrow_keys(self):
+        """Native keys with a small range should be stored narrowed"""
+        for lo, span, width in [(0, 200, 1), (-3, 60000, 2),
+                                (10**15, 2**32 - 1, 4), (-2**63, 2**40, 8),
+                                (-2**62, 2**63, 8)]:
+            xs = [lo + random.randint(0, span) for _ in xrange(500)]
+            xs[0], xs[1] = lo, lo + span
+            for reverse in [False, True]:
+                ls = LazySorted(xs, reverse=reverse)
+                self.assertEqual(ls.memory_usage()["native_keys"],
+                                 len(xs) * width)
+                ys = sorted(xs, reverse=reverse)
+                self.assertEqual(ls[250], ys[250])
+                self.assertEqual(ls[10:20], ys[10:20])
+                self.assertEqual(ls.between(5, 9), ys[5:9])
+                arr = LazySorted(xs, reverse=reverse, out='array')
+                self.assertEqual(list(arr.between(5, 9)), ys[5:9])
+                self.assertEqual(ls.index(ys[100]), ys.index(ys[100]))
+                self.assertEqual(list(ls), ys)
+
+        # The NaN and null sentinels don't count towards the range
+        xs = [1.0, float('nan'), 0.5, 2.0]
+        self.assertEqual(LazySorted(xs, nan='drop')[:], [0.5, 1.0, 2.0])
+        ls = LazySorted([3, 0, 1, 2], mask=b"\x0b", nulls='first')
+        self.assertEqual(ls.memory_usage()["native_keys"], 4 * 8)
+        self.assertEqual(ls[:], [1, 0, 2, 3])
+        ls = LazySorted([3, 0, 1, 2], mask=b"\x0b")
+        self.assertEqual(ls.memory_usage()["native_keys"], 3)
+        self.assertEqual(ls[:], [0, 2, 3])
+
+        weighted = LazySorted([3, 1, 2], weights=[1, 1, 2])
+        self.assertEqual(weighted.memory_usage()["native_keys"],
+                         3 + 3 * 8)
+        self.assertEqual(weighted.weighted_median(), 2)
+
+    def test_huge_pages(self):
+        """Big native arrays may be on huge pages, and work the same"""
+        for ls in [LazySorted([3, 1, 2]), LazySorted(["a", "b"])]:
+            self.assertEqual(ls.huge_pages, 0)
+            self.assertEqual(ls.huge_pages_advised, 0)
+
+        # Each of the two 4.8MB arrays is either on huge pages, (and counted
+        # as three whole 2MB pages), or it isn't
+        n = 600000
+        xs = [random.random() for _ in xrange(n)]
+        ls = LazySorted(xs, weights=[1] * n)
+        mapped = ls.huge_pages + ls.huge_pages_advised
+        self.assertTrue(mapped in (0, 6 * 2**20, 12 * 2**20))
+        self.assertEqual(ls.memory_usage()["native_keys"],
+                         mapped + (2 - mapped // (6 * 2**20)) * n * 8)
+        ys = sorted(xs)
+        for k in xrange(0, n, n // 50):
+            self.assertEqual(ls[k], ys[k])
+        ls.compact(5)
+        self.assertEqual(ls[n // 2], ys[n // 2])
+        self.assertEqual(ls.weighted_median(), ys[(n - 1) // 2])
+
+    def test_memory_usage(self):
+        """__sizeof__ should count the list, keys and pivots"""
+        xs = range(10000)
+        random.shuffle(xs)
+        ls = LazySorted(xs)
+        usage = ls.memory_usage()
+        self.assertEqual(sys.getsizeof(ls), usage["total"])
+        self.assertEqual(usage["total"],
+                         sum(v for k, v in usage.items() if k != "total"))
+        pointer = ctypes.sizeof(ctypes.c_void_p)
+        self.assertTrue(usage["items"] >= 10000 * pointer)
+        self.assertEqual(usage["native_keys"], 10000 * 2)
+        self.assertEqual(usage["keys"], 0)
+
+        before = usage["pivots"]
+        for k in xrange(0, 10000, 97):
+            ls[k]
+        self.assertTrue(ls.memory_usage()["pivots"] > before)
+
+        strs = LazySorted([str(x) for x in xs], key=lambda s: s + "x")
+        self.assertTrue(strs.memory_usage()["keys"] > 10000 *
+                        sys.getsizeof("xxxx"))
+        lazy = LazySorted([str(x) for x in xs], key=lambda s: s + "x",
+                          key_cache=0)
+        self.assertTrue(lazy.memory_usage()["keys"] <
+                        strs.memory_usage()["keys"])
+
+    def test_hash_index(self):
+        """in and count should agree with the list once it's hash indexed"""
+        for rep in xrange(50):
+            n = random.randint(0, 500)
+            xs = [random.randint(0, n // 4 + 1) for _ in xrange(n)]
+            xs += [str(x) for x in xs[:n // 10]]
+            for after in [0, 5]:
+                ls = LazySorted(xs, hash_index=after, key=hash)
+                for y in range(-2, n // 4 + 3) + ["1", "x", 1.0, None]:
+                    self.assertEqual(y in ls, y in xs)
+                    self.assertEqual(ls.count(y), xs.count(y))
+                self.assertTrue(ls.memory_usage()["hash_index"] > 0)
+                self.assertEqual(sorted(ls, key=hash), sorted(xs, key=hash))
+
+        ls = LazySorted([[1], [3], [1]], hash_index=0)
+        self.assertEqual(ls.count([1]), 2)
+        self.assertFalse([2] in ls)
+        self.assertEqual(ls.memory_usage()["hash_index"], 0)
+        self.assertEqual(LazySorted(range(5)).memory_usage()["hash_index"], 0)
+        self.assertRaises(ValueError, LazySorted, [], hash_index=-1)
+
+    def test_max_pivots(self):
+        """The pivot tree should stay within max_pivots"""
+        for n in [0, 1, 10, 100, 1000]:
+            xs = range(n)
+            random.shuffle(xs)
+            for max_pivots in [0, 1, 4, 30]:
+                ls = LazySorted(xs, max_pivots=max_pivots)
+                for _ in xrange(200):
+                    k = random.randrange(n + 1)
+                    if k < n:
+                        self.assertEqual(ls[k], k)
+                    self.assertTrue(len(ls._pivots()) - 2 <=
+                                    max_pivots + 2 * n.bit_length())
+                    self.assertEqual(sorted(ls.between(k // 2, k)),
+                                     range(k // 2, k))
+                    if k < n:
+                        self.assertEqual(ls.index(k), k)
+                self.assertEqual(list(ls), range(n))
+
+        self.assertRaises(ValueError, lambda: LazySorted([], max_pivots=-1))
+
+    def test_compact(self):
+        """compact should forget pivots without changing the contents"""
+        xs = range(5000)
+        random.shuffle(xs)
+        ls = LazySorted(xs)
+        for k in xrange(0, 5000, 7):
+            self.assertEqual(ls[k], k)
+        ls[1000:1100]
+        self.assertEqual(ls[1000:1100], range(1000, 1100))
+        before = len(ls._pivots())
+        usage = ls.memory_usage()["pivots"]
+
+        ls.compact()
+        self.assertTrue(len(ls._pivots()) - 2 <= (before - 2) // 2)
+        ls.compact(10)
+        self.assertTrue(len(ls._pivots()) - 2 <= 10)
+        self.assertTrue(ls.memory_usage()["pivots"] < usage)
+        self.assertEqual(ls[1000:1100], range(1000, 1100))
+        ls.compact(0)
+        self.assertEqual(len(ls._pivots()), 2)
+        self.assertEqual(list(ls), range(5000))
+        self.assertRaises(ValueError, lambda: ls.compact(-1))
+
+    def test_group_select(self):
+        """group_select should match selecting from each group separately"""
+        def quantile(ys, q):
+            h = q * (len(ys) - 1)
+            lo = int(h)
+            if lo + 1 < len(ys):
+                return ys[lo] + (ys[lo + 1] - ys[lo]) * (h - lo)
+            return float(ys[lo])
+
+        for rep in xrange(50):
+            ngroups = random.randint(1, 30)
+            ids = [random.choice([random.randrange(ngroups),
+                                  random.randrange(-10**15, 10**15)])
+                   if rep % 2 else random.randrange(ngroups)
+                   for _ in xrange(random.randint(1, 2000))]
+            values = [random.randint(-5, 5) if rep % 3 else random.random()
+                      for _ in ids]
+            by_group = {}
+            for value, group in zip(values, ids):
+                by_group.setdefault(group, []).append(value)
+            expected_groups = sorted(by_group)
+            for ys in by_group.values():
+                ys.sort()
+
+            groups, results = lazysorted.group_select(values, ids, [0, -1])
+            self.assertEqual(list(groups), expected_groups)
+            self.assertEqual(list(results),
+                             [y for g in expected_groups
+                              for y in (by_group[g][0], by_group[g][-1])])
+
+            qs = [0.0, 0.25, 0.5, 0.99, 1.0]
+            groups, results = lazysorted.group_select(
+                array('d', values), array('l', ids), qs)
+            self.assertEqual(list(groups), expected_groups)
+            expected = [quantile(by_group[g], q)
+                        for g in expected_groups for q in qs]
+            for x, y in zip(results, expected):
+                self.assertAlmostEqual(x, y)
+
+        self.assertEqual(map(list, lazysorted.group_select([], [], [0])),
+                         [[], []])
+        self.assertRaises(IndexError,
+                          lambda: lazysorted.group_select([1], [0], [1]))
+        self.assertRaises(ValueError,
+                          lambda: lazysorted.group_select([1], [0, 0], [0]))
+        self.assertRaises(ValueError,
+                          lambda: lazysorted.group_select([1], [0], [1.5]))
+        self.assertRaises(TypeError,
+                          lambda: lazysorted.group_select([1], [0.5], [0]))
+        self.assertRaises(TypeError,
+                          lambda: lazysorted.group_select(["a"], [0], [0]))
+
+    def test_merge_join(self):
+        """merge_join and intersect should match a nested loop join"""
+        for rep in xrange(100):
+            hi = random.choice([5, 50, 5000])
+            xs = [random.randint(0, hi) for _ in xrange(random.randint(0, 200))]
+            ys = [random.randint(0, hi) for _ in xrange(random.randint(0, 200))]
+            if rep % 3 == 0:
+                xs = [str(x) for x in xs]
+                ys = [str(y) for y in ys]
+            for reverse in [True, False]:
+                pairs = sorted([(x, y) for x in xs for y in ys if x == y],
+                               reverse=reverse)
+                a = LazySorted(xs, reverse=reverse)
+                b = LazySorted(ys, reverse=reverse)
+                self.assertEqual(list(lazysorted.merge_join(a, b)), pairs)
+                self.assertEqual(list(lazysorted.intersect(a, b)),
+                                 sorted(set(xs) & set(ys), reverse=reverse))
+                self.assertEqual(list(a), sorted(xs, reverse=reverse))
+
+        xs = [(random.randrange(20), random.random()) for _ in xrange(100)]
+        xs += [(0, 0.5), (3, 0.5)]
+        ys = range(0, 40, 3)
+        a = LazySorted(xs, key=lambda x: x[0])
+        b = LazySorted(ys, max_pivots=2)
+        joined = list(lazysorted.merge_join(a, b))
+        self.assertEqual(sorted(joined),
+                         sorted((x, y) for x in xs for y in ys if x[0] == y))
+        self.assertEqual([y for x, y in joined], sorted(y for x, y in joined))
+        self.assertEqual(list(islice(lazysorted.intersect(b, a), 2)), [0, 3])
+        self.assertRaises(ValueError, lazysorted.merge_join, a,
+                          LazySorted(ys, reverse=True))
+        self.assertRaises(TypeError, lazysorted.intersect, a, ys)
+
+    def test_median_many(self):
+        """median_many should find the median of each sequence"""
+        seqs = [[random.randint(0, 100) for _ in xrange(random.randint(1, 50))]
+                for _ in xrange(500)]
+        seqs.append(array('d', [0.5, 2.5]))
+        seqs.append((10**15, 10**15 + 2, 7))
+        medians = lazysorted.median_many(seqs)
+        self.assertEqual(len(medians), len(seqs))
+        for median, seq in zip(medians, seqs):
+            ys = sorted(seq)
+            n = len(ys)
+            self.assertEqual(median, (ys[(n - 1) // 2] + ys[n // 2]) / 2.0)
+
+        self.assertEqual(list(lazysorted.median_many([])), [])
+        self.assertRaises(ValueError, lambda: lazysorted.median_many([[]]))
+        self.assertRaises(ValueError,
+                          lambda: lazysorted.median_many([[float('nan')]]))
+
+    def test_c_api(self):
+        """The C API capsule should work like the python API"""
+        if not hasattr(lazysorted, "_C_API"):
+            return  # PyCapsules are new in python2.7
+
+        obj, n_t = ctypes.py_object, ctypes.c_ssize_t
+        func = ctypes.PYFUNCTYPE
+
+        class CAPI(ctypes.Structure):
+            _fields_ = [
+                ("version", ctypes.c_int),
+                ("Type", ctypes.c_void_p),
+                ("FromArray", func(obj, ctypes.POINTER(obj), n_t, obj,
+                                   ctypes.c_int)),
+                ("FromBuffer", func(obj, obj, ctypes.c_int)),
+                ("Select", func(obj, obj, n_t)),
+                ("SortRange", func(ctypes.c_int, obj, n_t, n_t)),
+                ("Between", func(obj, obj, n_t, n_t)),
+                ("Rank", func(n_t, obj, obj)),
+                ("Range", func(ctypes.POINTER(obj), obj, n_t, n_t,
+                               ctypes.c_int)),
+            ]
+
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [obj, ctypes.c_char_p]
+        capi = ctypes.cast(get_pointer(lazysorted._C_API,
+                                       b"lazysorted._C_API"),
+                           ctypes.POINTER(CAPI)).contents
+        self.assertEqual(capi.version, 1)
+
+        for rep in xrange(20):
+            n = random.randrange(1, 200)
+            xs = [random.randrange(n) for _ in xrange(n)]
+            for reverse in [True, False]:
+                expected = sorted(xs, reverse=reverse)
+                start = random.randrange(n)
+                stop = random.randrange(start, n + 1)
+
+                ls = capi.FromArray((obj * n)(*xs), n, None, reverse)
+                self.assertTrue(isinstance(ls, LazySorted))
+                k = random.randrange(n)
+                self.assertEqual(capi.Select(ls, k), expected[k])
+                self.assertEqual(sorted(capi.Between(ls, start, stop)),
+                                 sorted(expected[start:stop]))
+                items = capi.Range(ls, start, stop, 0)
+                self.assertEqual(sorted(items[i] for i in xrange(stop - start)),
+                                 sorted(expected[start:stop]))
+                self.assertEqual(capi.SortRange(ls, start, stop), 0)
+                items = capi.Range(ls, start, stop, 1)
+                self.assertEqual([items[i] for i in xrange(stop - start)],
+                                 expected[start:stop])
+                x = random.randrange(-1, n + 1)
+                self.assertEqual(capi.Rank(ls, x),
+                                 len([y for y in xs
+                                      if (y > x if reverse else y < x)]))
+
+                ls = capi.FromArray((obj * n)(*xs), n, lambda x: -x, reverse)
+                self.assertEqual(capi.Select(ls, k), expected[n - 1 - k])
+
+                ls = capi.FromBuffer(array('i', xs), reverse)
+                self.assertEqual(capi.Select(ls, k), expected[k])
+                self.assertEqual(list(ls), expected)
+
+        ls = LazySorted([3, 1, 2])
+        self.assertRaises(IndexError, lambda: capi.Select(ls, 3))
+        self.assertRaises(IndexError, lambda: capi.Between(ls, 2, 1))
+        self.assertRaises(IndexError, lambda: capi.SortRange(ls, -1, 2))
+        self.assertRaises(TypeError, lambda: capi.Select([3, 1, 2], 0))
+
+    def test_cpp_engine(self):
+        """The C++ engine should work with every width of index"""
+        directory = tempfile.mkdtemp()
+        try:
+            program = build_program("test_engine.cpp", directory)
+            if program is None:
+                return  # Only built with unix compilers
+            process = subprocess.Popen([program], stdout=subprocess.PIPE)
+            output = process.communicate()[0]
+            self.assertEqual(process.returncode, 0, msg=output)
+        finally:
+            shutil.rmtree(directory)
+
+    def test_stats_tool(self):
+        """lazysorted-stats should agree with sorted"""
+        # setup.py needs README.txt, which test_versions.sh generates
+        if not (os.path.exists(os.path.join(HERE, "setup.py")) and
+                os.path.exists(os.path.join(HERE, "README.txt"))):
+            return
+        directory = tempfile.mkdtemp()
+        try:
+            process = subprocess.Popen([sys.executable, "setup.py",
+                                        "build_tool", "-b", directory],
+                                       cwd=HERE, stdout=subprocess.PIPE,
+                                       stderr=subprocess.STDOUT)
+            output = process.communicate()[0]
+            self.assertEqual(process.returncode, 0, msg=output)
+            tool = os.path.join(directory, "lazysorted-stats")
+
+            def run(args, data):
+                process = subprocess.Popen([tool] + args,
+                                           stdin=subprocess.PIPE,
+                                           stdout=subprocess.PIPE,
+                                           stderr=subprocess.PIPE)
+                out, err = process.communicate(data.encode("ascii"))
+                stats = {}
+                for line in out.decode("ascii").splitlines():
+                    name, value = line.split(None, 1)
+                    stats[name] = [float(v) for v in value.split()]
+                return process.returncode, stats, err.decode("ascii")
+
+            # Big enough to be parsed and selected with several threads
+            n = 100000
+            xs = [random.gauss(0, 1) for _ in xrange(n)]
+            lines = [repr(x) for x in xs] + ["nan"]
+            numbers = os.path.join(directory, "numbers.txt")
+            f = open(numbers, "w")
+            f.write("\n".join(lines[:n // 2]) + " \t" +
+                    " ".join(lines[n // 2:]) + "\n")
+            f.close()
+
+            ys = sorted(xs)
+            status, stats, err = run(["-q", "0,0.25,0.5,0.99,1", "-k", "3",
+                                      "-t", "0.1", "-j", "4", numbers], "")
+            self.assertEqual(status, 0, msg=err)
+            self.assertEqual(stats["count"], [n])
+            self.assertEqual(stats["nans"], [1])
+            for q in [0, 0.25, 0.5, 0.99, 1]:
+                h = q * (n - 1)
+                lo = int(h)
+                expected = ys[lo]
+                if lo + 1 < n and h > lo:
+                    expected += (ys[lo + 1] - ys[lo]) * (h - lo)
+                self.assertAlmostEqual(stats["q%g" % q][0], expected)
+            self.assertEqual(stats["top3"], ys[:-4:-1])
+            cut = n // 10
+            self.assertAlmostEqual(stats["trimmed0.1"][0],
+                                   sum(ys[cut:n - cut]) / (n - 2 * cut))
+
+            # Standard input, and the defaults
+            status, stats, err = run([], "3 1\n2\n")
+            self.assertEqual(status, 0, msg=err)
+            self.assertEqual(stats, {"count": [3], "q0": [1], "q0.5": [2],
+                                     "q1": [3]})
+
+            # Bad input and arguments
+            for args, data, message in [
+                    ([], "1 2 x 3", "not a number: x"),
+                    (["-q", "2"], "1", "quantiles must be between 0 and 1"),
+                    (["-k", "0"], "1", "-k must be positive"),
+                    ([os.path.join(directory, "missing")], "", "missing")]:
+                status, stats, err = run(args, data)
+                self.assertNotEqual(status, 0)
+                self.assertTrue(message in err, msg=err)
+        finally:
+            shutil.rmtree(directory)
+
     def test_API(self):
         """The sorted(...) API should be implemented except for cmp"""
         xs = range(10)
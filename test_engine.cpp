@@ -0,0 +1,79 @@
+/* test_engine.cpp
+ *
+ * Checks the header-only engine, (lazysorted.hpp), against std::sort for
+ * each width of index, since nothing else instantiates the class template.
+ * test.py compiles and runs it; it prints the failures and exits with 1 if
+ * there are any.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <vector>
+
+#include "lazysorted.hpp"
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char *what, const char *index, int n)
+{
+    if (!ok) {
+        std::printf("FAIL: %s with %s indices, n = %d\n", what, index, n);
+        failures++;
+    }
+}
+
+template <class Index>
+void test_index(const char *name)
+{
+    const int lengths[] = {0, 1, 2, 17, 100, 1000, 20000};
+    for (std::size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        int n = lengths[l];
+        std::vector<int> xs(n);
+        for (int i = 0; i < n; i++)
+            xs[i] = std::rand() % (n / 2 + 1);
+        std::vector<int> ys(xs);
+        std::sort(ys.begin(), ys.end());
+
+        lazysorted::LazySorted<int, std::less<int>, Index> ls(xs.begin(),
+                                                              xs.end());
+        check(ls.size() == n, "size", name, n);
+
+        bool ok = true;
+        for (int k = 0; k < n; k += 1 + n / 50)
+            ok = ok && ls[static_cast<Index>(k)] == ys[k];
+        check(ok, "select", name, n);
+
+        ok = true;
+        for (int k = 0; k < n; k += 1 + n / 20) {
+            int value = ys[k];
+            Index rank = ls.rank(value);
+            ok = ok && rank == std::lower_bound(ys.begin(), ys.end(), value)
+                               - ys.begin();
+            ok = ok && ls.contains(value) && !ls.contains(-1);
+        }
+        check(ok, "rank", name, n);
+
+        ls.sort_range(static_cast<Index>(n / 4), static_cast<Index>(n / 2));
+        check(std::equal(ys.begin() + n / 4, ys.begin() + n / 2,
+                         ls.data().begin() + n / 4), "sort_range", name, n);
+
+        ls.sort_range(0, ls.size());
+        check(ls.data() == ys, "sort", name, n);
+    }
+}
+
+}  /* namespace */
+
+int main()
+{
+    std::srand(1);
+    test_index<int16_t>("int16_t");
+    test_index<int32_t>("int32_t");
+    test_index<std::ptrdiff_t>("ptrdiff_t");
+    return failures == 0 ? 0 : 1;
+}